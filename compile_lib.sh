@@ -0,0 +1,14 @@
+#! /bin/sh
+set -ex
+${CC:-gcc} -c -O2 -fPIC \
+    -W -Wall -Wextra \
+    -Werror=missing-declarations -Werror=implicit-function-declaration \
+    -ansi -pthread -DNDEBUG -DPTS_LBSEARCH_LIB=1 -DUSE_ZLIB=1 \
+    -DUSE_SERVER=0 -DUSE_SHARDS=0 -DUSE_FOLLOW=0 -DUSE_BATCH=0 -DUSE_INSERT=0 \
+    -o pts_lbsearch_lib.o ./pts_lbsearch.c
+rm -f libptslbsearch.a
+ar rcs libptslbsearch.a pts_lbsearch_lib.o
+${CC:-gcc} -shared -pthread -o libptslbsearch.so pts_lbsearch_lib.o -lz
+rm -f pts_lbsearch_lib.o
+ls -l libptslbsearch.a libptslbsearch.so
+: compile_lib.sh OK.
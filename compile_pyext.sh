@@ -0,0 +1,22 @@
+#! /bin/sh
+# Builds the CPython extension used by pts_line_bisect.py for $PYTHON.
+set -ex
+PYTHON="${PYTHON:-python}"
+INCLUDE="$("$PYTHON" -c 'import sysconfig
+print(sysconfig.get_paths()["include"])')"
+SUFFIX="$("$PYTHON" -c 'import sysconfig
+v = sysconfig.get_config_var
+print(v("EXT_SUFFIX") or v("SO"))')"
+${CC:-gcc} -c -O2 -fPIC \
+    -W -Wall -Wextra \
+    -Werror=missing-declarations -Werror=implicit-function-declaration \
+    -ansi -pthread -DNDEBUG -DPTS_LBSEARCH_LIB=1 \
+    -DUSE_SERVER=0 -DUSE_SHARDS=0 -DUSE_FOLLOW=0 -DUSE_BATCH=0 -DUSE_INSERT=0 \
+    -o pts_lbsearch_pyext.o ./pts_lbsearch.c
+${CC:-gcc} -c -O2 -fPIC -W -Wall -Wextra -fno-strict-aliasing -pthread \
+    -DNDEBUG -I"$INCLUDE" -o pts_line_bisect_ext.o ./pts_line_bisect_ext.c
+${CC:-gcc} -shared -pthread -o "pts_line_bisect_ext$SUFFIX" \
+    pts_line_bisect_ext.o pts_lbsearch_pyext.o
+rm -f pts_lbsearch_pyext.o pts_line_bisect_ext.o
+ls -l "pts_line_bisect_ext$SUFFIX"
+: compile_pyext.sh OK.
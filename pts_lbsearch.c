@@ -1,6 +1,6 @@
 #define DUMMY \
   set -ex; ${CC:-gcc} -ansi -W -Wall -Wextra -Werror=missing-declarations \
-      -s -O2 -DNDEBUG -o pts_lbsearch "$0"; : OK; exit
+      -s -O2 -DNDEBUG -DUSE_ZLIB=1 -pthread -o pts_lbsearch "$0" -lz; : OK; exit
 /*
  * pts_lbsearch.c: Fast binary search in a line-sorted text file.
  * by pts@fazekas.hu at Sat Nov 30 02:42:03 CET 2013
@@ -23,8 +23,13 @@
  *
  * Nice properties of this implementation:
  *
- * * no dynamic memory allocation (except possibly for stdio.h)
- * * no unnecessary lseek(2) or read(2) system calls
+ * * no dynamic memory allocation (except possibly for stdio.h, and for
+ *   optional features, such as the block and line cache of flag -k, and
+ *   reading BGZF files and searching shards)
+ * * no unnecessary lseek(2) or read(2) system calls (pread(2) is used if
+ *   available)
+ * * regular files are mapped to memory with mmap(2) if possible (on 64-bit
+ *   systems), and then they are searched without any system calls
  * * no unnecessary comparisons for long strings
  * * very small memory usage: only a few dozen of offsets and flags in addition
  *   to a single file read buffer (of 8K by default)
@@ -46,6 +51,11 @@
 #define _FILE_OFFSET_BITS 64
 #endif
 
+#if defined(__linux__) && !defined(__XTINY__) && !defined(_GNU_SOURCE)
+/* For syscall(2), posix_fadvise(2) etc., even with -ansi. */
+#define _GNU_SOURCE 1
+#endif
+
 #ifdef __XTINY__
 #include <xtiny.h>
 #undef  assert
@@ -64,10 +74,237 @@
 #include <stdio.h>  /* Not strictly needed. */
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #endif
 
+/* mmap(2) is used for reading regular files if available. */
+#ifndef YF_USE_MMAP
+#if defined(__XTINY__) || defined(__MSDOS__) || defined(_WIN32) || \
+    defined(_WIN64)
+#define YF_USE_MMAP 0
+#else
+#define YF_USE_MMAP 1
+#endif
+#endif
+
+#if YF_USE_MMAP
+#include <sys/mman.h>
+#endif
+
+/* sendfile(2) and copy_file_range(2) are used for printing large ranges. */
+#ifndef USE_KERNEL_COPY
+#if defined(__linux__) && !defined(__XTINY__)
+#define USE_KERNEL_COPY 1
+#else
+#define USE_KERNEL_COPY 0
+#endif
+#endif
+
+#if USE_KERNEL_COPY
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+
+/* posix_fadvise(2) is used for prefetching with flag -h. */
+#ifndef YF_USE_FADVISE
+#if defined(__linux__) && !defined(__XTINY__)
+#define YF_USE_FADVISE 1
+#else
+#define YF_USE_FADVISE 0
+#endif
+#endif
+
+/* O_DIRECT is used for printing large ranges without polluting the page
+ * cache (flag -d).
+ */
+#ifndef YF_USE_DIRECT
+#if defined(__linux__) && !defined(__XTINY__) && defined(O_DIRECT)
+#define YF_USE_DIRECT 1
+#else
+#define YF_USE_DIRECT 0
+#endif
+#endif
+
+#if YF_USE_DIRECT && !YF_USE_FADVISE
+#error YF_USE_DIRECT needs YF_USE_FADVISE.
+#endif
+
+/* pread(2) is used for reading, so threads can share a file descriptor. */
+#ifndef YF_USE_PREAD
+#if defined(__XTINY__) || defined(__MSDOS__) || defined(_WIN32) || \
+    defined(_WIN64)
+#define YF_USE_PREAD 0
+#else
+#define YF_USE_PREAD 1
+#endif
+#endif
+
+/* mkstemp(3) is used for creating temporary files. */
+#ifndef USE_MKSTEMP
+#if defined(__XTINY__) || defined(__MSDOS__) || defined(_WIN32) || \
+    defined(_WIN64)
+#define USE_MKSTEMP 0
+#else
+#define USE_MKSTEMP 1
+#endif
+#endif
+
+/* Server (flag -S) and client (flag -z) over a Unix domain socket. */
+#ifndef USE_SERVER
+#if defined(__linux__) && !defined(__XTINY__)
+#define USE_SERVER 1
+#else
+#define USE_SERVER 0
+#endif
+#endif
+
+#if USE_SERVER
+#if !YF_USE_PREAD
+#error USE_SERVER needs YF_USE_PREAD.
+#endif
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+/* Searching many shards in parallel threads (flag -M). */
+#ifndef USE_SHARDS
+#if defined(__XTINY__) || defined(__MSDOS__) || defined(_WIN32) || \
+    defined(_WIN64)
+#define USE_SHARDS 0
+#else
+#define USE_SHARDS 1
+#endif
+#endif
+
+#if USE_SHARDS
+#include <glob.h>
+#include <pthread.h>
+#endif
+
+/* Batch lookup of a key file in parallel threads (flag -B). */
+#ifndef USE_BATCH
+#if defined(__XTINY__) || defined(__MSDOS__) || defined(_WIN32) || \
+    defined(_WIN64)
+#define USE_BATCH 0
+#else
+#define USE_BATCH 1
+#endif
+#endif
+
+#if USE_BATCH
+#if !YF_USE_PREAD
+#error USE_BATCH needs YF_USE_PREAD.
+#endif
+#include <pthread.h>
+#endif
+
+/* Merge-insert of new lines to the sorted file (flag -N). */
+#ifndef USE_INSERT
+#if defined(__XTINY__) || defined(__MSDOS__) || defined(_WIN32) || \
+    defined(_WIN64)
+#define USE_INSERT 0
+#else
+#define USE_INSERT 1
+#endif
+#endif
+
+#if USE_INSERT
+#include <sys/file.h>
+#endif
+
+/* inotify(7) is used for following appends to the file (flag -f). */
+#ifndef USE_FOLLOW
+#if defined(__linux__) && !defined(__XTINY__)
+#define USE_FOLLOW 1
+#else
+#define USE_FOLLOW 0
+#endif
+#endif
+
+#if USE_FOLLOW
+#include <sys/inotify.h>
+#endif
+
+/* A shared memory file is used for caching the top levels of the bisection
+ * across processes (flag -H).
+ */
+#ifndef USE_SHM_CACHE
+#if defined(__linux__) && !defined(__XTINY__)
+#define USE_SHM_CACHE 1
+#else
+#define USE_SHM_CACHE 0
+#endif
+#endif
+
+#if USE_SHM_CACHE
+#include <sys/mman.h>
+#endif
+
+/* io_uring(7) is used for k-ary search (flag -K), with raw system calls. */
+#ifndef USE_IO_URING
+#if defined(__linux__) && !defined(__XTINY__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define USE_IO_URING 1
+#endif
+#endif
+#endif
+#ifndef USE_IO_URING
+#define USE_IO_URING 0
+#endif
+
+#if USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+/* zlib is used for reading and writing BGZF files (flag -Z). Off by
+ * default, because it needs -lz.
+ */
+#ifndef USE_ZLIB
+#define USE_ZLIB 0
+#endif
+
+#if USE_ZLIB
+#include <zlib.h>
+#endif
+
+/* The library API in pts_lbsearch.h, for embedding. With
+ * -DPTS_LBSEARCH_LIB=1, main is omitted, see compile_lib.sh.
+ */
+#ifndef PTS_LBSEARCH_LIB
+#define PTS_LBSEARCH_LIB 0
+#endif
+#ifndef USE_LIBRARY
+#if PTS_LBSEARCH_LIB || (defined(__linux__) && !defined(__XTINY__))
+#define USE_LIBRARY 1
+#else
+#define USE_LIBRARY 0
+#endif
+#endif
+
+#if PTS_LBSEARCH_LIB && !USE_LIBRARY
+#error PTS_LBSEARCH_LIB needs USE_LIBRARY.
+#endif
+#if USE_LIBRARY && !YF_USE_PREAD
+#error USE_LIBRARY needs YF_USE_PREAD.
+#endif
+#if USE_LIBRARY
+#include <setjmp.h>
+#include "pts_lbsearch.h"
+#else  /* The error codes are used by die*. */
+#define PTS_LBSEARCH_EIO (-1)
+#define PTS_LBSEARCH_ENOMEM (-2)
+#define PTS_LBSEARCH_EFORMAT (-3)
+#define PTS_LBSEARCH_EINVAL (-4)
+#define PTS_LBSEARCH_ECALLBACK (-5)
+#endif
+
 /* Win32 compatibility */
 /* TODO(pts): Verify that it works on Win32. */
 #ifndef O_BINARY
@@ -75,13 +312,15 @@
 #endif
 
 #ifndef STATIC
+#if PTS_LBSEARCH_LIB  /* Some functions are used only by main. */
+#define STATIC static __attribute__((unused))
+#else
 #define STATIC static
 #endif
+#endif
 
 typedef char ybool;
 
-#define YF_READ_BUF_SIZE 8192  /* Must be a power of 2. */
-
 /* --- Buffered, seekable file reader.
  *
  * We implement our own optimized buffered file reader, which makes sure that
@@ -90,7 +329,8 @@ typedef char ybool;
  */
 
 #ifndef YF_READ_BUF_SIZE
-/* Sensible values are 4096, 8192, 16384 and 32768.
+/* Must be a power of 2, at least 64 (LBIDX_HEADER_SIZE).
+ * Sensible values are 4096, 8192, 16384 and 32768.
  * Larger values most probably don't make the program measurably faster.
  */
 #define YF_READ_BUF_SIZE 8192
@@ -107,22 +347,142 @@ struct AssertYfReadBufSizeIsSmall_Struct {
       YF_READ_BUF_SIZE + 0ULL;
 };
 
+struct ycache;
+struct ybgzf;
+
+/* Phases of a query, for timing with flag -v. */
+typedef enum ystats_phase_t {
+  YS_OPEN,  /* Opening the file (and the index), flag -i. */
+  YS_START,  /* Bisection for the start offset. */
+  YS_END,  /* Bisection for the end offset. */
+  YS_PRINT,  /* Printing the results. */
+  YS_PHASE_COUNT,
+} ystats_phase_t;
+
+/* Statistics of a yfile, printed by flag -v. */
+typedef struct ystats {
+  ybool is_on;  /* Flag -v. If false, then phases are not timed. */
+  long long last_usec;  /* Time at the end of the previous phase. */
+  long long usec[YS_PHASE_COUNT];  /* Wall-clock time spent in each phase. */
+  off_t read_bytes;
+  unsigned long read_count;  /* read(2) or pread(2) calls. */
+  unsigned long lseek_count;
+  unsigned long copy_count;  /* copy_file_range(2) or sendfile(2) calls. */
+  unsigned long prefetch_count;  /* posix_fadvise(2) calls (flag -h). */
+  unsigned long inflate_count;  /* BGZF blocks decompressed. */
+  unsigned long probe_count;  /* Probes in bisect_way (and flag -K rounds). */
+  unsigned long kary_round_count;  /* io_uring rounds of flag -K. */
+  unsigned long compare_count;  /* compare_line calls. */
+  /* Lookups in get_using_cache and get_fofs_using_cache. */
+  unsigned long cache_hit_count, cache_miss_count;
+  unsigned long line_hit_count, block_hit_count;  /* Flag -k. */
+  unsigned long shm_hit_count;  /* Probes answered by flag -H. */
+} ystats;
+
 typedef struct yfile {
   char *p;
-  /* Invariant: *yf->rend == '\0'. */
   char *rend;
+  /* The window of file contents available in memory: either rbuf, a block
+   * in the block cache or the entire mapped file. Invariant:
+   * buf <= p <= rend, or p is at the forgotten position (YF_FORGOTTEN(yf)).
+   */
+  char *buf;
   int fd;
-  off_t ofs;  /* File offset at the beginning of rbuf. */
+  off_t ofs;  /* File offset at the beginning of buf. */
   off_t size;
+  off_t fdofs;  /* File offset of fd, or -1 if unknown. Unused by pread. */
+  struct ycache *cache;  /* Block and line cache, or NULL. */
+  ybool is_borrowed;  /* fd and map are owned by another yfile. */
+  /* Flag -w: length of each line (record) including the '\n', or 0 if the
+   * lines are not known to be fixed-width.
+   */
+  off_t reclen;
+  ystats stats;
+#if YF_USE_MMAP
+  char *map;  /* The whole file mapped to memory, or NULL if not mapped. */
+  size_t map_size;
+#endif
+#if USE_ZLIB
+  /* If not NULL, then fd is a BGZF file, and yf reads its uncompressed
+   * contents, and size and offsets are uncompressed.
+   */
+  struct ybgzf *bgzf;
+#endif
+#if YF_USE_DIRECT
+  /* Flag -d: print large ranges without polluting the page cache, reading
+   * them from direct_fd (opened with O_DIRECT), or if it's -1, dropping the
+   * pages read with posix_fadvise(2).
+   */
+  ybool is_cold;
+  int direct_fd;
+#endif
   char rbuf[YF_READ_BUF_SIZE + 2];
 } yfile;
 
-STATIC __attribute__((noreturn)) void die5_code(
+/* In the forgotten position, there is no file content in memory. */
+#define YF_FORGOTTEN(yf) ((yf)->rbuf + YF_READ_BUF_SIZE + 1)
+
+#if YF_USE_MMAP
+#define YF_IS_MAPPED(yf) ((yf)->map != NULL)
+#else
+#define YF_IS_MAPPED(yf) 0
+#endif
+
+#if USE_ZLIB
+#define YF_IS_COMPRESSED(yf) ((yf)->bgzf != NULL)
+#else
+#define YF_IS_COMPRESSED(yf) 0
+#endif
+
+#if USE_LIBRARY
+/* Where die* jumps to instead of exit(2), in library functions. */
+typedef struct ycatch {
+  jmp_buf jb;
+  volatile int code;  /* PTS_LBSEARCH_E... */
+  volatile int saved_errno;
+  struct ycatch *prev;
+} ycatch;
+
+/* The innermost active ycatch of the thread, or NULL. */
+static __thread ycatch *ycatch_current;
+static __thread char yerror_msg[256];
+
+/* Sets the error message, and returns code. */
+STATIC int yerror(int code, const char *msg) {
+  strncpy(yerror_msg, msg, sizeof(yerror_msg) - 1);
+  return code;
+}
+#endif
+
+#if USE_LIBRARY
+/* Appends msg to yerror_msg at i (truncating). Returns the new end. */
+STATIC size_t yerror_append(size_t i, const char *msg) {
+  for (; *msg && i < sizeof(yerror_msg) - 1; ++msg) yerror_msg[i++] = *msg;
+  yerror_msg[i] = '\0';
+  return i;
+}
+#endif
+
+/* Prints the message (msg5 is the terminator) and exits with exit_code. In
+ * library functions, it jumps to ycatch_current with error_code instead.
+ */
+STATIC __attribute__((noreturn)) void die5_error(
     const char *msg1, const char *msg2, const char *msg3, const char *msg4,
-    const char *msg5, int exit_code) {
+    const char *msg5, int exit_code, int error_code) {
   const size_t msg1_size = strlen(msg1), msg2_size = strlen(msg2);
   const size_t msg3_size = strlen(msg3), msg4_size = strlen(msg4);
   const size_t msg5_size = strlen(msg5);  /* !! */
+#if USE_LIBRARY
+  if (ycatch_current) {
+    ycatch_current->saved_errno = errno;
+    ycatch_current->code = error_code;
+    yerror_append(yerror_append(yerror_append(yerror_append(
+        0, msg1), msg2), msg3), msg4);
+    longjmp(ycatch_current->jb, 1);
+  }
+#else
+  (void)error_code;
+#endif
   (void)!write(STDERR_FILENO, msg1, msg1_size);
   (void)!write(STDERR_FILENO, msg2, msg2_size);
   (void)!write(STDERR_FILENO, msg3, msg3_size);
@@ -131,24 +491,55 @@ STATIC __attribute__((noreturn)) void die5_code(
   exit(exit_code);
 }
 
+STATIC __attribute__((noreturn)) void die5_code(
+    const char *msg1, const char *msg2, const char *msg3, const char *msg4,
+    const char *msg5, int exit_code) {
+  die5_error(msg1, msg2, msg3, msg4, msg5, exit_code,
+             exit_code == 1 ? PTS_LBSEARCH_EINVAL : PTS_LBSEARCH_EFORMAT);
+}
+
 STATIC __attribute__((noreturn)) void die2_strerror(
     const char *msg1, const char *msg2) {
-  die5_code(msg1, msg2, ": ", strerror(errno), "\n", 2);
+  die5_error(msg1, msg2, ": ", strerror(errno), "\n", 2, PTS_LBSEARCH_EIO);
 }
 
 STATIC __attribute__((noreturn)) void die1(const char *msg1) {
   die5_code(msg1, "", "", "", "\n", 2);
 }
 
-/** Constructor. Opens and initializes yf.
- * If size != (off_t)-1, then it will be imposed as a limit.
+STATIC __attribute__((noreturn)) void die1_nomem(const char *msg1) {
+  die5_error(msg1, "", "", "", "\n", 2, PTS_LBSEARCH_ENOMEM);
+}
+
+#if YF_USE_MMAP
+/* Tries to map the whole file to memory (the first size bytes of it). Does
+ * nothing on failure, the reader will fall back to read(2).
  */
-STATIC void yfopen(yfile *yf, const char *pathname, off_t size) {
-  int fd = open(pathname, O_RDONLY | O_BINARY, 0);
-  if (fd < 0) {
-    die2_strerror("error: open ", pathname);
-    exit(2);
+STATIC void yfmap(yfile *yf) {
+  struct stat st;
+  void *map;
+  /* On 32-bit systems the address space is too small for large files. */
+  if (sizeof(char*) < 8 || sizeof(size_t) < sizeof(off_t) || yf->size <= 0) {
+    return;
   }
+  if (fstat(yf->fd, &st) != 0 || !S_ISREG(st.st_mode)) return;
+  if (st.st_size < yf->size) return;
+  map = mmap(NULL, (size_t)yf->size, PROT_READ, MAP_SHARED, yf->fd, 0);
+  if (map == MAP_FAILED) return;
+  yf->map = yf->buf = (char*)map;
+  yf->map_size = (size_t)yf->size;
+  yf->ofs = 0;
+  yf->p = yf->buf;
+  yf->rend = yf->buf + yf->map_size;
+}
+#endif
+
+/** Constructor. Initializes yf to read from fd, and takes ownership of fd.
+ * If size != (off_t)-1, then it will be imposed as a limit.
+ * If the file is a regular file (and mmap(2) is enabled), then it will be
+ * mapped to memory, and read(2) won't be called.
+ */
+STATIC void yfopen_fd(yfile *yf, int fd, off_t size) {
   if (size == -1) {
     size = lseek(fd, 0, SEEK_END);
     if (size + 1ULL == 0ULL) {
@@ -159,20 +550,182 @@ STATIC void yfopen(yfile *yf, const char *pathname, off_t size) {
       }
     }
   }
-  yf->p = yf->rend = yf->rbuf + YF_READ_BUF_SIZE + 1;
-  *yf->p = '\0';
-  yf->p[-1] = '\0';
+  yf->buf = yf->rbuf;
+  yf->p = yf->rend = YF_FORGOTTEN(yf);
   yf->fd = fd;
   yf->size = size;
+  yf->fdofs = -1;
+  yf->cache = NULL;
+  yf->is_borrowed = 0;
+  yf->reclen = 0;
+  memset(&yf->stats, '\0', sizeof(yf->stats));
+  yf->ofs = -(YF_READ_BUF_SIZE + 1);  /* So yftell(f) would return 0. */
+#if USE_ZLIB
+  yf->bgzf = NULL;
+#endif
+#if YF_USE_DIRECT
+  yf->is_cold = 0;
+  yf->direct_fd = -1;
+#endif
+#if YF_USE_MMAP
+  yf->map = NULL;
+  yfmap(yf);
+#endif
+}
+
+#if USE_ZLIB
+STATIC void ybgzf_dup(yfile *yf, const yfile *src);
+STATIC void ybgzf_free(yfile *yf);
+STATIC void yfopen_bgzf(yfile *yf, const char *pathname);
+#endif
+
+#if USE_SERVER || USE_LIBRARY || USE_BATCH
+/** Constructor. Initializes yf to read the same file as src, with its own
+ * read buffer and position, sharing the file descriptor (read with pread(2))
+ * and the memory mapping of src. src must outlive yf.
+ */
+STATIC void yfopen_dup(yfile *yf, const yfile *src) {
+  yf->buf = yf->rbuf;
+  yf->p = yf->rend = YF_FORGOTTEN(yf);
+  yf->fd = src->fd;
+  yf->size = src->size;
+  yf->fdofs = -1;
+  yf->cache = NULL;
+  yf->is_borrowed = 1;
+  yf->reclen = src->reclen;
+  memset(&yf->stats, '\0', sizeof(yf->stats));
+  yf->ofs = -(YF_READ_BUF_SIZE + 1);  /* So yftell(f) would return 0. */
+#if YF_USE_MMAP
+  if ((yf->map = src->map) != NULL) {
+    yf->map_size = src->map_size;
+    yf->buf = yf->p = yf->map;
+    yf->ofs = 0;
+    yf->rend = yf->buf + (size_t)yf->size;
+  }
+#endif
+#if USE_ZLIB
+  yf->bgzf = NULL;
+  if (src->bgzf) ybgzf_dup(yf, src);
+#endif
+#if YF_USE_DIRECT
+  yf->is_cold = src->is_cold;
+  yf->direct_fd = src->direct_fd;
+#endif
+}
+#endif
+
+#if YF_USE_MMAP && USE_LIBRARY
+/** Constructor. Initializes yf to read buf[:size] in memory, as if it was a
+ * mapped file without a file descriptor. buf must outlive yf.
+ */
+STATIC void yfopen_memory(yfile *yf, const char *buf, off_t size) {
+  yf->map = yf->buf = yf->p = (char*)(size == 0 ? "" : buf);
+  yf->map_size = (size_t)size;
+  yf->rend = yf->buf + yf->map_size;
+  yf->ofs = 0;
+  yf->fd = -1;
+  yf->size = size;
+  yf->fdofs = -1;
+  yf->cache = NULL;
+  yf->is_borrowed = 1;  /* Don't unmap buf. */
+  yf->reclen = 0;
+  memset(&yf->stats, '\0', sizeof(yf->stats));
+#if USE_ZLIB
+  yf->bgzf = NULL;
+#endif
+#if YF_USE_DIRECT
+  yf->is_cold = 0;
+  yf->direct_fd = -1;
+#endif
+}
+#endif
+
+#if USE_IO_URING || USE_ZLIB || USE_FOLLOW
+/* Unmaps yf if it was mapped, so that it will be read with read(2) (or
+ * pread(2)) through the read buffer.
+ */
+STATIC void yfunmap(yfile *yf) {
+#if YF_USE_MMAP
+  if (!yf->map) return;
+  if (!yf->is_borrowed) munmap(yf->map, yf->map_size);
+  yf->map = NULL;
+  yf->buf = yf->rbuf;
+  yf->p = yf->rend = YF_FORGOTTEN(yf);
   yf->ofs = -(YF_READ_BUF_SIZE + 1);  /* So yftell(f) would return 0. */
+#else
+  (void)yf;
+#endif
+}
+#endif
+
+/** Constructor. Opens and initializes yf.
+ * If size != (off_t)-1, then it will be imposed as a limit.
+ */
+STATIC void yfopen(yfile *yf, const char *pathname, off_t size) {
+  int fd = open(pathname, O_RDONLY | O_BINARY, 0);
+  if (fd < 0) {
+    die2_strerror("error: open ", pathname);
+    exit(2);
+  }
+  yfopen_fd(yf, fd, size);
+#if USE_ZLIB
+  if (size == -1) yfopen_bgzf(yf, pathname);
+#endif
+}
+
+#if YF_USE_DIRECT
+/** Constructor. Like yfopen(yf, pathname, (off_t)-1), but yf will print
+ * large ranges without polluting the page cache (flag -d). Bisection still
+ * reads through the page cache, but without readahead (also for detecting
+ * BGZF), so it reads only a few blocks.
+ */
+STATIC void yfopen_cold(yfile *yf, const char *pathname) {
+  const int fd = open(pathname, O_RDONLY | O_BINARY, 0);
+  if (fd < 0) die2_strerror("error: open ", pathname);
+  yfopen_fd(yf, fd, (off_t)-1);
+  (void)!posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+#if YF_USE_MMAP
+  if (yf->map) (void)!madvise(yf->map, yf->map_size, MADV_RANDOM);
+#endif
+#if USE_ZLIB
+  yfopen_bgzf(yf, pathname);
+  if (YF_IS_COMPRESSED(yf)) return;  /* Large ranges are inflated anyway. */
+#endif
+  yf->is_cold = 1;
+  /* Fails with EINVAL on filesystems which don't support O_DIRECT. */
+  yf->direct_fd = open(pathname, O_RDONLY | O_DIRECT, 0);
 }
+#endif
+
+STATIC void ycache_free(struct ycache *cache);
 
 STATIC void yfclose(yfile *yf) {
+  if (yf->cache) {
+    ycache_free(yf->cache);
+    yf->cache = NULL;
+  }
+#if YF_USE_MMAP
+  if (yf->map) {
+    if (!yf->is_borrowed) munmap(yf->map, yf->map_size);
+    yf->map = NULL;
+  }
+#endif
+#if USE_ZLIB
+  if (yf->bgzf) ybgzf_free(yf);
+#endif
   if (yf->fd >= 0) {
-    close(yf->fd);
+    if (!yf->is_borrowed) close(yf->fd);
     yf->fd = -1;
   }
-  yf->p = yf->rend = yf->rbuf + YF_READ_BUF_SIZE + 1;
+#if YF_USE_DIRECT
+  if (yf->direct_fd >= 0) {
+    if (!yf->is_borrowed) close(yf->direct_fd);
+    yf->direct_fd = -1;
+  }
+  yf->is_cold = 0;
+#endif
+  yf->buf = yf->rbuf;
+  yf->p = yf->rend = YF_FORGOTTEN(yf);
   yf->size = 0;
   yf->ofs = -(YF_READ_BUF_SIZE + 1);  /* So yftell(f) would return 0. */
 }
@@ -181,9 +734,11 @@ STATIC void yfclose(yfile *yf) {
 /* Constructor. Opens a file which always returns EOF. */
 STATIC void yfopen_devnull(yfile *yf) {
   yf->fd = -1;
+  yf->cache = NULL;
+#if YF_USE_MMAP
+  yf->map = NULL;
+#endif
   yfclose(yf);
-  *yf->p = '\0';
-  yf->p[-1] = '\0';
 }
 #endif
 
@@ -193,7 +748,7 @@ STATIC off_t yfgetsize(yfile *yf) {
 
 #if 0
 STATIC off_t yftell(yfile *yf) {
-  return yf->p - yf->rbuf + yf->ofs;
+  return yf->p - yf->buf + yf->ofs;
 }
 #endif
 
@@ -202,33 +757,82 @@ STATIC off_t yflimit(yfile *yf, off_t size) {
   if (size + 0ULL < yf->size + 0ULL) {
     yf->size = size;
     /* Fix up yf->p and yf->rend if they are too large. */
-    if (yf->rend - yf->rbuf + yf->ofs + 0ULL > yf->size + 0ULL &&
-        yf->p != yf->rbuf + YF_READ_BUF_SIZE + 1) {
-      if (yf->p - yf->rbuf + yf->ofs + 0ULL > yf->size + 0ULL) {
+    if (YF_IS_MAPPED(yf)) {
+      yf->rend = yf->buf + (size_t)size;
+      if (yf->p > yf->rend) yf->p = yf->rend;
+    } else if (yf->rend - yf->buf + yf->ofs + 0ULL > yf->size + 0ULL &&
+               yf->p != YF_FORGOTTEN(yf)) {
+      if (yf->p - yf->buf + yf->ofs + 0ULL > yf->size + 0ULL) {
         /* TODO(pts): Do it without dropping all the caches. */
-        ofs = yf->p - yf->rbuf + yf->ofs;
-        yf->p = yf->rend = yf->rbuf + YF_READ_BUF_SIZE + 1;
+        ofs = yf->p - yf->buf + yf->ofs;
+        yf->buf = yf->rbuf;
+        yf->p = yf->rend = YF_FORGOTTEN(yf);
         yf->ofs = ofs - (YF_READ_BUF_SIZE + 1);
       } else {
-        yf->rend = yf->size - yf->ofs + yf->rbuf;  /* Make it smaller. */
-        *yf->rend = '\0';
+        yf->rend = yf->size - yf->ofs + yf->buf;  /* Make it smaller. */
       }
     }
   }
   return yf->size;
 }
 
+#if USE_FOLLOW
+/* Increases the size of yf (not mapped) to size, after the file has grown.
+ * The read buffer is forgotten, because its end may be limited by the old
+ * size. Flag -w is turned off, because the new lines were not checked.
+ */
+STATIC void yfgrow(yfile *yf, off_t size) {
+  assert(!YF_IS_MAPPED(yf));
+  if (size + 0ULL > yf->size + 0ULL) {
+    yf->size = size;
+    yf->buf = yf->rbuf;
+    yf->p = yf->rend = YF_FORGOTTEN(yf);
+    yf->ofs = -(YF_READ_BUF_SIZE + 1);  /* So yftell(f) would return 0. */
+    yf->reclen = 0;
+  }
+}
+#endif
+
+/* Returns the wall-clock time in microseconds. */
+STATIC long long get_usec(void) {
+#ifdef __XTINY__
+  return 0;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+#endif
+}
+
+/* Adds the time elapsed since the end of the previous phase to phase. */
+STATIC void ystats_mark(ystats *st, ystats_phase_t phase) {
+  long long now;
+  if (!st->is_on) return;
+  now = get_usec();
+  st->usec[phase] += now - st->last_usec;
+  st->last_usec = now;
+}
+
+/* Clears the counters, and starts timing if is_on. */
+STATIC void ystats_reset(ystats *st, ybool is_on) {
+  memset(st, '\0', sizeof(*st));
+  if ((st->is_on = is_on)) st->last_usec = get_usec();
+}
+
 /* It's possible to seek beyond the file size. */
 STATIC void yfseek_set(yfile *yf, off_t ofs) {
-  char * const rbuf1 = yf->rbuf + YF_READ_BUF_SIZE + 1;
   assert(ofs >= 0);
   /* TODO(pts): Convert off_t to its unsigned equivalent? + 0U doesn't seem to
    * make a difference. + 0ULL seems to solve it.
    */
-  if (yf->p != rbuf1 && ofs - yf->ofs + 0ULL <= yf->rend - yf->rbuf + 0ULL) {
-    yf->p = ofs - yf->ofs + yf->rbuf;
+  if (yf->p != YF_FORGOTTEN(yf) &&
+      ofs - yf->ofs + 0ULL <= yf->rend - yf->buf + 0ULL) {
+    yf->p = ofs - yf->ofs + yf->buf;
+  } else if (YF_IS_MAPPED(yf)) {  /* Beyond EOF, yfgetc will return -1. */
+    yf->p = yf->rend;
   } else {  /* Forget about the cached read buffer. */
-    yf->p = yf->rend = rbuf1;
+    yf->buf = yf->rbuf;
+    yf->p = yf->rend = YF_FORGOTTEN(yf);
     yf->ofs = ofs - (YF_READ_BUF_SIZE + 1);
   }
 }
@@ -237,82 +841,616 @@ STATIC void yfseek_cur(yfile *yf, off_t ofs) {
   if (ofs + 0ULL <= yf->rend - yf->p + 0ULL) {  /* Shortcut for ofs >= 0. */
     yf->p += ofs;
   } else {
-    yfseek_set(yf, yf->p - yf->rbuf + yf->ofs + ofs);
+    yfseek_set(yf, yf->p - yf->buf + yf->ofs + ofs);
   }
 }
 
 /** Fast macro for yfgetc. */
-#define YFGETCHAR(yf) (*(yf)->p == '\0' ? yfgetc(yf) : \
+#define YFGETCHAR(yf) ((yf)->p == (yf)->rend ? yfgetc(yf) : \
     (int)*(unsigned char*)(yf)->p++)
 
 /** Can only be called after a getchar returning non-EOF. */
 #define YFUNGET(yf) ((void)--(yf)->p)
 
-/** Returns -1 on EOF, or 0..255. */
-STATIC int yfgetc(yfile *yf) {
-  if (yf->p == yf->rend) {
-    off_t a = yf->p - yf->rbuf + yf->ofs, b;  /* a = yftell(yf); */
-    int got, need;
-    if (a + 0ULL >= yf->size + 0ULL) return -1;  /* EOF. */
-    /* YF_READ_BUF_SIZE must be a power of 2 for this below. */
-    b = a & -YF_READ_BUF_SIZE;
-    yf->p = a - b + yf->rbuf;
-    if (yf->ofs != b) {
-      a = lseek(yf->fd, b, SEEK_SET);
-      if (a + 1ULL == 0ULL) {
-        if (errno == ESPIPE) {
-          die1("error: input not seekable, cannot binary search");
-        } else {
-          die2_strerror("error: lseek set", "");  /* !! merge */
-        }
-        exit(2);
-      }
-      if (a != b) {  /* Should not happen. */
-        die2_strerror("error: lseek set offset", "");
-        exit(2);
+/* Reads up to size bytes at file offset ofs of the file descriptor of yf
+ * to dst. Uses pread(2) if available, otherwise lseek(2) (only if needed)
+ * and read(2). Returns the number of bytes read, or -1 on error.
+ */
+STATIC int yfpread_fd(yfile *yf, char *dst, int size, off_t ofs) {
+  int got;
+  ++yf->stats.read_count;
+#if YF_USE_PREAD
+  got = pread(yf->fd, dst, size, ofs);
+#else
+  off_t a;
+  if (yf->fdofs != ofs) {
+    ++yf->stats.lseek_count;
+    a = lseek(yf->fd, ofs, SEEK_SET);
+    if (a + 1ULL == 0ULL) {
+      if (errno == ESPIPE) {
+        die1("error: input not seekable, cannot binary search");
+      } else {
+        die2_strerror("error: lseek set", "");  /* !! merge */
       }
-      yf->ofs = b;
-    }
-    need = b + YF_READ_BUF_SIZE + 0ULL > yf->size + 0ULL ?
-        yf->size - b : YF_READ_BUF_SIZE;
-    got = yf->fd < 0 ? 0 : read(yf->fd, yf->rbuf, need);
-    if (got < 0) {
-      die2_strerror("error: read", "");
-    }
-    *(yf->rend = yf->rbuf + got) = '\0';
-    b += got;
-    if (got < need && b + 0ULL < yf->size + 0ULL) {
-      yf->size = b;
+      exit(2);
     }
-    if (b + 0ULL <= a + 0ULL) {  /* yf->p is past the buffer. */
-      yf->p = yf->rend;
-      return -1;  /* EOF. */
+    if (a != ofs) {  /* Should not happen. */
+      die2_strerror("error: lseek set offset", "");
+      exit(2);
     }
+    yf->fdofs = ofs;
   }
-  return *(unsigned char*)yf->p++;
+  got = read(yf->fd, dst, size);
+  yf->fdofs = got < 0 ? -1 : yf->fdofs + got;
+#endif
+  if (got > 0) yf->stats.read_bytes += got;
+  return got;
 }
 
-/* If len <= 0 or at EOF, just returns 0. Otherwise, it makes sure that the
- * read buffer of yf contains it least 1 byte available (by calling
- * yfgetc(yf) if needed), and returns min(available, len), thus the return
- * value is at least 1. Also sets *buf_out so that (*buf_out[:result]) is
- * the next available bytes with the read buffer. It doesn't skip over these
- * bytes though, the caller can do it by yfseek_cur(yf, result) later.
- */
-STATIC int yfpeek(yfile *yf, off_t len, const char **buf_out) {
-  int available;
-  if (len <= 0) return 0;
-  available = yf->rend - yf->p;  /* This fits to an int. */
-  if (available <= 0 && yfgetc(yf) >= 0) {
-    --yf->p;  /* YFUNGET(yf). */
-    available = yf->rend - yf->p;
-  }
-  *buf_out = yf->p;
-  return len + 0ULL > available + 0ULL ? available : (int)len;
+STATIC void put_u64le(char *p, off_t v) {
+  unsigned long long u = v;
+  int i;
+  for (i = 0; i < 8; ++i, u >>= 8) p[i] = (char)(u & 255);
 }
 
-/* --- Bisection (binary search)
- *
+STATIC off_t get_u64le(const char *p) {
+  unsigned long long u = 0;
+  int i;
+  for (i = 8; i-- > 0;) u = u << 8 | *(const unsigned char*)(p + i);
+  return (off_t)u;
+}
+
+#if USE_ZLIB
+/* --- BGZF (blocked gzip) files
+ *
+ * A BGZF file (as written by `bgzip' of htslib, or by flag -Z) is a
+ * concatenation of gzip members (blocks), each at most 64 KiB compressed and
+ * uncompressed, and each having its compressed size in the header. zcat(1)
+ * can read it. A yfile opened from a BGZF file reads its uncompressed
+ * contents: a read at an uncompressed offset first finds the block
+ * containing it in the block table (by binary search), and then decompresses
+ * only that block (unless it's the last one decompressed). Thus bisection
+ * decompresses about log2(number of blocks) blocks.
+ *
+ * The block table is read from the sidecar file <file>.gzi (as written by
+ * `bgzip -i' or by flag -Z): a little endian uint64 count, followed by
+ * (compressed offset, uncompressed offset) uint64 pairs for each block after
+ * the first. If it's missing, then the block headers are scanned instead
+ * (reading 2 small pieces of each block), which is slow for large files.
+ */
+
+#define BGZF_MAX_BLOCK_SIZE 65536
+#define BGZF_HEADER_READ_SIZE 64
+
+typedef struct ybgzf {
+  /* The compressed and uncompressed offsets of block i are cofs[i] and
+   * uofs[i]. cofs[count] and uofs[count] are the file size and the
+   * uncompressed size. These arrays are shared by yfopen_dup.
+   */
+  off_t *cofs, *uofs;
+  off_t count, capacity;
+  off_t block;  /* Index of the block in data, or -1. */
+  z_stream zs;
+  char cdata[BGZF_MAX_BLOCK_SIZE];
+  char data[BGZF_MAX_BLOCK_SIZE];
+} ybgzf;
+
+STATIC unsigned get_u32le(const char *p) {
+  const unsigned char *q = (const unsigned char*)p;
+  return q[0] | q[1] << 8 | q[2] << 16 | (unsigned)q[3] << 24;
+}
+
+/* Returns the (compressed) size of the BGZF block whose first size bytes
+ * are hdr, and sets *hdr_size_out to the size of its gzip header. Returns
+ * -1 if it's not a BGZF block.
+ */
+STATIC int bgzf_block_size(const char *hdr, int size, int *hdr_size_out) {
+  const unsigned char *h = (const unsigned char*)hdr;
+  int xend, i, bsize;
+  /* FLG must be FEXTRA only. */
+  if (size < 18 || h[0] != 0x1f || h[1] != 0x8b || h[2] != 8 || h[3] != 4) {
+    return -1;
+  }
+  if ((xend = 12 + (h[10] | h[11] << 8)) > size) return -1;
+  for (i = 12; i + 4 <= xend; i += 4 + (h[i + 2] | h[i + 3] << 8)) {
+    if (h[i] == 'B' && h[i + 1] == 'C' && h[i + 2] == 2 && h[i + 3] == 0 &&
+        i + 6 <= xend) {
+      bsize = (h[i + 4] | h[i + 5] << 8) + 1;
+      *hdr_size_out = xend;
+      return bsize < xend + 8 ? -1 : bsize;
+    }
+  }
+  return -1;
+}
+
+/* Returns the index of the block containing uncompressed offset ofs, which
+ * must be smaller than the uncompressed size.
+ */
+STATIC off_t ybgzf_find(const ybgzf *bz, off_t ofs) {
+  off_t lo = 0, hi = bz->count - 1, mid;
+  /* Find the last block starting at or before ofs, skipping empty ones. */
+  while (lo < hi) {
+    mid = (lo + hi + 1) >> 1;
+    if (bz->uofs[mid] <= ofs) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+/* Reads and decompresses block i of yf to bz->data. */
+STATIC void ybgzf_load(yfile *yf, ybgzf *bz, off_t i) {
+  const off_t csize = bz->cofs[i + 1] - bz->cofs[i];
+  const off_t usize = bz->uofs[i + 1] - bz->uofs[i];
+  const char *trailer;
+  int hdr_size;
+  bz->block = -1;
+  if (csize > BGZF_MAX_BLOCK_SIZE ||
+      yfpread_fd(yf, bz->cdata, (int)csize, bz->cofs[i]) != csize ||
+      bgzf_block_size(bz->cdata, (int)csize, &hdr_size) != csize) {
+    die1("error: bad BGZF block header");
+  }
+  trailer = bz->cdata + csize - 8;
+  inflateReset(&bz->zs);
+  bz->zs.next_in = (Bytef*)bz->cdata + hdr_size;
+  bz->zs.avail_in = (int)csize - hdr_size - 8;
+  bz->zs.next_out = (Bytef*)bz->data;
+  bz->zs.avail_out = BGZF_MAX_BLOCK_SIZE;
+  if (inflate(&bz->zs, Z_FINISH) != Z_STREAM_END ||
+      (off_t)bz->zs.total_out != usize || get_u32le(trailer + 4) != usize ||
+      crc32(0, (const Bytef*)bz->data, (int)usize) != get_u32le(trailer)) {
+    die1("error: bad BGZF block");
+  }
+  ++yf->stats.inflate_count;
+  bz->block = i;
+}
+
+/* Like yfpread_fd, but reads the uncompressed contents of a BGZF file. */
+STATIC int ybgzf_pread(yfile *yf, char *dst, int size, off_t ofs) {
+  ybgzf *bz = yf->bgzf;
+  off_t i;
+  int got = 0, n;
+  while (got < size && ofs < bz->uofs[bz->count]) {
+    if ((i = bz->block) < 0 || ofs < bz->uofs[i] || ofs >= bz->uofs[i + 1]) {
+      ybgzf_load(yf, bz, i = ybgzf_find(bz, ofs));
+    }
+    n = bz->uofs[i + 1] - ofs > size - got ? size - got :
+        (int)(bz->uofs[i + 1] - ofs);
+    memcpy(dst + got, bz->data + (size_t)(ofs - bz->uofs[i]), n);
+    got += n;
+    ofs += n;
+  }
+  return got;
+}
+#endif
+
+/* Reads up to size bytes at offset ofs of yf to dst: its uncompressed
+ * contents if it's a BGZF file. Returns the number of bytes read, or -1 on
+ * error.
+ */
+STATIC int yfpread(yfile *yf, char *dst, int size, off_t ofs) {
+#if USE_ZLIB
+  if (yf->bgzf) return ybgzf_pread(yf, dst, size, ofs);
+#endif
+  return yfpread_fd(yf, dst, size, ofs);
+}
+
+/* Reads the block at file offset b (a multiple of YF_READ_BUF_SIZE) to
+ * dst. Returns the number of bytes read, and shrinks yf->size if the file
+ * has become shorter.
+ */
+STATIC int yfread_block(yfile *yf, off_t b, char *dst) {
+  int got, need;
+  need = b + YF_READ_BUF_SIZE + 0ULL > yf->size + 0ULL ?
+      yf->size - b : YF_READ_BUF_SIZE;
+  got = yf->fd < 0 ? 0 : yfpread(yf, dst, need, b);
+  if (got < 0) die2_strerror("error: read", "");
+  if (got < need && b + got + 0ULL < yf->size + 0ULL) {
+    yf->size = b + got;
+  }
+  return got;
+}
+
+/* --- Block and line cache
+ *
+ * Optional (flag -k), for processes doing many searches in the same file
+ * (e.g. bisect_interval, or flag -s). The block cache keeps the most
+ * recently used blocks of the file (of YF_READ_BUF_SIZE bytes each) in
+ * memory, with LRU eviction. The line cache remembers the results of
+ * get_fofs (in a direct-mapped table), so that the upper levels of the
+ * bisection don't have to scan for '\n' again. Both are dropped by yfclose.
+ */
+
+typedef struct ycache_block {
+  off_t ofs;  /* File offset of the block, or -1 if unused. */
+  int size;  /* Number of bytes read. */
+  int prev, next;  /* Neighbors in the LRU list, or -1. */
+  int hnext;  /* Next block in the hash chain, or -1. */
+} ycache_block;
+
+typedef struct ycache_line {
+  off_t ofs;  /* 0 if unused. */
+  off_t fofs;  /* The value of get_fofs(yf, ofs). */
+} ycache_line;
+
+typedef struct ycache {
+  int block_count;
+  int hash_mask;  /* Size of hash minus 1, a power of 2 minus 1. */
+  int lru_head, lru_tail;  /* Most and least recently used block. */
+  int line_mask;  /* Size of lines minus 1, a power of 2 minus 1. */
+  ycache_block *blocks;
+  int *hash;  /* Hash table of block indexes, by block file offset. */
+  ycache_line *lines;
+  char *data;  /* Contents of the blocks. */
+} ycache;
+
+STATIC void ycache_free(ycache *cache) {
+  free(cache->blocks);
+  free(cache->hash);
+  free(cache->lines);
+  free(cache->data);
+  free(cache);
+}
+
+/* Enables the block and line cache in yf, using about budget bytes of
+ * memory. Returns false on out of memory. Blocks are cached only if the
+ * file is not mapped to memory.
+ */
+STATIC ybool yfenable_cache(yfile *yf, size_t budget) {
+  ycache *cache;
+  int i, block_count = budget / (YF_READ_BUF_SIZE + sizeof(ycache_line) * 16);
+  int hash_size = 1, line_count = 1;
+  if (block_count < 2) block_count = 2;
+  if (YF_IS_MAPPED(yf)) block_count = 0;
+  while (hash_size < block_count * 2) hash_size <<= 1;
+  while ((size_t)line_count * 2 * sizeof(ycache_line) <=
+         (budget >> 4) + sizeof(ycache_line)) {
+    line_count <<= 1;
+  }
+  if (!(cache = (ycache*)malloc(sizeof(ycache)))) return 0;
+  cache->block_count = block_count;
+  cache->hash_mask = hash_size - 1;
+  cache->line_mask = line_count - 1;
+  cache->blocks = (ycache_block*)malloc(
+      sizeof(ycache_block) * (block_count + 1));
+  cache->hash = (int*)malloc(sizeof(int) * hash_size);
+  cache->lines = (ycache_line*)calloc(line_count, sizeof(ycache_line));
+  cache->data = (char*)malloc((size_t)YF_READ_BUF_SIZE * (block_count + 1));
+  if (!cache->blocks || !cache->hash || !cache->lines || !cache->data) {
+    ycache_free(cache);
+    return 0;
+  }
+  for (i = 0; i < hash_size; ++i) cache->hash[i] = -1;
+  for (i = 0; i < block_count; ++i) {
+    cache->blocks[i].ofs = -1;
+    cache->blocks[i].size = 0;
+    cache->blocks[i].prev = i - 1;
+    cache->blocks[i].next = i + 1 < block_count ? i + 1 : -1;
+    cache->blocks[i].hnext = -1;
+  }
+  cache->lru_head = block_count > 0 ? 0 : -1;
+  cache->lru_tail = block_count - 1;
+  yf->cache = cache;
+  return 1;
+}
+
+#define YCACHE_HASH(cache, b) \
+    ((int)((b) / YF_READ_BUF_SIZE) & (cache)->hash_mask)
+
+/* Moves block i to the front of the LRU list. */
+STATIC void ycache_touch(ycache *cache, int i) {
+  ycache_block *blocks = cache->blocks;
+  if (cache->lru_head == i) return;
+  blocks[blocks[i].prev].next = blocks[i].next;
+  if (blocks[i].next >= 0) {
+    blocks[blocks[i].next].prev = blocks[i].prev;
+  } else {
+    cache->lru_tail = blocks[i].prev;
+  }
+  blocks[i].prev = -1;
+  blocks[i].next = cache->lru_head;
+  blocks[cache->lru_head].prev = i;
+  cache->lru_head = i;
+}
+
+/* Makes yf->buf point to the block at file offset b in the block cache,
+ * reading it (and evicting the least recently used block) if needed.
+ * Returns the number of bytes available at yf->buf.
+ */
+STATIC int ycache_load(yfile *yf, off_t b) {
+  ycache *cache = yf->cache;
+  ycache_block *blocks = cache->blocks;
+  int *hp = cache->hash + YCACHE_HASH(cache, b), *hq;
+  int i, got;
+  for (i = *hp; i >= 0 && blocks[i].ofs != b; i = blocks[i].hnext) {}
+  if (i < 0) {  /* Cache miss, evict the least recently used block. */
+    i = cache->lru_tail;
+    if (blocks[i].ofs >= 0) {  /* Remove it from its hash chain. */
+      for (hq = cache->hash + YCACHE_HASH(cache, blocks[i].ofs);
+           *hq != i; hq = &blocks[*hq].hnext) {}
+      *hq = blocks[i].hnext;
+    }
+    blocks[i].ofs = -1;
+    got = yfread_block(yf, b, cache->data + (size_t)i * YF_READ_BUF_SIZE);
+    blocks[i].ofs = b;
+    blocks[i].size = got;
+    blocks[i].hnext = *hp;
+    *hp = i;
+  } else {
+    ++yf->stats.block_hit_count;
+  }
+  ycache_touch(cache, i);
+  yf->buf = cache->data + (size_t)i * YF_READ_BUF_SIZE;
+  got = blocks[i].size;
+  return b + got + 0ULL > yf->size + 0ULL ? (int)(yf->size - b) : got;
+}
+
+/** Returns -1 on EOF, or 0..255. */
+STATIC int yfgetc(yfile *yf) {
+  if (yf->p == yf->rend) {
+    off_t a = yf->p - yf->buf + yf->ofs, b;  /* a = yftell(yf); */
+    int got;
+    if (YF_IS_MAPPED(yf)) return -1;  /* EOF, the whole file is in buf. */
+    if (a + 0ULL >= yf->size + 0ULL) return -1;  /* EOF. */
+    /* YF_READ_BUF_SIZE must be a power of 2 for this below. */
+    b = a & -YF_READ_BUF_SIZE;
+    if (yf->cache && yf->cache->block_count > 0) {
+      got = ycache_load(yf, b);
+    } else {
+      yf->buf = yf->rbuf;
+      got = yfread_block(yf, b, yf->buf);
+    }
+    yf->ofs = b;
+    yf->p = a - b + yf->buf;
+    yf->rend = yf->buf + got;
+    if (b + got + 0ULL <= a + 0ULL) {  /* yf->p is past the buffer. */
+      yf->p = yf->rend;
+      return -1;  /* EOF. */
+    }
+  }
+  return *(unsigned char*)yf->p++;
+}
+
+/* Upper limit for the return value of yfpeek, so that it fits to an int
+ * even if the whole file is mapped to memory.
+ */
+#define YF_PEEK_MAX 0x40000000
+
+/* If len <= 0 or at EOF, just returns 0. Otherwise, it makes sure that the
+ * read buffer of yf contains it least 1 byte available (by calling
+ * yfgetc(yf) if needed), and returns min(available, len), thus the return
+ * value is at least 1. Also sets *buf_out so that (*buf_out[:result]) is
+ * the next available bytes with the read buffer. It doesn't skip over these
+ * bytes though, the caller can do it by yfseek_cur(yf, result) later.
+ *
+ * If the file is mapped, then available can be the entire rest of the file
+ * (capped at YF_PEEK_MAX), without copying.
+ */
+STATIC int yfpeek(yfile *yf, off_t len, const char **buf_out) {
+  int available;
+  if (len <= 0) return 0;
+  available = yf->rend - yf->p > YF_PEEK_MAX ?
+      YF_PEEK_MAX : (int)(yf->rend - yf->p);
+  if (available <= 0 && yfgetc(yf) >= 0) {
+    --yf->p;  /* YFUNGET(yf). */
+    available = yf->rend - yf->p;
+  }
+  *buf_out = yf->p;
+  return len + 0ULL > available + 0ULL ? available : (int)len;
+}
+
+/* Reads up to size bytes from the current position of yf to buf. Returns
+ * the number of bytes read, smaller than size only at EOF.
+ */
+STATIC int yfread(yfile *yf, char *buf, int size) {
+  int got, c;
+  for (got = 0; got < size && (c = YFGETCHAR(yf)) >= 0; ++got) {
+    buf[got] = (char)c;
+  }
+  return got;
+}
+
+#if USE_SHARDS || USE_LIBRARY
+/* Reads the line of yf at ofs (< end), but at most until end. Sets
+ * *line_out to the line (including the '\n', if any): in the read buffer
+ * (or the mapped file) if possible, otherwise copied to *lbuf_io, which is
+ * grown with realloc(3) as needed. Returns the size of the line, which is
+ * positive: it fails with EIO if there is nothing to read at ofs (e.g. the
+ * file has become shorter).
+ */
+STATIC size_t yfgetline(yfile *yf, off_t ofs, off_t end,
+                        const char **line_out,
+                        char **lbuf_io, size_t *lbuf_capacity_io) {
+  const char *buf, *nl;
+  off_t left = end - ofs;
+  size_t size = 0;
+  int got;
+  yfseek_set(yf, ofs);
+  got = yfpeek(yf, left, &buf);
+  if (got > 0 && (nl = (const char*)memchr(buf, '\n', got)) != NULL) {
+    *line_out = buf;  /* Fast path: the line is in the read buffer. */
+    return nl - buf + 1;
+  }
+  for (; got > 0; got = yfpeek(yf, left, &buf)) {
+    if ((nl = (const char*)memchr(buf, '\n', got)) != NULL) got = nl - buf + 1;
+    if (size + got > *lbuf_capacity_io) {
+      *lbuf_capacity_io = (size + got) * 2;
+      if (!(*lbuf_io = (char*)realloc(*lbuf_io, *lbuf_capacity_io))) {
+        die1_nomem("error: out of memory for line");
+      }
+    }
+    memcpy(*lbuf_io + size, buf, got);
+    size += got;
+    left -= got;
+    if (nl) break;
+    yfseek_cur(yf, got);
+  }
+  if (size == 0) {
+    errno = EIO;
+    die2_strerror("error: unexpected EOF", "");
+  }
+  *line_out = *lbuf_io;
+  return size;
+}
+#endif
+
+#if USE_ZLIB
+/* --- Opening BGZF files
+ *
+ * Loading the block table of a BGZF file (see the BGZF section above).
+ */
+
+STATIC ybgzf *ybgzf_new(void) {
+  ybgzf *bz = (ybgzf*)malloc(sizeof(ybgzf));
+  if (!bz) die1_nomem("error: out of memory for BGZF");
+  bz->cofs = bz->uofs = NULL;
+  bz->count = bz->capacity = 0;
+  bz->block = -1;
+  memset(&bz->zs, '\0', sizeof(bz->zs));
+  if (inflateInit2(&bz->zs, -15) != Z_OK) die1("error: inflateInit2");
+  return bz;
+}
+
+/* Sets bz->count, making room for count + 1 entries in the block table. */
+STATIC void ybgzf_set_count(ybgzf *bz, off_t count) {
+  off_t capacity = bz->capacity < 64 ? 64 : bz->capacity;
+  if (count >= bz->capacity) {
+    while (count >= capacity) capacity <<= 1;
+    if (!(bz->cofs = (off_t*)realloc(bz->cofs, capacity * sizeof(off_t))) ||
+        !(bz->uofs = (off_t*)realloc(bz->uofs, capacity * sizeof(off_t)))) {
+      die1_nomem("error: out of memory for BGZF block table");
+    }
+    bz->capacity = capacity;
+  }
+  bz->count = count;
+}
+
+/* Reads the block table from the .gzi file at pathname. Returns false if
+ * it's missing or invalid.
+ */
+STATIC ybool ybgzf_read_gzi(ybgzf *bz, const char *pathname) {
+  yfile gyf;
+  char entry[16];
+  off_t count, i;
+  int fd;
+  ybool is_ok = 0;
+  if ((fd = open(pathname, O_RDONLY | O_BINARY, 0)) < 0) return 0;
+  yfopen_fd(&gyf, fd, (off_t)-1);
+  if (yfread(&gyf, entry, 8) == 8 && (count = get_u64le(entry)) >= 0 &&
+      (yfgetsize(&gyf) - 8) / 16 == count && (yfgetsize(&gyf) - 8) % 16 == 0) {
+    ybgzf_set_count(bz, count);
+    bz->cofs[0] = bz->uofs[0] = 0;
+    for (i = 1; i <= count; ++i) {
+      if (yfread(&gyf, entry, 16) != 16) break;
+      bz->cofs[i] = get_u64le(entry);
+      bz->uofs[i] = get_u64le(entry + 8);
+      if (bz->cofs[i] <= bz->cofs[i - 1] || bz->uofs[i] < bz->uofs[i - 1] ||
+          bz->uofs[i] - bz->uofs[i - 1] > BGZF_MAX_BLOCK_SIZE) break;
+    }
+    is_ok = i > count;
+  }
+  yfclose(&gyf);
+  return is_ok;
+}
+
+/* Appends the blocks after block bz->count - 1 to the block table, by
+ * reading their headers and trailers, up to the compressed size fsize.
+ * Returns false if the file is not a valid BGZF file.
+ */
+STATIC ybool ybgzf_scan(yfile *yf, ybgzf *bz, off_t fsize) {
+  char hdr[BGZF_HEADER_READ_SIZE];
+  off_t cofs = bz->cofs[bz->count], uofs = bz->uofs[bz->count];
+  int got, bsize, hdr_size;
+  unsigned isize;
+  while (cofs < fsize) {
+    got = fsize - cofs < (off_t)sizeof(hdr) ? (int)(fsize - cofs) :
+        (int)sizeof(hdr);
+    if (yfpread_fd(yf, hdr, got, cofs) != got ||
+        (bsize = bgzf_block_size(hdr, got, &hdr_size)) < 0 ||
+        bsize > fsize - cofs ||
+        yfpread_fd(yf, hdr, 4, cofs + bsize - 4) != 4 ||
+        (isize = get_u32le(hdr)) > BGZF_MAX_BLOCK_SIZE) {
+      return 0;
+    }
+    ybgzf_set_count(bz, bz->count + 1);
+    bz->cofs[bz->count] = cofs += bsize;
+    bz->uofs[bz->count] = uofs += isize;
+  }
+  return cofs == fsize;
+}
+
+/* If yf (opened from pathname) is a BGZF file, then makes it read the
+ * uncompressed contents. Otherwise it does nothing.
+ */
+STATIC void yfopen_bgzf(yfile *yf, const char *pathname) {
+  char hdr[BGZF_HEADER_READ_SIZE], pathbuf[4096];
+  const char *p = hdr;
+  const size_t pathname_size = strlen(pathname);
+  const off_t fsize = yf->size;
+  int got, hdr_size, bsize;
+  ybgzf *bz;
+  ybool has_gzi;
+  got = fsize < (off_t)sizeof(hdr) ? (int)fsize : (int)sizeof(hdr);
+#if YF_USE_MMAP
+  if (YF_IS_MAPPED(yf)) {  /* Don't do a read(2) for non-BGZF files. */
+    p = yf->map;
+  } else
+#endif
+  if (got > 0) {
+    got = yfpread_fd(yf, hdr, got, 0);
+  }
+  if ((bsize = bgzf_block_size(p, got, &hdr_size)) < 0) return;
+  yfunmap(yf);
+  yf->bgzf = bz = ybgzf_new();  /* Freed by yfclose even on error. */
+  has_gzi = pathname_size + 5 <= sizeof(pathbuf);
+  if (has_gzi) {
+    memcpy(pathbuf, pathname, pathname_size);
+    memcpy(pathbuf + pathname_size, ".gzi", 5);
+    has_gzi = ybgzf_read_gzi(bz, pathbuf);
+    /* A .gzi of another .gz (e.g. during a concurrent -Z) is ignored if its
+     * first block size differs. Otherwise the scan below from its last
+     * block, and ybgzf_load checking each block, detect the mismatch.
+     */
+    if (has_gzi && bz->count > 0 && bz->cofs[1] != bsize) has_gzi = 0;
+  }
+  if (!has_gzi) {
+    ybgzf_set_count(bz, 0);
+    bz->cofs[0] = bz->uofs[0] = 0;
+  }
+  if (!ybgzf_scan(yf, bz, fsize)) {
+    ybgzf_set_count(bz, 0);  /* The .gzi file may be stale, retry. */
+    if (!has_gzi || !ybgzf_scan(yf, bz, fsize)) {
+      die5_code("error: bad BGZF file: ", pathname, "", "", "\n", 2);
+    }
+  }
+  yf->size = bz->uofs[bz->count];
+}
+
+/* Makes yf a BGZF reader sharing the block table of src. */
+STATIC void ybgzf_dup(yfile *yf, const yfile *src) {
+  ybgzf *bz = ybgzf_new();
+  bz->cofs = src->bgzf->cofs;
+  bz->uofs = src->bgzf->uofs;
+  bz->count = bz->capacity = src->bgzf->count;
+  yf->bgzf = bz;
+}
+
+STATIC void ybgzf_free(yfile *yf) {
+  ybgzf *bz = yf->bgzf;
+  if (!yf->is_borrowed) {
+    free(bz->cofs);
+    free(bz->uofs);
+  }
+  inflateEnd(&bz->zs);
+  free(bz);
+  yf->bgzf = NULL;
+}
+#endif
+
+/* --- Bisection (binary search)
+ *
  * The algorithms and data structures below are complex, tricky, and very
  * underdocumented. See (ARTICLE) above for a detailed explanation of both
  * design and implementation.
@@ -320,21 +1458,50 @@ STATIC int yfpeek(yfile *yf, off_t len, const char **buf_out) {
 
 /* Returns the file offset of the line starting at ofs, or if no line
  * starts their, then the the offset of the next line.
+ *
+ * The '\n' is searched for with memchr(3) in the read buffer (or in the
+ * mapped file), which is vectorized in libc (e.g. glibc selects an SSE2,
+ * AVX2 or EVEX implementation at runtime). With fixed-width records (flag
+ * -w), it's computed without reading the file.
  */
 STATIC off_t get_fofs(yfile *yf, off_t ofs) {
-  int c;
-  off_t size;
+  const char *buf, *nl;
+  int got;
+  off_t size, fofs;
+  ycache_line *line = NULL;
   assert(ofs >= 0);
   if (ofs == 0) return 0;
   size = yfgetsize(yf);
   if (ofs > size) return size;
-  --ofs;
-  yfseek_set(yf, ofs);
-  for (;;) {
-    if ((c = YFGETCHAR(yf)) < 0) return ofs;
-    ++ofs;
-    if (c == '\n') return ofs;
+  if (yf->reclen != 0) {
+    fofs = (ofs + yf->reclen - 1) / yf->reclen * yf->reclen;
+    return fofs > size ? size : fofs;
+  }
+  if (yf->cache) {
+    line = yf->cache->lines +
+        (((unsigned)ofs * 0x9e3779b1U) >> 8 & yf->cache->line_mask);
+    if (line->ofs == ofs) {
+      ++yf->stats.line_hit_count;
+      /* If yflimit has been called since, then size is smaller. */
+      return line->fofs > size ? size : line->fofs;
+    }
   }
+  fofs = ofs - 1;
+  yfseek_set(yf, fofs);
+  while ((got = yfpeek(yf, YF_PEEK_MAX, &buf)) > 0) {
+    if ((nl = (const char*)memchr(buf, '\n', got)) != NULL) {
+      fofs += nl - buf + 1;
+      yfseek_cur(yf, nl - buf + 1);
+      break;
+    }
+    fofs += got;
+    yfseek_cur(yf, got);
+  }
+  if (line) {
+    line->ofs = ofs;
+    line->fofs = fofs;
+  }
+  return fofs;
 }
 
 typedef enum compare_mode_t {
@@ -344,26 +1511,33 @@ typedef enum compare_mode_t {
   CM_UNSET,  /* Not set yet. Most functions do not support it. */
 } compare_mode_t;
 
-/* Compares x[:xsize] with a line read from yf. */
+/* Compares x[:xsize] with a line read from yf. x[:xsize] must not contain
+ * '\n'.
+ *
+ * Compares a read buffer (or mapped file) worth of bytes at a time, using
+ * memchr(3) and memcmp(3), which are vectorized in libc.
+ */
 STATIC ybool compare_line(yfile *yf, off_t fofs,
                           const char *x, size_t xsize, compare_mode_t cm) {
-  int b, c;
+  const char *buf, *nl;
+  size_t size;
+  int got, r;
+  ++yf->stats.compare_count;
   yfseek_set(yf, fofs);
-  c = YFGETCHAR(yf);
-  if (c < 0) return 1;  /* Special casing of EOF at BOL. */
-  YFUNGET(yf);
-  /* TODO(pts): Possibly speed up the loop with yfpeek(...). */
+  if (yfpeek(yf, 1, &buf) == 0) return 1;  /* Special casing of EOF at BOL. */
   for (;;) {
-    c = YFGETCHAR(yf);
-    if (c < 0 || c == '\n') {
+    if ((got = yfpeek(yf, (off_t)xsize + 1, &buf)) == 0) {  /* EOF. */
       return cm == CM_LE ? xsize == 0 : 0;
     } else if (xsize == 0) {
-      return cm != CM_LP;
-    } else if ((b = (int)*(unsigned char*)x) != c) {
-      return b < c;
+      return *buf == '\n' ? cm == CM_LE : cm != CM_LP;
     }
-    ++x;
-    --xsize;
+    size = (size_t)got < xsize ? (size_t)got : xsize;
+    if ((nl = (const char*)memchr(buf, '\n', size)) != NULL) size = nl - buf;
+    if ((r = memcmp(x, buf, size)) != 0) return r < 0;
+    if (nl) return 0;  /* The line is shorter than x. */
+    x += size;
+    xsize -= size;
+    yfseek_cur(yf, size);
   }
 }
 
@@ -392,12 +1566,31 @@ STATIC void cache_init(struct cache *cache) {
   cache->active = 3;
 }
 
+/* Activates a new entry in cache (evicting the inactive one) for the line
+ * at fofs == get_fofs(ofs). Returns the new entry.
+ */
+STATIC const struct cache_entry *cache_put(
+    struct cache *cache, off_t ofs, off_t fofs, ybool cmp_result) {
+  int a = cache->active;
+  struct cache_entry *entry;
+  if (CACHE_HAS_0(a)) {
+    cache->active = a = CACHE_GET_ACTIVE(a) ^ 1;
+    entry = cache->e + a;
+  } else {
+    cache->active = 2;
+    entry = cache->e;
+  }
+  entry->fofs = fofs;
+  entry->ofs = ofs;
+  entry->cmp_result = cmp_result;
+  return entry;
+}
+
 /* x[:xsize] must not contain '\n'. */
 STATIC const struct cache_entry *get_using_cache(
     yfile *yf, struct cache *cache, off_t ofs,
     const char *x, size_t xsize, compare_mode_t cm) {
   int a = cache->active;
-  struct cache_entry *entry;
   off_t fofs;
   assert(ofs >= 0);
   /* TODO(pts): Add tests for efficient and correct cache usage. */
@@ -405,10 +1598,13 @@ STATIC const struct cache_entry *get_using_cache(
   if (CACHE_HAS_0(a) &&
       cache->e[0].ofs <= ofs && ofs <= cache->e[0].fofs) {
     if (a == 1) cache->active = a = 0;
+    ++yf->stats.cache_hit_count;
   } else if (CACHE_HAS_1(a) &&
              cache->e[1].ofs <= ofs && ofs <= cache->e[1].fofs) {
     if (a == 0) cache->active = a = 1;
+    ++yf->stats.cache_hit_count;
   } else {
+    ++yf->stats.cache_miss_count;
     fofs = get_fofs(yf, ofs);
     assert(ofs <= fofs);
     if (CACHE_HAS_0(a) && cache->e[0].fofs == fofs) {
@@ -418,18 +1614,8 @@ STATIC const struct cache_entry *get_using_cache(
       if (a == 0) cache->active = a = 1;
       if (cache->e[1].ofs > ofs) cache->e[1].ofs = ofs;
     } else {
-      if (CACHE_HAS_0(a)) {
-        cache->active = a = CACHE_GET_ACTIVE(a) ^ 1;
-        entry = cache->e + a;
-      } else {
-        cache->active = a = 2;
-        entry = cache->e;
-      }
-      /* Fill newly activated cache entry. */
-      entry->fofs = fofs;
-      entry->ofs = ofs;
-      entry->cmp_result = compare_line(yf, fofs, x, xsize, cm);
-      return entry;  /* Shortcut, the return below would do the same. */
+      return cache_put(cache, ofs, fofs,
+                       compare_line(yf, fofs, x, xsize, cm));
     }
   }
   return cache->e + CACHE_GET_ACTIVE(a);
@@ -444,12 +1630,15 @@ STATIC off_t get_fofs_using_cache(
   if (CACHE_HAS_0(a) &&
       cache->e[0].ofs <= ofs && ofs <= cache->e[0].fofs) {
     if (a == 1) cache->active = a = 0;
+    ++yf->stats.cache_hit_count;
     return cache->e[0].fofs;
   } else if (CACHE_HAS_1(a) &&
              cache->e[1].ofs <= ofs && ofs <= cache->e[1].fofs) {
     if (a == 0) cache->active = a = 1;
+    ++yf->stats.cache_hit_count;
     return cache->e[1].fofs;
   } else {
+    ++yf->stats.cache_miss_count;
     fofs = get_fofs(yf, ofs);
     assert(ofs <= fofs);
     if (CACHE_HAS_0(a) && cache->e[0].fofs == fofs) {
@@ -466,103 +1655,1128 @@ STATIC off_t get_fofs_using_cache(
   }
 }
 
-/* x[:xsize] must not contain '\n'.
- *
- * cm=CM_LE is equivalent to is_left=true and is_open=true.
- * cm=CM_LT is equivalent to is_left=false and is_open=false.
- * cm=CL_LP is also supported, it does prefix search.
+/* Creates and opens a new file for writing, replacing the trailing "XXXXXX"
+ * of tmppathname to make its name unique. Like mkstemp(3), it uses O_EXCL,
+ * so concurrent writers and planted symlinks don't interfere. Returns the
+ * file descriptor, or -1 on error.
  */
-STATIC off_t bisect_way(
-    yfile *yf, struct cache *cache, off_t lo, off_t hi,
-    const char *x, size_t xsize, compare_mode_t cm) {
-  const off_t size = yfgetsize(yf);
-  off_t mid, midf;
-  const struct cache_entry *entry;
-  if (hi + 0ULL > size + 0ULL) hi = size;  /* Also applies to hi == -1. */
-  if (xsize == 0) {  /* Shortcuts. */
-    if (cm == CM_LE) hi = lo;  /* Faster for lo == 0. Returns right below. */
-    if (cm == CM_LP && hi == size) return hi;
+STATIC int open_unique(char *tmppathname, int mode) {
+#if USE_MKSTEMP
+  const int fd = mkstemp(tmppathname);
+  if (fd >= 0 && fchmod(fd, mode) != 0) {
+    close(fd);
+    unlink(tmppathname);
+    return -1;
   }
-  if (lo >= hi) return get_fofs_using_cache(yf, cache, lo);
-  do {
-    mid = (lo + hi) >> 1;
-    entry = get_using_cache(yf, cache, mid, x, xsize, cm);
-    midf = entry->fofs;
-    if (entry->cmp_result) {
-      hi = mid;
-    } else {
-      lo = mid + 1;
+  return fd;
+#else
+  char *p = tmppathname + strlen(tmppathname) - 6;
+  long i, j;
+  int k, fd;
+  for (i = 0; i < 1000000L; ++i) {
+    for (k = 5, j = i; k >= 0; --k, j /= 10) p[k] = (char)('0' + j % 10);
+    if ((fd = open(tmppathname, O_WRONLY | O_CREAT | O_EXCL | O_BINARY,
+                   mode)) >= 0 || errno != EEXIST) {
+      return fd;
     }
-  } while (lo < hi);
-  return mid == lo ? midf : get_fofs_using_cache(yf, cache, lo);
-}
-
-/* x[:xsize] and y[:ysize] must not contain '\n'. */
-STATIC void bisect_interval(
-    yfile *yf, off_t lo, off_t hi, compare_mode_t cm,
-    const char *x, size_t xsize,
-    const char *y, size_t ysize,
-    off_t *start_out, off_t *end_out) {
-  off_t start;
-  struct cache cache;
-  /* TODO(pts): If y < x, then don't even read the file. Smart compare! */
-  cache_init(&cache);
-  *start_out = start = bisect_way(yf, &cache, lo, hi, x, xsize, CM_LE);
-  if (cm == CM_LE && xsize == ysize && 0 == memcmp(x, y, xsize)) {
-    *end_out = start;
-  } else {
-    /* Don't use a shared cache, because x or cm are different. */
-    cache_init(&cache);
-    *end_out = bisect_way(yf, &cache, start, hi, y, ysize, cm);
   }
+  return -1;
+#endif
 }
 
-/* --- main */
+/* --- Sidecar index
+ *
+ * The sidecar index file (<sorted-text-file>.lbidx, written by flag -X)
+ * contains the offset and the first few bytes (the key prefix) of the first
+ * line starting at or after each multiple of LBIDX_STEP. Bisection in the
+ * index (flag -x) narrows the lo and hi offsets of bisect_way to about
+ * LBIDX_STEP bytes without reading the text file, so bisect_way needs only
+ * one or two reads. The index is only used if the size and mtime of the
+ * text file recorded in it are still the same, otherwise it is ignored.
+ *
+ * File format (all integers are 8-byte little endian):
+ *
+ * * header (LBIDX_HEADER_SIZE bytes): LBIDX_MAGIC, text file size, text
+ *   file mtime (seconds), LBIDX_STEP, entry count, LBIDX_PREFIX_SIZE,
+ *   text file mtime (nanoseconds, 0 if unknown), zero;
+ * * entries (LBIDX_ENTRY_SIZE bytes each), in increasing offset order:
+ *   line start offset, prefix size byte (bit 7 is set iff the line is
+ *   longer than the prefix), LBIDX_PREFIX_SIZE bytes of prefix (padded
+ *   with '\0').
+ */
 
-STATIC __attribute__((noreturn)) void usage_error(
-    const char *argv0, const char *msg) {
-  die5_code("Binary search (bisection) in a sorted text file\n"
-            "Usage: ", argv0, "-<flags> <sorted-text-file> <key-x> [<key-y>]\n"
-            "<key-x> is the first key to search for\n"
-            "<key-y> is the last key to search for; default is <key-x>\n"
-            "Flags:\n"
-            "e: do bisect_left, open interval end\n"
-            "t: do bisect_right, closed interval end\n"
-            "b: do bisect_left for interval start (default)\n"
-            "a: do bisect_right for interval start (for append position)\n"
-            "p: do prefix search\n"
-            "c: print file contents (default)\n"
-            "o: print file offsets\n"
-            "q: don't print anything, just detect if there is a match\n"
-            "i: ignore incomplete last line (may be appended to right now)\n"
-            "usage error: ", msg, "\n",
-            1);
+#ifndef LBIDX_STEP
+#define LBIDX_STEP YF_READ_BUF_SIZE
+#endif
+#define LBIDX_MAGIC "LBIDX2\n"  /* With the trailing '\0', 8 bytes. */
+#define LBIDX_HEADER_SIZE 64
+#define LBIDX_ENTRY_SIZE 32
+#define LBIDX_PREFIX_SIZE (LBIDX_ENTRY_SIZE - 9)
+#define LBIDX_TRUNCATED 0x80
+
+/* The nanoseconds part of the mtime in struct stat, or 0 if unknown. */
+#ifndef ST_MTIME_NSEC
+#if defined(__linux__) && !defined(__XTINY__)
+#define ST_MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#elif defined(__APPLE__)
+#define ST_MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#else
+#define ST_MTIME_NSEC(st) 0
+#endif
+#endif
+
+typedef struct lbindex {
+  yfile yf;
+  off_t count;  /* Number of entries. */
+} lbindex;
+
+/* Appends ".lbidx" (and suffix) to filename, writes it to pathbuf. Returns
+ * NULL if the result is too long.
+ */
+STATIC const char *lbindex_pathname(char *pathbuf, size_t pathbuf_size,
+                                    const char *filename, const char *suffix) {
+  const size_t filename_size = strlen(filename), suffix_size = strlen(suffix);
+  if (filename_size + suffix_size + 7 > pathbuf_size) return NULL;
+  memcpy(pathbuf, filename, filename_size);
+  memcpy(pathbuf + filename_size, ".lbidx", 6);
+  memcpy(pathbuf + filename_size + 6, suffix, suffix_size + 1);
+  return pathbuf;
 }
 
-STATIC void write_all_to_stdout(const char *buf, size_t size) {
-  size_t got = write(STDOUT_FILENO, buf, size);
-  if (got == size) {
-  } else if (got + 1U == 0U) {
-   die2_strerror("error: write stdout", "");
-  } else {
-   die1("error: short write");
+/* Opens the sidecar index of the text file filename (already open as yf).
+ * Returns true on success. Returns false if the index doesn't exist, it is
+ * invalid or stale (i.e. yf has been modified since the index was written).
+ */
+STATIC ybool lbindex_open(lbindex *idx, const char *filename, yfile *yf) {
+  char pathbuf[4096], hdr[LBIDX_HEADER_SIZE];
+  const char *pathname;
+  struct stat st;
+  int fd;
+  if (!(pathname = lbindex_pathname(pathbuf, sizeof(pathbuf), filename, ""))) {
+    return 0;
+  }
+  if (fstat(yf->fd, &st) != 0) return 0;
+  if ((fd = open(pathname, O_RDONLY | O_BINARY, 0)) < 0) return 0;
+  yfopen_fd(&idx->yf, fd, (off_t)-1);
+  if (yfread(&idx->yf, hdr, LBIDX_HEADER_SIZE) != LBIDX_HEADER_SIZE ||
+      0 != memcmp(hdr, LBIDX_MAGIC, 8) ||
+      get_u64le(hdr + 8) != st.st_size ||
+      get_u64le(hdr + 16) != (off_t)st.st_mtime ||
+      get_u64le(hdr + 48) != (off_t)ST_MTIME_NSEC(st) ||
+      get_u64le(hdr + 40) != LBIDX_PREFIX_SIZE ||
+      (idx->count = get_u64le(hdr + 32)) < 0 ||
+      (yfgetsize(&idx->yf) - LBIDX_HEADER_SIZE) / LBIDX_ENTRY_SIZE !=
+      idx->count) {
+    yfclose(&idx->yf);
+    return 0;
   }
+  return 1;
 }
 
-STATIC void print_range(yfile *yf, off_t start, off_t end) {
-  int need;
-  const char *buf;
-  if (start >= end) return;
-  yfseek_set(yf, start);
-  end -= start;
+STATIC void lbindex_close(lbindex *idx) {
+  yfclose(&idx->yf);
+}
+
+/* Compares x[:xsize] with a line, like compare_line, but using only the
+ * prefix of the line: prefix[:prefix_size & ~LBIDX_TRUNCATED], with
+ * LBIDX_TRUNCATED set in prefix_size iff the line is longer.
+ *
+ * Returns 0 or 1 (the same as compare_line would return), or -1 if the
+ * prefix is too short to decide.
+ */
+STATIC int compare_prefix(const unsigned char *prefix, unsigned prefix_size,
+                          const char *x, size_t xsize, compare_mode_t cm) {
+  const ybool is_truncated = (prefix_size & LBIDX_TRUNCATED) != 0;
+  size_t j;
+  prefix_size &= ~LBIDX_TRUNCATED;
+  for (j = 0; ; ++j) {  /* Same logic as in compare_line. */
+    if (j == prefix_size) {
+      if (is_truncated) return -1;
+      return cm == CM_LE ? xsize == j : 0;
+    } else if (j == xsize) {
+      return cm != CM_LP;
+    } else if (*(const unsigned char*)(x + j) != prefix[j]) {
+      return *(const unsigned char*)(x + j) < prefix[j];
+    }
+  }
+}
+
+/* Compares x[:xsize] with the line of entry i of idx, like compare_line,
+ * but using only the prefix of the line in the index. Sets *ofs_out to the
+ * offset of the line. Returns the same as compare_prefix.
+ */
+STATIC int lbindex_compare(lbindex *idx, off_t i, off_t size,
+                           const char *x, size_t xsize, compare_mode_t cm,
+                           off_t *ofs_out) {
+  char entry[LBIDX_ENTRY_SIZE];
+  yfseek_set(&idx->yf, LBIDX_HEADER_SIZE + i * LBIDX_ENTRY_SIZE);
+  if (yfread(&idx->yf, entry, LBIDX_ENTRY_SIZE) != LBIDX_ENTRY_SIZE) {
+    die1("error: sidecar index truncated");
+  }
+  *ofs_out = get_u64le(entry);
+  if (*ofs_out >= size) return 1;  /* EOF (e.g. after flag -i). */
+  if (((unsigned char)entry[8] & ~LBIDX_TRUNCATED) > LBIDX_PREFIX_SIZE) {
+    die1("error: sidecar index corrupt");
+  }
+  return compare_prefix((const unsigned char*)entry + 9,
+                        (unsigned char)entry[8], x, xsize, cm);
+}
+
+/* Narrows [*lo_io, *hi_io] (hi <= size) to the range between the last
+ * index entry whose line is known to be false (e.g. smaller than x) and the
+ * first index entry whose line is known to be true.
+ */
+STATIC void lbindex_narrow(lbindex *idx, off_t size,
+                           const char *x, size_t xsize, compare_mode_t cm,
+                           off_t *lo_io, off_t *hi_io) {
+  off_t a = 0, b = idx->count, m, ofs;
+  off_t lo = *lo_io, hi = *hi_io;
+  /* Find the first entry whose line is not known to be false. */
+  while (a < b) {
+    m = a + ((b - a) >> 1);
+    if (lbindex_compare(idx, m, size, x, xsize, cm, &ofs) == 0) {
+      a = m + 1;
+      if (lo <= ofs) lo = ofs + 1;
+    } else {
+      b = m;
+    }
+  }
+  /* Find the first entry whose line is known to be true. */
+  b = idx->count;
+  while (a < b) {
+    m = a + ((b - a) >> 1);
+    if (lbindex_compare(idx, m, size, x, xsize, cm, &ofs) == 1) {
+      b = m;
+      if (hi > ofs) hi = ofs;
+    } else {
+      a = m + 1;
+    }
+  }
+  if (lo > *hi_io) lo = *hi_io;
+  if (hi < lo) hi = lo;
+  *lo_io = lo;
+  *hi_io = hi;
+}
+
+/* Writes the sidecar index of the text file filename (already open as yf). */
+STATIC void lbindex_write(const char *filename, yfile *yf) {
+  char pathbuf[4096], tmppathname[4096];
+  const char *pathname;
+  char wbuf[YF_READ_BUF_SIZE], *wp = wbuf + LBIDX_HEADER_SIZE, *entry;
+  struct stat st;
+  const off_t size = yfgetsize(yf);
+  off_t ofs, fofs, last_fofs = 0, count = 0;
+  int fd, c;
+  size_t prefix_size;
+  if (!(pathname = lbindex_pathname(pathbuf, sizeof(pathbuf), filename, "")) ||
+      !lbindex_pathname(
+          tmppathname, sizeof(tmppathname), filename, ".XXXXXX")) {
+    die1("error: sidecar index pathname too long");
+  }
+  if (fstat(yf->fd, &st) != 0) die2_strerror("error: fstat ", filename);
+  /* Readable by those who can read the text file. */
+  if ((fd = open_unique(tmppathname, st.st_mode & 0666)) < 0) {
+    die2_strerror("error: open ", tmppathname);
+  }
+  memset(wbuf, '\0', LBIDX_HEADER_SIZE);  /* Header is written last. */
+  for (ofs = LBIDX_STEP; ofs < size; ofs += LBIDX_STEP) {
+    if ((fofs = get_fofs(yf, ofs)) >= size) break;
+    if (fofs == last_fofs) continue;  /* Long line. */
+    last_fofs = fofs;
+    if (wp == wbuf + sizeof(wbuf)) {
+      if (write(fd, wbuf, sizeof(wbuf)) != (int)sizeof(wbuf)) {
+        die2_strerror("error: write ", tmppathname);
+      }
+      wp = wbuf;
+    }
+    entry = wp;
+    wp += LBIDX_ENTRY_SIZE;
+    memset(entry, '\0', LBIDX_ENTRY_SIZE);
+    put_u64le(entry, fofs);
+    yfseek_set(yf, fofs);
+    for (prefix_size = 0; (c = YFGETCHAR(yf)) >= 0 && c != '\n';
+         ++prefix_size) {
+      if (prefix_size == LBIDX_PREFIX_SIZE) {
+        prefix_size |= LBIDX_TRUNCATED;
+        break;
+      }
+      entry[9 + prefix_size] = (char)c;
+    }
+    entry[8] = (char)prefix_size;
+    ++count;
+  }
+  if (write(fd, wbuf, wp - wbuf) != wp - wbuf) {
+    die2_strerror("error: write ", tmppathname);
+  }
+  memcpy(wbuf, LBIDX_MAGIC, 8);
+  put_u64le(wbuf + 8, st.st_size);
+  put_u64le(wbuf + 16, st.st_mtime);
+  put_u64le(wbuf + 24, LBIDX_STEP);
+  put_u64le(wbuf + 32, count);
+  put_u64le(wbuf + 40, LBIDX_PREFIX_SIZE);
+  put_u64le(wbuf + 48, ST_MTIME_NSEC(st));
+  memset(wbuf + 56, '\0', LBIDX_HEADER_SIZE - 56);
+  if (lseek(fd, 0, SEEK_SET) != 0 ||
+      write(fd, wbuf, LBIDX_HEADER_SIZE) != LBIDX_HEADER_SIZE) {
+    die2_strerror("error: write ", tmppathname);
+  }
+  if (close(fd) != 0) die2_strerror("error: close ", tmppathname);
+  if (rename(tmppathname, pathname) != 0) {
+    die2_strerror("error: rename ", tmppathname);
+  }
+}
+
+#if USE_SHM_CACHE
+/* --- Shared memory probe cache (flag -H)
+ *
+ * Each bisect_way on a file starts with the same probes (size / 2, then
+ * size / 4 or 3 * size / 4 etc.), so short-lived processes searching the
+ * same file keep reading the same blocks for the top levels of the
+ * bisection tree. With flag -H, the results of these probes (the ones with
+ * hi - lo >= size >> SHMC_LEVELS) are saved to a direct-mapped table in the
+ * shared memory file /dev/shm/pts_lbsearch.<uid>: the probe offset, its
+ * line start (get_fofs) and the key prefix of the line, like in the sidecar
+ * index. Later probes at the same offset, in any process, are answered from
+ * the table without I/O if the prefix is enough to compare.
+ *
+ * All files of a user share the same table (so replacing files, e.g. by -N
+ * or log rotation, doesn't create new ones): the slot of an entry depends
+ * on the identity of the file (device, inode, size, mtime and the searched
+ * size) and the probe offset. The table is not locked. Each entry has a
+ * checksum, which also covers the identity of the file, so entries torn by
+ * concurrent writers, or written for another file or an earlier version of
+ * the file, are ignored (and then overwritten).
+ */
+
+#define SHMC_LEVELS 14
+#define SHMC_SLOT_COUNT 65536  /* Power of 2. */
+#define SHMC_PREFIX_SIZE 43  /* An entry is 64 bytes with 64-bit off_t. */
+#define SHMC_SLOT(sc, ofs) \
+    ((((unsigned)(ofs) ^ (sc)->seed) * 0x9e3779b1U) >> 8 & \
+     (SHMC_SLOT_COUNT - 1))
+
+typedef struct shmc_entry {
+  off_t ofs;  /* Probe offset. */
+  off_t fofs;  /* get_fofs(ofs). */
+  unsigned check;  /* shmc_check of the entry. */
+  unsigned char prefix_size;  /* Like in the sidecar index. */
+  unsigned char prefix[SHMC_PREFIX_SIZE];
+} shmc_entry;
+
+typedef struct shmcache {
+  shmc_entry *entries;  /* Mapped, SHMC_SLOT_COUNT entries. */
+  unsigned seed;  /* Hash of the file identity, for shmc_check. */
+  off_t min_span;  /* Probes with hi - lo >= min_span are cached. */
+  ybool is_borrowed;  /* The mapping is owned by another handle. */
+} shmcache;
+
+/* Returns the FNV-1a hash of buf[:size], continuing from h. */
+STATIC unsigned shmc_hash(unsigned h, const void *buf, size_t size) {
+  const unsigned char *p = (const unsigned char*)buf, *pend = p + size;
+  for (; p != pend; ++p) {
+    h = (h ^ *p) * 16777619U;
+  }
+  return h;
+}
+
+STATIC unsigned shmc_check(unsigned seed, const shmc_entry *e) {
+  seed = shmc_hash(seed, &e->ofs, sizeof(e->ofs));
+  seed = shmc_hash(seed, &e->fofs, sizeof(e->fofs));
+  seed = shmc_hash(seed, &e->prefix_size, 1);
+  return shmc_hash(seed, e->prefix, SHMC_PREFIX_SIZE);
+}
+
+/* Appends u as 16 hex digits to p. Returns the end. */
+STATIC char *shmc_format_hex(char *p, unsigned long long u) {
+  int shift;
+  for (shift = 60; shift >= 0; shift -= 4) {
+    *p++ = "0123456789abcdef"[(unsigned)(u >> shift) & 15];
+  }
+  return p;
+}
+
+/* Opens (or creates) the shared memory cache of yf, which is already open,
+ * with flag -i applied. Returns true on success. Returns false if shared
+ * memory is not available, and then the search works without the cache.
+ */
+STATIC ybool shmcache_open(shmcache *sc, yfile *yf) {
+  const size_t map_size = SHMC_SLOT_COUNT * sizeof(shmc_entry);
+  char pathbuf[80], *p;
+  struct stat st, shm_st;
+  unsigned long long ident[6];
+  void *map;
+  int fd;
+  if (fstat(yf->fd, &st) != 0) return 0;
+  memcpy(pathbuf, "/dev/shm/pts_lbsearch.", 22);
+  p = shmc_format_hex(pathbuf + 22, getuid());
+  *p = '\0';
+  if ((fd = open(pathbuf, O_RDWR | O_CREAT | O_NOFOLLOW | O_BINARY,
+                 0600)) < 0) {
+    return 0;
+  }
+  /* Don't trust files of other users, they may contain bad entries. */
+  if (fstat(fd, &shm_st) != 0 || shm_st.st_uid != getuid() ||
+      !S_ISREG(shm_st.st_mode) ||
+      (shm_st.st_size < (off_t)map_size && ftruncate(fd, map_size) != 0) ||
+      (map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  fd, 0)) == MAP_FAILED) {
+    close(fd);
+    return 0;
+  }
+  close(fd);
+  sc->entries = (shmc_entry*)map;
+  ident[0] = st.st_dev;
+  ident[1] = st.st_ino;
+  ident[2] = st.st_size;
+  ident[3] = st.st_mtime;
+  ident[4] = ST_MTIME_NSEC(st);
+  ident[5] = yfgetsize(yf);
+  sc->seed = shmc_hash(2166136261U + sizeof(shmc_entry), ident,
+                       sizeof(ident));
+  if ((sc->min_span = yfgetsize(yf) >> SHMC_LEVELS) == 0) sc->min_span = 1;
+  sc->is_borrowed = 0;
+  return 1;
+}
+
+STATIC void shmcache_close(shmcache *sc) {
+  if (!sc->is_borrowed) {
+    munmap((void*)sc->entries, SHMC_SLOT_COUNT * sizeof(shmc_entry));
+  }
+}
+
+/* Compares x[:xsize] with the line at get_fofs(ofs) using the entry of ofs
+ * in sc. Sets *fofs_out to get_fofs(ofs) if the entry is found.
+ *
+ * Returns the same as compare_prefix, or -2 if ofs is not in sc.
+ */
+STATIC int shmcache_compare(const shmcache *sc, off_t ofs, off_t size,
+                            const char *x, size_t xsize, compare_mode_t cm,
+                            off_t *fofs_out) {
+  shmc_entry e;
+  /* Copy it first, because other processes may be overwriting it. */
+  memcpy(&e, sc->entries + SHMC_SLOT(sc, ofs), sizeof(e));
+  if (e.ofs != ofs || e.check != shmc_check(sc->seed, &e) ||
+      (e.prefix_size & ~LBIDX_TRUNCATED) > SHMC_PREFIX_SIZE) {
+    return -2;
+  }
+  *fofs_out = e.fofs;
+  if (e.fofs >= size) return 1;  /* EOF. */
+  return compare_prefix(e.prefix, e.prefix_size, x, xsize, cm);
+}
+
+/* Saves the line of yf at fofs == get_fofs(ofs) to the entry of ofs in sc. */
+STATIC void shmcache_put(const shmcache *sc, yfile *yf, off_t ofs,
+                         off_t fofs) {
+  shmc_entry e;
+  unsigned prefix_size;
+  int c;
+  memset(&e, '\0', sizeof(e));
+  e.ofs = ofs;
+  e.fofs = fofs;
+  yfseek_set(yf, fofs);
+  for (prefix_size = 0; (c = YFGETCHAR(yf)) >= 0 && c != '\n';
+       ++prefix_size) {
+    if (prefix_size == SHMC_PREFIX_SIZE) {
+      prefix_size |= LBIDX_TRUNCATED;
+      break;
+    }
+    e.prefix[prefix_size] = (unsigned char)c;
+  }
+  e.prefix_size = (unsigned char)prefix_size;
+  e.check = shmc_check(sc->seed, &e);
+  memcpy(sc->entries + SHMC_SLOT(sc, ofs), &e, sizeof(e));
+}
+
+/* Like get_using_cache for a probe at ofs, but tries sc first, and saves
+ * the result to sc if it was not there.
+ */
+STATIC const struct cache_entry *shmcache_get_using_cache(
+    const shmcache *sc, yfile *yf, struct cache *cache, off_t ofs,
+    const char *x, size_t xsize, compare_mode_t cm) {
+  const struct cache_entry *entry;
+  off_t fofs;
+  const int r = shmcache_compare(sc, ofs, yfgetsize(yf), x, xsize, cm,
+                                 &fofs);
+  if (r >= 0) {
+    ++yf->stats.shm_hit_count;
+    return cache_put(cache, ofs, fofs, r);
+  } else if (r == -1) {  /* Only the comparison needs I/O. */
+    return cache_put(cache, ofs, fofs, compare_line(yf, fofs, x, xsize, cm));
+  }
+  entry = get_using_cache(yf, cache, ofs, x, xsize, cm);
+  shmcache_put(sc, yf, ofs, entry->fofs);
+  return entry;
+}
+#endif
+
+#if USE_IO_URING
+/* --- k-ary search with io_uring (flag -K)
+ *
+ * Before the bisection in bisect_way, the interval [lo, hi) is narrowed in
+ * rounds: each round reads the blocks of k-1 evenly spaced probes in
+ * parallel (as a single batch of io_uring reads, which keeps a deep queue
+ * busy on NVMe devices), then it does the get_fofs and compare_line of the
+ * probes in increasing offset order on these blocks, and the interval is
+ * narrowed to the 1/k of it between 2 adjacent probes. For sorted input,
+ * the result is the same as with plain bisection, because both find the
+ * first line for which compare_line is true.
+ *
+ * We use the system calls directly, because liburing is usually not
+ * installed. If io_uring is not available (e.g. old kernel, seccomp or
+ * kernel.io_uring_disabled), then yuring_open fails, and only the plain
+ * bisection is done.
+ */
+
+#define KARY_DEFAULT_K 16
+#define KARY_MAX_K 64
+/* Each probe reads 2 blocks, so that lines crossing a block boundary are
+ * usually read in the same round.
+ */
+#define KARY_READ_SIZE (YF_READ_BUF_SIZE * 2)
+
+typedef struct yuring {
+  int fd;  /* io_uring file descriptor, or -1. */
+  int k;  /* Number of subintervals per round, 2 <= k <= KARY_MAX_K. */
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_map, *cq_map;  /* MAP_FAILED if not mapped. */
+  size_t sq_map_size, cq_map_size, sqes_size;
+  char *bufs;  /* k-1 read buffers of KARY_READ_SIZE bytes each. */
+} yuring;
+
+STATIC void yuring_close(yuring *ur) {
+  if (ur->bufs) free(ur->bufs);
+  if (ur->sqes != MAP_FAILED) munmap(ur->sqes, ur->sqes_size);
+  if (ur->cq_map != MAP_FAILED) munmap(ur->cq_map, ur->cq_map_size);
+  if (ur->sq_map != MAP_FAILED) munmap(ur->sq_map, ur->sq_map_size);
+  if (ur->fd >= 0) close(ur->fd);
+  ur->fd = -1;
+  ur->bufs = NULL;
+  ur->sqes = (struct io_uring_sqe*)MAP_FAILED;
+  ur->sq_map = ur->cq_map = MAP_FAILED;
+}
+
+/* Sets up an io_uring for k-ary search. Returns false if io_uring is not
+ * available.
+ */
+STATIC ybool yuring_open(yuring *ur, int k) {
+  struct io_uring_params params;
+  char *sq, *cq;
+  ur->fd = -1;
+  ur->k = k;
+  ur->bufs = NULL;
+  ur->sqes = (struct io_uring_sqe*)MAP_FAILED;
+  ur->sq_map = ur->cq_map = MAP_FAILED;
+  memset(&params, '\0', sizeof(params));
+  if ((ur->fd = syscall(__NR_io_uring_setup, k - 1, &params)) < 0) return 0;
+  /* IORING_OP_READ is supported since Linux 5.6, just like this feature. */
+  if (!(params.features & IORING_FEAT_RW_CUR_POS)) goto error;
+  ur->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ur->cq_map_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ur->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  if ((ur->sq_map = mmap(NULL, ur->sq_map_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, ur->fd, IORING_OFF_SQ_RING)) ==
+      MAP_FAILED ||
+      (ur->cq_map = mmap(NULL, ur->cq_map_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, ur->fd, IORING_OFF_CQ_RING)) ==
+      MAP_FAILED ||
+      (ur->sqes = (struct io_uring_sqe*)mmap(
+          NULL, ur->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, ur->fd,
+          IORING_OFF_SQES)) == MAP_FAILED ||
+      !(ur->bufs = (char*)malloc((size_t)(k - 1) * KARY_READ_SIZE))) {
+    goto error;
+  }
+  sq = (char*)ur->sq_map;
+  cq = (char*)ur->cq_map;
+  ur->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  ur->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+  ur->sq_array = (unsigned*)(sq + params.sq_off.array);
+  ur->cq_head = (unsigned*)(cq + params.cq_off.head);
+  ur->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  ur->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+  ur->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+  return 1;
+ error:
+  yuring_close(ur);
+  return 0;
+}
+
+/* Reads the blocks at file offsets bs[:n] (n <= k-1) of yf in parallel, the
+ * block i to ur->bufs + i * KARY_READ_SIZE. Sets sizes[i] to the number of
+ * bytes read, or -1 on error.
+ */
+STATIC void yuring_read(yuring *ur, yfile *yf, const off_t *bs, int n,
+                        int *sizes) {
+  struct io_uring_sqe *sqe;
+  const struct io_uring_cqe *cqe;
+  unsigned tail = *ur->sq_tail, head, idx;
+  int i, to_submit = n, done = 0, got;
+  for (i = 0; i < n; ++i) {
+    idx = tail++ & *ur->sq_mask;
+    sqe = ur->sqes + idx;
+    memset(sqe, '\0', sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = yf->fd;
+    sqe->off = bs[i];
+    sqe->addr = (unsigned long)(ur->bufs + (size_t)i * KARY_READ_SIZE);
+    sqe->len = bs[i] + KARY_READ_SIZE + 0ULL > yf->size + 0ULL ?
+        (unsigned)(yf->size - bs[i]) : KARY_READ_SIZE;
+    sqe->user_data = i;
+    ur->sq_array[idx] = idx;
+    sizes[i] = -1;
+  }
+  __atomic_store_n(ur->sq_tail, tail, __ATOMIC_RELEASE);
+  yf->stats.read_count += n;
+  while (done < n) {
+    got = syscall(__NR_io_uring_enter, ur->fd, to_submit, n - done,
+                  IORING_ENTER_GETEVENTS, NULL, 0);
+    if (got < 0) {
+      if (errno == EINTR) continue;
+      die2_strerror("error: io_uring_enter", "");
+    }
+    to_submit -= got;
+    head = *ur->cq_head;
+    for (; head != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE); ++head) {
+      cqe = ur->cqes + (head & *ur->cq_mask);
+      if ((sizes[cqe->user_data] = cqe->res) > 0) {
+        yf->stats.read_bytes += cqe->res;
+      }
+      ++done;
+    }
+    __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+  }
+}
+
+/* Narrows [*lo_io, *hi_io) in k-ary rounds (see above), keeping the
+ * invariant of bisect_way: compare_line is false for the lines of all
+ * probes before lo, and true at hi.
+ */
+STATIC void kary_narrow(yfile *yf, yuring *ur, off_t *lo_io, off_t *hi_io,
+                        const char *x, size_t xsize, compare_mode_t cm) {
+  off_t lo = *lo_io, hi = *hi_io, step, b;
+  off_t mids[KARY_MAX_K - 1], bs[KARY_MAX_K - 1];
+  int slots[KARY_MAX_K - 1], sizes[KARY_MAX_K - 1];
+  const int k = ur->k;
+  int i, n;
+  char *buf;
+  ybool cmp_result = 0;
+  /* No need for parallel reads if mapped, and BGZF blocks are decompressed
+   * one by one anyway.
+   */
+  if (YF_IS_MAPPED(yf) || YF_IS_COMPRESSED(yf)) return;
+  /* Below 1 block, the bisection needs at most 2 reads anyway. */
+  while (hi - lo > YF_READ_BUF_SIZE) {
+    step = (hi - lo) / k;
+    for (i = n = 0; i < k - 1; ++i) {
+      mids[i] = lo + step * (i + 1);
+      b = (mids[i] - 1) & -YF_READ_BUF_SIZE;  /* get_fofs starts at mid-1. */
+      if (n == 0 || bs[n - 1] != b) bs[n++] = b;
+      slots[i] = n - 1;
+    }
+    ++yf->stats.kary_round_count;
+    yuring_read(ur, yf, bs, n, sizes);
+    for (i = 0; i < k - 1; ++i) {
+      /* Use the block as the read buffer of yf. If the line doesn't fit,
+       * the rest is read by yfgetc as usual.
+       */
+      buf = ur->bufs + (size_t)slots[i] * KARY_READ_SIZE;
+      if (sizes[slots[i]] > 0) {
+        yf->buf = yf->p = buf;
+        yf->rend = buf + sizes[slots[i]];
+        yf->ofs = bs[slots[i]];
+      }
+      ++yf->stats.probe_count;
+      cmp_result = compare_line(yf, get_fofs(yf, mids[i]), x, xsize, cm);
+      if (yf->buf == buf) {  /* Forget buf, it will be overwritten. */
+        yf->buf = yf->rbuf;
+        yf->p = yf->rend = YF_FORGOTTEN(yf);
+        yf->ofs = -(YF_READ_BUF_SIZE + 1);
+      }
+      if (cmp_result) break;
+      lo = mids[i] + 1;
+    }
+    if (cmp_result) hi = mids[i];
+  }
+  *lo_io = lo;
+  *hi_io = hi;
+}
+#endif
+
+/* Options of bisect_way. NULL means all defaults. */
+typedef struct bisect_opts {
+  lbindex *idx;  /* Sidecar index to narrow the search, or NULL. */
+  ybool is_interpolation;  /* Flag -u: do interpolation search. */
+  int prefetch_depth;  /* Flag -h<N>: levels of probes to prefetch. */
+#if USE_IO_URING
+  yuring *uring;  /* Flag -K: do k-ary search with this io_uring, or NULL. */
+#endif
+#if USE_SHM_CACHE
+  shmcache *shmc;  /* Flag -H: shared memory probe cache, or NULL. */
+#endif
+} bisect_opts;
+
+/* --- Prefetching (flag -h)
+ *
+ * Before each probe of bisect_way, we know the 2 possible next probes (and
+ * their 4 possible next probes etc.), so we ask the kernel to start reading
+ * their blocks in the background, while we read and compare the current
+ * line. This helps if reads have a high latency (e.g. network filesystems
+ * and spinning disks), and the file is not in the page cache.
+ */
+
+/* Hints the kernel that get_fofs(yf, ofs) will be called soon. */
+STATIC void yfprefetch(yfile *yf, off_t ofs) {
+#if YF_USE_FADVISE
+  off_t b;
+  if (ofs == 0) return;
+  b = (ofs - 1) & -YF_READ_BUF_SIZE;
+  if (!YF_IS_MAPPED(yf) && yf->p != YF_FORGOTTEN(yf) &&
+      b + 0ULL - yf->ofs < yf->rend - yf->buf + 0ULL) {
+    return;  /* Already in the read buffer. */
+  }
+#if USE_ZLIB
+  if (yf->bgzf) {  /* Prefetch the compressed block. */
+    const ybgzf *bz = yf->bgzf;
+    off_t i;
+    if (ofs - 1 >= bz->uofs[bz->count]) return;
+    if ((i = ybgzf_find(bz, ofs - 1)) == bz->block) return;
+    ++yf->stats.prefetch_count;
+    (void)posix_fadvise(yf->fd, bz->cofs[i], bz->cofs[i + 1] - bz->cofs[i],
+                        POSIX_FADV_WILLNEED);
+    return;
+  }
+#endif
+  ++yf->stats.prefetch_count;
+  (void)posix_fadvise(yf->fd, b, YF_READ_BUF_SIZE, POSIX_FADV_WILLNEED);
+#else
+  (void)yf; (void)ofs;
+#endif
+}
+
+/* Prefetches the next depth levels of midpoint probes of bisect_way after
+ * the probe at mid within [lo, hi).
+ */
+STATIC void prefetch_probes(yfile *yf, off_t lo, off_t mid, off_t hi,
+                            int depth) {
+  off_t next;
+  /* Small intervals are read by the current probe anyway. */
+  if (depth <= 0 || hi - lo <= YF_READ_BUF_SIZE) return;
+  if (lo < mid) {  /* The probe at mid will set hi = mid. */
+    yfprefetch(yf, next = (lo + mid) >> 1);
+    prefetch_probes(yf, lo, next, mid, depth - 1);
+  }
+  if (mid + 1 < hi) {  /* The probe at mid will set lo = mid + 1. */
+    yfprefetch(yf, next = (mid + 1 + hi) >> 1);
+    prefetch_probes(yf, mid + 1, next, hi, depth - 1);
+  }
+}
+
+/* --- Interpolation search
+ *
+ * If the keys are distributed uniformly (e.g. hex hashes, zero-padded
+ * numbers), the position of x between the lines at lo and hi can be
+ * estimated from the first few bytes (the key) of x and these lines, after
+ * their common prefix. In bisect_way, each estimated probe is followed by a
+ * guard probe a small gap (1/64 of the interval) away from it on the side of
+ * x, to bracket x if the estimate was close. If the guard misses, the next
+ * probe is a midpoint, and after 2 consecutive misses we switch to plain
+ * bisection, so we never do more than a few probes more than plain
+ * bisection, and we still terminate on unsorted input, because each probe is
+ * within [lo, hi).
+ */
+
+#define INTERP_KEY_SIZE 16  /* Number of bytes of keys remembered. */
+#define INTERP_NUM_SIZE 6  /* Number of key bytes used after the prefix. */
+
+/* Reads the first INTERP_KEY_SIZE bytes of the line at fofs to key, padded
+ * with '\0'.
+ */
+STATIC void get_line_key(yfile *yf, off_t fofs, unsigned char *key) {
+  int i, c;
+  yfseek_set(yf, fofs);
+  for (i = 0; i < INTERP_KEY_SIZE && (c = YFGETCHAR(yf)) >= 0 && c != '\n';
+       ++i) {
+    key[i] = (unsigned char)c;
+  }
+  memset(key + i, '\0', INTERP_KEY_SIZE - i);
+}
+
+/* Returns the value of byte c as a digit in base (10, 16 or 256), or -1 if
+ * it isn't a digit. '\0' (padding) is 0.
+ */
+STATIC int digit_value(int c, int base) {
+  if (base == 256 || c == '\0') return c;
+  if (c >= '0' && c <= '9') return c - '0';
+  if (base == 16 && c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (base == 16 && c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+/* Returns the INTERP_NUM_SIZE bytes at key[d:] as a big endian number in
+ * base, or -1 if some of them are not digits in base.
+ */
+STATIC double key_to_num(const unsigned char *key, size_t d, int base) {
+  double num = 0;
+  size_t i;
+  int v;
+  for (i = d; i < d + INTERP_NUM_SIZE; ++i) {
+    if ((v = digit_value(i < INTERP_KEY_SIZE ? key[i] : 0, base)) < 0) {
+      return -1;
+    }
+    num = num * base + v;
+  }
+  return num;
+}
+
+/* Estimates the offset of x in [lo, hi), given the keys of the lines just
+ * before lo and at hi. Returns -1 if it can't be estimated.
+ */
+STATIC off_t interpolate(off_t lo, off_t hi, const unsigned char *lo_key,
+                         const unsigned char *hi_key,
+                         const char *x, size_t xsize) {
+  unsigned char x_key[INTERP_KEY_SIZE];
+  size_t d;
+  double lo_num, hi_num, x_num;
+  off_t mid;
+  int base;
+  for (d = 0; d < INTERP_KEY_SIZE && lo_key[d] == hi_key[d]; ++d) {}
+  if (d == INTERP_KEY_SIZE) return -1;
+  if (xsize > INTERP_KEY_SIZE) xsize = INTERP_KEY_SIZE;
+  memcpy(x_key, x, xsize);
+  memset(x_key + xsize, '\0', INTERP_KEY_SIZE - xsize);
+  if (0 != memcmp(x_key, lo_key, d)) return -1;  /* Unsorted input. */
+  /* Keys of decimal or hex digits are converted by digit value, otherwise
+   * the gaps between the digits in ASCII would distort the estimate.
+   */
+  for (base = 10; base <= 256; base = base == 10 ? 16 : 256) {
+    if ((lo_num = key_to_num(lo_key, d, base)) >= 0 &&
+        (hi_num = key_to_num(hi_key, d, base)) >= 0 &&
+        (x_num = key_to_num(x_key, d, base)) >= 0) break;
+  }
+  if (!(lo_num <= x_num && x_num <= hi_num && lo_num < hi_num)) return -1;
+  mid = lo + (off_t)((hi - lo) * ((x_num - lo_num) / (hi_num - lo_num)));
+  return mid < lo ? lo : mid >= hi ? hi - 1 : mid;
+}
+
+/* With fixed-width records (flag -w), returns the middle one of the record
+ * starts in [lo, hi), or -1 if there is none, so that each probe reads a
+ * different record.
+ */
+STATIC off_t record_mid(const yfile *yf, off_t lo, off_t hi) {
+  const off_t lo_i = (lo + yf->reclen - 1) / yf->reclen;
+  const off_t hi_i = (hi + yf->reclen - 1) / yf->reclen;
+  return lo_i < hi_i ? ((lo_i + hi_i) >> 1) * yf->reclen : -1;
+}
+
+/* x[:xsize] must not contain '\n'.
+ *
+ * cm=CM_LE is equivalent to is_left=true and is_open=true.
+ * cm=CM_LT is equivalent to is_left=false and is_open=false.
+ * cm=CL_LP is also supported, it does prefix search.
+ */
+STATIC off_t bisect_way(
+    yfile *yf, struct cache *cache, const bisect_opts *opts, off_t lo, off_t hi,
+    const char *x, size_t xsize, compare_mode_t cm) {
+  const off_t size = yfgetsize(yf);
+  off_t mid, midf;
+  const struct cache_entry *entry;
+  /* Interpolation search state. */
+  unsigned char lo_key[INTERP_KEY_SIZE], hi_key[INTERP_KEY_SIZE];
+  /* -1: disabled; bit 0: lo_key is known, bit 1: hi_key is known, bit 2: do
+   * a midpoint probe next.
+   */
+  int interp = opts && opts->is_interpolation ? 4 : -1;
+  int kind;  /* Kind of the probe at mid: 0: midpoint, 1: estimate, 2: guard. */
+  int misses = 0;  /* Number of consecutive guard probes missed. */
+  off_t old_size = 0, gap = 0, guard = -1;
+  if (hi + 0ULL > size + 0ULL) hi = size;  /* Also applies to hi == -1. */
+  if (xsize == 0) {  /* Shortcuts. */
+    if (cm == CM_LE) hi = lo;  /* Faster for lo == 0. Returns right below. */
+    if (cm == CM_LP && hi == size) return hi;
+  }
+  if (lo < hi && opts && opts->idx) {
+    lbindex_narrow(opts->idx, size, x, xsize, cm, &lo, &hi);
+  }
+#if USE_IO_URING
+  if (lo < hi && opts && opts->uring) {
+    kary_narrow(yf, opts->uring, &lo, &hi, x, xsize, cm);
+  }
+#endif
+  if (lo >= hi) return get_fofs_using_cache(yf, cache, lo);
+  do {
+    kind = 0;
+    if (interp >= 0) {
+      if (guard >= lo && guard < hi) {
+        mid = guard;
+        kind = 2;
+      } else if (interp == 3 &&
+                 (mid = interpolate(lo, hi, lo_key, hi_key, x, xsize)) >= 0) {
+        kind = 1;
+      } else {
+        interp &= 3;
+      }
+      guard = -1;
+      old_size = hi - lo;
+    }
+    if (kind == 0) {
+      mid = (lo + hi) >> 1;
+      if (yf->reclen != 0 && (mid = record_mid(yf, lo, hi)) < 0) {
+        return get_fofs_using_cache(yf, cache, lo);  /* No record in it. */
+      }
+    }
+    if (interp < 0 && opts && opts->prefetch_depth > 0) {
+      prefetch_probes(yf, lo, mid, hi, opts->prefetch_depth);
+    }
+    ++yf->stats.probe_count;
+#if USE_SHM_CACHE
+    if (interp < 0 && opts && opts->shmc && hi - lo >= opts->shmc->min_span) {
+      entry = shmcache_get_using_cache(
+          opts->shmc, yf, cache, mid, x, xsize, cm);
+    } else
+#endif
+    {
+      entry = get_using_cache(yf, cache, mid, x, xsize, cm);
+    }
+    midf = entry->fofs;
+    if (entry->cmp_result) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+    if (interp >= 0) {
+      interp |= entry->cmp_result ? 2 : 1;
+      if (kind == 1) {  /* Bracket the estimate from the side of x. */
+        gap = (old_size >> 6) + 1;
+        guard = entry->cmp_result ? mid - gap : mid + gap;
+      } else if (kind == 2 && hi - lo > gap) {
+        interp |= 4;  /* The guard has missed, do a midpoint probe next. */
+        if (++misses == 2) interp = -1;  /* Keys are not uniform enough. */
+      } else if (kind == 2) {
+        misses = 0;
+      }
+      if (lo < hi && interp >= 0) {
+        get_line_key(yf, midf, entry->cmp_result ? hi_key : lo_key);
+      }
+    }
+  } while (lo < hi);
+  return mid == lo ? midf : get_fofs_using_cache(yf, cache, lo);
+}
+
+/* x[:xsize] and y[:ysize] must not contain '\n'. */
+STATIC void bisect_interval(
+    yfile *yf, const bisect_opts *opts, off_t lo, off_t hi, compare_mode_t cm,
+    const char *x, size_t xsize,
+    const char *y, size_t ysize,
+    off_t *start_out, off_t *end_out) {
+  off_t start;
+  struct cache cache;
+  /* TODO(pts): If y < x, then don't even read the file. Smart compare! */
+  cache_init(&cache);
+  *start_out = start = bisect_way(yf, &cache, opts, lo, hi, x, xsize, CM_LE);
+  ystats_mark(&yf->stats, YS_START);
+  if (cm == CM_LE && xsize == ysize && 0 == memcmp(x, y, xsize)) {
+    *end_out = start;
+  } else {
+    /* Don't use a shared cache, because x or cm are different. */
+    cache_init(&cache);
+    *end_out = bisect_way(yf, &cache, opts, start, hi, y, ysize, cm);
+  }
+  ystats_mark(&yf->stats, YS_END);
+}
+
+/* --- Output */
+
+/* Writes buf[:size] to fd. Returns false on error. */
+STATIC ybool write_all(int fd, const char *buf, size_t size) {
+  long got;
+  while (size > 0) {
+    if ((got = write(fd, buf, size)) <= 0) {
+      if (got < 0 && errno == EINTR) continue;
+      return 0;
+    }
+    buf += got;
+    size -= got;
+  }
+  return 1;
+}
+
+STATIC void write_all_to_stdout(const char *buf, size_t size) {
+  if (!write_all(STDOUT_FILENO, buf, size)) {
+    die2_strerror("error: write stdout", "");
+  }
+}
+
+/* Ranges at least this large are printed with in-kernel copying or large
+ * reads.
+ */
+#define PRINT_LARGE_SIZE (YF_READ_BUF_SIZE * 8)
+#define PRINT_MAX_CHUNK_SIZE (1 << 20)
+
+#if USE_KERNEL_COPY
+/* Copies yf[*start_io:end] to out_fd within the kernel, without copying to
+ * user space, using copy_file_range(2) (if out_fd is a regular file) or
+ * sendfile(2) (e.g. for pipes and sockets). Advances *start_io by the number
+ * of bytes copied, which is less than requested if the kernel doesn't
+ * support copying between these file descriptors. Returns false on write
+ * error.
+ */
+STATIC ybool print_range_in_kernel(yfile *yf, int out_fd, off_t *start_io,
+                                   off_t end) {
+  struct stat st;
+  off_t ofs = *start_io;
+  long got;
+  size_t need;
+  ybool is_copy_file_range = 0;
+#ifdef __NR_copy_file_range
+  is_copy_file_range = fstat(out_fd, &st) == 0 && S_ISREG(st.st_mode);
+#else
+  (void)st;
+#endif
+  while (ofs < end) {
+    need = end - ofs > 0x40000000 ? 0x40000000 : (size_t)(end - ofs);
+    ++yf->stats.copy_count;
+#ifdef __NR_copy_file_range
+    if (is_copy_file_range) {
+      got = syscall(__NR_copy_file_range, yf->fd, &ofs, out_fd, NULL,
+                    need, 0);
+    } else
+#endif
+    {
+      got = sendfile(out_fd, yf->fd, &ofs, need);
+    }
+    if (got > 0) continue;  /* ofs has been advanced by the kernel. */
+    if (got < 0 && is_copy_file_range &&
+        (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+         errno == EBADF || errno == EOPNOTSUPP)) {
+      is_copy_file_range = 0;  /* Try sendfile(2) instead. */
+      continue;
+    }
+    if (got < 0 && errno == EINTR) continue;
+    if (got < 0 && errno != EINVAL && errno != ENOSYS &&
+        errno != EOPNOTSUPP && errno != EAGAIN) {
+      return 0;
+    }
+    break;  /* Not supported, or EOF (file got shorter). */
+  }
+  *start_io = ofs;
+  return 1;
+}
+#endif
+
+/* Prints yf[start:end] to out_fd by reading it in chunks growing up to
+ * PRINT_MAX_CHUNK_SIZE directly from the file, bypassing the read buffer.
+ * Advances *start_io by the number of bytes printed. Returns false on write
+ * error.
+ */
+STATIC ybool print_range_in_chunks(yfile *yf, int out_fd, off_t *start_io,
+                                   off_t end) {
+  size_t chunk_size = PRINT_LARGE_SIZE;
+  char *chunk = NULL, *new_chunk;
+  off_t ofs = *start_io;
+  int got, need;
+  ybool is_ok = 1;
+  while (ofs < end) {
+    if ((new_chunk = (char*)realloc(chunk, chunk_size)) == NULL) break;
+    chunk = new_chunk;
+    need = end - ofs > (off_t)chunk_size ? (int)chunk_size : (int)(end - ofs);
+    if ((got = yfpread(yf, chunk, need, ofs)) < 0) {
+      die2_strerror("error: read", "");
+    }
+    if (got == 0) break;  /* EOF, the file got shorter. */
+    if (!(is_ok = write_all(out_fd, chunk, got))) break;
+#if YF_USE_DIRECT
+    if (yf->is_cold) {  /* Drop the pages behind the read cursor. */
+      (void)!posix_fadvise(yf->fd, ofs, got, POSIX_FADV_DONTNEED);
+    }
+#endif
+    ofs += got;
+    if (chunk_size < PRINT_MAX_CHUNK_SIZE) chunk_size <<= 1;
+  }
+  free(chunk);
+  *start_io = ofs;
+  return is_ok;
+}
+
+#if YF_USE_DIRECT
+/* Alignment of the file offset, size and buffer of O_DIRECT reads. */
+#define YF_DIRECT_ALIGN 4096
+
+/* Prints yf[*start_io:end] to out_fd by reading it from yf->direct_fd
+ * (opened with O_DIRECT) in aligned chunks of PRINT_MAX_CHUNK_SIZE,
+ * bypassing the page cache. Advances *start_io by the number of bytes
+ * printed, which is less than requested if a read fails. Returns false on
+ * write error.
+ */
+STATIC ybool print_range_direct(yfile *yf, int out_fd, off_t *start_io,
+                                off_t end) {
+  char *chunk0, *chunk;
+  off_t ofs = *start_io & -(off_t)YF_DIRECT_ALIGN;
+  long got;
+  size_t skip, need;
+  ybool is_ok = 1;
+  if (!(chunk0 = (char*)malloc(PRINT_MAX_CHUNK_SIZE + YF_DIRECT_ALIGN))) {
+    return 1;
+  }
+  chunk = chunk0 + (-(size_t)chunk0 & (YF_DIRECT_ALIGN - 1));
+  while (*start_io < end) {
+    ++yf->stats.read_count;
+    got = pread(yf->direct_fd, chunk, PRINT_MAX_CHUNK_SIZE, ofs);
+    if (got < 0 && errno == EINTR) continue;
+    /* On EOF (the file got shorter) or error, the caller falls back. */
+    if (got <= *start_io - ofs) break;
+    yf->stats.read_bytes += got;
+    skip = (size_t)(*start_io - ofs);
+    need = got - skip;
+    if (need > (size_t)(end - *start_io)) need = (size_t)(end - *start_io);
+    if (!(is_ok = write_all(out_fd, chunk + skip, need))) break;
+    *start_io += need;
+    ofs += got;
+    if (got & (YF_DIRECT_ALIGN - 1)) break;  /* Unaligned, at EOF. */
+  }
+  free(chunk0);
+  return is_ok;
+}
+#endif
+
+/* Prints yf[start:end] to out_fd. Returns false on write error. */
+STATIC ybool print_range(yfile *yf, int out_fd, off_t start, off_t end) {
+  int need;
+  const char *buf;
+  ybool is_ok = 1, is_cold = 0;
+  if (start >= end) return 1;
 #if defined(__MSDOS__) || defined(_WIN32) || defined(_WIN64)
   /* _WIN32 and _WIN64 cover __CYGWIN__, __MINGW32__, __MINGW64__ and
    * _MSC_VER > 1000, no need to check for more.
    */
-  setmode(STDOUT_FILENO, O_BINARY);
+  setmode(out_fd, O_BINARY);
 #endif
-  while ((need = yfpeek(yf, end, &buf)) > 0) {
-    write_all_to_stdout(buf, need);
+  if (end - start >= PRINT_LARGE_SIZE) {
+    /* Bisection is finished, we don't need the read buffer anymore. */
+#if YF_USE_DIRECT
+    if ((is_cold = yf->is_cold) && yf->direct_fd >= 0) {
+      is_ok = print_range_direct(yf, out_fd, &start, end);
+    }
+#endif
+#if USE_KERNEL_COPY
+    if (!YF_IS_COMPRESSED(yf) && !is_cold) {
+      is_ok = print_range_in_kernel(yf, out_fd, &start, end);
+    }
+#endif
+    /* With flag -d, don't read the mapped file, it would fill the page
+     * cache.
+     */
+    if (is_ok && (!YF_IS_MAPPED(yf) || is_cold) &&
+        end - start >= PRINT_LARGE_SIZE) {
+      is_ok = print_range_in_chunks(yf, out_fd, &start, end);
+    }
+  }
+  yfseek_set(yf, start);
+  end -= start;
+  while (is_ok && (need = yfpeek(yf, end, &buf)) > 0) {
+    is_ok = write_all(out_fd, buf, need);
     yfseek_cur(yf, need);
     end -= need;
   }
@@ -571,224 +2785,2901 @@ STATIC void print_range(yfile *yf, off_t start, off_t end) {
   /* _WIN32 and _WIN64 cover __CYGWIN__, __MINGW32__, __MINGW64__ and
    * _MSC_VER > 1000, no need to check for more.
    */
-  setmode(STDOUT_FILENO, 0);
+  setmode(out_fd, 0);
+#endif
+  return is_ok;
+}
+
+/* Returns the number of '\n' bytes in buf[:size]. It checks a word at a
+ * time, with the zero byte trick on the word xored with '\n' bytes.
+ */
+STATIC off_t count_newlines(const char *buf, size_t size) {
+  const unsigned long ones = ~0UL / 255;  /* 0x0101...01. */
+  const unsigned long nls = ones * '\n', lows = ones * 0x7f;
+  const char *end = buf + size;
+  unsigned long w, acc;
+  off_t count = 0;
+  int i;
+  while ((size_t)(end - buf) >= sizeof(w)) {
+    /* Each byte of acc counts up to 31, so their sum fits in a byte. */
+    for (acc = 0, i = 0; i < 31 && (size_t)(end - buf) >= sizeof(w);
+         ++i, buf += sizeof(w)) {
+      memcpy(&w, buf, sizeof(w));
+      w ^= nls;  /* Now the '\n' bytes are 0. */
+      acc += (~(((w & lows) + lows) | w) >> 7) & ones;  /* 1 for a 0 byte. */
+    }
+    count += (acc * ones) >> (sizeof(w) * 8 - 8);  /* Sum of the bytes. */
+  }
+  for (; buf != end; ++buf) count += *buf == '\n';
+  return count;
+}
+
+/* Returns the number of lines in yf[start:end], including an incomplete
+ * last line. It counts in place: in the mapped file or in the read buffer,
+ * or (for large ranges) in chunks read directly from the file, like
+ * print_range_in_chunks.
+ */
+STATIC off_t count_lines(yfile *yf, off_t start, off_t end) {
+  size_t chunk_size = PRINT_LARGE_SIZE;
+  char *chunk = NULL, *new_chunk;
+  const char *buf;
+  off_t count = 0;
+  int got;
+  char last = '\n';
+  if (start >= end) return 0;
+  if (!YF_IS_MAPPED(yf)) {
+    while (end - start >= PRINT_LARGE_SIZE) {
+      if ((new_chunk = (char*)realloc(chunk, chunk_size)) == NULL) break;
+      chunk = new_chunk;
+      got = end - start > (off_t)chunk_size ?
+          (int)chunk_size : (int)(end - start);
+      if ((got = yfpread(yf, chunk, got, start)) < 0) {
+        die2_strerror("error: read", "");
+      }
+      if (got == 0) break;  /* EOF, the file got shorter. */
+      count += count_newlines(chunk, got);
+      last = chunk[got - 1];
+      start += got;
+      if (chunk_size < PRINT_MAX_CHUNK_SIZE) chunk_size <<= 1;
+    }
+    free(chunk);
+  }
+  yfseek_set(yf, start);
+  end -= start;
+  while ((got = yfpeek(yf, end, &buf)) > 0) {
+    count += count_newlines(buf, got);
+    last = buf[got - 1];
+    yfseek_cur(yf, got);
+    end -= got;
+  }
+  return count + (last != '\n');
+}
+
+/* Returns the offset after the first n (> 0) lines of yf[start:end], or
+ * end if it has fewer lines (flag -m<N>).
+ */
+STATIC off_t skip_lines(yfile *yf, off_t start, off_t end, off_t n) {
+  const char *buf, *p, *nl;
+  int got;
+  for (;;) {
+    yfseek_set(yf, start);
+    if ((got = yfpeek(yf, end - start, &buf)) <= 0) return end;
+    for (p = buf; (nl = (const char*)memchr(p, '\n', buf + got - p));
+         p = nl + 1) {
+      if (--n == 0) return start + (nl + 1 - buf);
+    }
+    start += got;
+  }
+}
+
+/* Returns the offset of the last n (> 0) lines of yf[start:end], or start
+ * if it has fewer lines (flags -m<N> -r). It scans backwards from end, a
+ * block of YF_READ_BUF_SIZE at a time, so it reads only the blocks of the
+ * last n lines.
+ */
+STATIC off_t skip_lines_back(yfile *yf, off_t start, off_t end, off_t n) {
+  const char *buf;
+  off_t lo, hi = end, ofs, count;
+  int got;
+  if (start >= end) return start;
+  yfseek_set(yf, end - 1);
+  if (YFGETCHAR(yf) == '\n') --hi;  /* Skip the '\n' of the last line. */
+  while (hi > start) {
+    lo = (hi - 1) & -(off_t)YF_READ_BUF_SIZE;
+    if (lo < start) lo = start;
+    count = 0;
+    for (ofs = lo; ofs < hi; ofs += got) {
+      yfseek_set(yf, ofs);
+      if ((got = yfpeek(yf, hi - ofs, &buf)) <= 0) break;
+      count += count_newlines(buf, got);
+    }
+    if (count >= n) {  /* The line before the last n ends in this block. */
+      return skip_lines(yf, lo, hi, count - n + 1);
+    }
+    n -= count;
+    hi = lo;
+  }
+  return start;
+}
+
+#if USE_ZLIB
+/* --- BGZF converter (flag -Z) */
+
+#ifndef BGZF_BLOCK_DATA_SIZE
+/* Maximum uncompressed size of the blocks written, the same as in bgzip.
+ * Must be at most 0xff00, so that incompressible blocks also fit.
+ */
+#define BGZF_BLOCK_DATA_SIZE 0xff00
+#endif
+
+STATIC void put_u32le(char *p, unsigned v) {
+  p[0] = (char)(v & 255);
+  p[1] = (char)(v >> 8 & 255);
+  p[2] = (char)(v >> 16 & 255);
+  p[3] = (char)(v >> 24 & 255);
+}
+
+/* Compresses data[:size] to a BGZF block in out. Returns the size of the
+ * block. With size == 0, it's the BGZF end-of-file marker block.
+ */
+STATIC int bgzf_compress_block(z_stream *zs, const char *data, int size,
+                               char *out) {
+  int bsize;
+  deflateReset(zs);
+  zs->next_in = (Bytef*)data;
+  zs->avail_in = size;
+  zs->next_out = (Bytef*)out + 18;
+  zs->avail_out = BGZF_MAX_BLOCK_SIZE - 18 - 8;
+  if (deflate(zs, Z_FINISH) != Z_STREAM_END) die1("error: deflate");
+  bsize = 18 + (int)zs->total_out + 8;
+  /* gzip header with FEXTRA, OS=unknown, and the BC subfield of BGZF. */
+  memcpy(out, "\37\213\10\4\0\0\0\0\0\377\6\0BC\2\0", 16);
+  out[16] = (char)((bsize - 1) & 255);
+  out[17] = (char)((bsize - 1) >> 8);
+  put_u32le(out + bsize - 8, crc32(0, (const Bytef*)data, size));
+  put_u32le(out + bsize - 4, size);
+  return bsize;
+}
+
+/* Writes the BGZF file <filename>.gz and its block table <filename>.gz.gzi,
+ * compressing the text file filename (already open as yf). Blocks end at a
+ * line boundary if possible, so that most lines can be compared and
+ * printed by decompressing a single block.
+ */
+STATIC void bgzf_write(const char *filename, yfile *yf) {
+  char pathbuf[4096], tmppathbuf[4096], gzipathbuf[4096], gzitmppathbuf[4096];
+  char gbuf[YF_READ_BUF_SIZE], *gp = gbuf + 8;
+  char *data, *out;
+  const char *buf;
+  const size_t filename_size = strlen(filename);
+  const off_t size = yfgetsize(yf);
+  off_t ofs = 0, cofs = 0, count = 0;
+  z_stream zs;
+  struct stat st;
+  int fd, gfd, got, n, bsize;
+  if (filename_size + 15 > sizeof(pathbuf)) {
+    die1("error: BGZF pathname too long");
+  }
+  memcpy(pathbuf, filename, filename_size);
+  memcpy(pathbuf + filename_size, ".gz", 4);
+  memcpy(tmppathbuf, pathbuf, filename_size + 3);
+  memcpy(tmppathbuf + filename_size + 3, ".XXXXXX", 8);
+  memcpy(gzipathbuf, pathbuf, filename_size + 3);
+  memcpy(gzipathbuf + filename_size + 3, ".gzi", 5);
+  memcpy(gzitmppathbuf, gzipathbuf, filename_size + 7);
+  memcpy(gzitmppathbuf + filename_size + 7, ".XXXXXX", 8);
+  if (fstat(yf->fd, &st) != 0) die2_strerror("error: fstat ", filename);
+  if (!(data = (char*)malloc(BGZF_BLOCK_DATA_SIZE)) ||
+      !(out = (char*)malloc(BGZF_MAX_BLOCK_SIZE))) {
+    die1_nomem("error: out of memory for BGZF");
+  }
+  memset(&zs, '\0', sizeof(zs));
+  if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    die1("error: deflateInit2");
+  }
+  if ((fd = open_unique(tmppathbuf, st.st_mode & 0666)) < 0) {
+    die2_strerror("error: open ", tmppathbuf);
+  }
+  if ((gfd = open_unique(gzitmppathbuf, st.st_mode & 0666)) < 0) {
+    die2_strerror("error: open ", gzitmppathbuf);
+  }
+  memset(gbuf, '\0', 8);  /* The count is written last. */
+  yfseek_set(yf, 0);
+  for (;;) {
+    for (got = 0; got < BGZF_BLOCK_DATA_SIZE &&
+         (n = yfpeek(yf, BGZF_BLOCK_DATA_SIZE - got, &buf)) > 0; got += n) {
+      memcpy(data + got, buf, n);
+      yfseek_cur(yf, n);
+    }
+    if (got == 0) break;
+    if (ofs + got < size) {  /* Cut after the last '\n', if any. */
+      for (n = got; n > 0 && data[n - 1] != '\n'; --n) {}
+      if (n > 0) got = n;
+    }
+    if (ofs > 0) {  /* The first block is not in the .gzi file. */
+      if (gp + 16 > gbuf + sizeof(gbuf)) {
+        if (!write_all(gfd, gbuf, gp - gbuf)) {
+          die2_strerror("error: write ", gzitmppathbuf);
+        }
+        gp = gbuf;
+      }
+      put_u64le(gp, cofs);
+      put_u64le(gp + 8, ofs);
+      gp += 16;
+      ++count;
+    }
+    bsize = bgzf_compress_block(&zs, data, got, out);
+    if (!write_all(fd, out, bsize)) die2_strerror("error: write ", tmppathbuf);
+    cofs += bsize;
+    ofs += got;
+    yfseek_set(yf, ofs);
+  }
+  bsize = bgzf_compress_block(&zs, data, 0, out);
+  if (!write_all(fd, out, bsize)) die2_strerror("error: write ", tmppathbuf);
+  if (!write_all(gfd, gbuf, gp - gbuf)) {
+    die2_strerror("error: write ", gzitmppathbuf);
+  }
+  put_u64le(gbuf, count);
+  if (lseek(gfd, 0, SEEK_SET) != 0 || !write_all(gfd, gbuf, 8)) {
+    die2_strerror("error: write ", gzitmppathbuf);
+  }
+  if (close(fd) != 0) die2_strerror("error: close ", tmppathbuf);
+  if (close(gfd) != 0) die2_strerror("error: close ", gzitmppathbuf);
+  /* Readers check that the .gzi matches the .gz (see yfopen_bgzf). */
+  if (rename(gzitmppathbuf, gzipathbuf) != 0) {
+    die2_strerror("error: rename ", gzitmppathbuf);
+  }
+  if (rename(tmppathbuf, pathbuf) != 0) {
+    die2_strerror("error: rename ", tmppathbuf);
+  }
+  deflateEnd(&zs);
+  free(out);
+  free(data);
+}
+#endif
+
+#if defined(__i386__) && __SIZEOF_INT__ == 4 && __SIZEOF_LONG_LONG__ == 8 && \
+    defined(__GNUC__)
+/* A smaller implementation of division for format_unsigned, which doesn't
+ * call the __udivdi3 (for 64-bit /) and __umoddi3 (for 64-bit %) functions
+ * from libgcc. This implementation can be smaller because the divisor (b) is
+ * only 32 bits.
+ */
+
+typedef unsigned UInt32;
+typedef unsigned long long UInt64;
+/* Returns *a % b, and sets *a = *a_old / b; */
+STATIC __inline__ UInt32 UInt64DivAndGetMod(UInt64 *a, UInt32 b) {
+  /* http://stackoverflow.com/a/41982320/97248 */
+  UInt32 upper = ((UInt32*)a)[1], r;
+  ((UInt32*)a)[1] = 0;
+  if (upper >= b) {
+    ((UInt32*)a)[1] = upper / b;
+    upper %= b;
+  }
+  __asm__("divl %2" : "=a" (((UInt32*)a)[0]), "=d" (r) :
+      "rm" (b), "0" (((UInt32*)a)[0]), "1" (upper));
+  return r;
+}
+/* Returns *a % b, and sets *a = *a_old / b; */
+STATIC __inline__ UInt32 UInt32DivAndGetMod(UInt32 *a, UInt32 b) {
+  /* gcc-4.4 is smart enough to optimize the / and % to a single divl. */
+  const UInt32 r = *a % b;
+  *a /= b;
+  return r;
+}
+
+/** Returns p + size of formatted output. */
+STATIC char *format_unsigned(char *p, off_t i) {
+  struct AssertOffTSizeIs4or8_Struct {
+    int  AssertOffTSizeIs4or8 : sizeof(i) == 4 || sizeof(i) == 8;
+  };
+  char *q = p, *result, c;
+  assert(i >= 0);
+  do {
+    *q++ = '0' + (
+        sizeof(i) == 8 ? UInt64DivAndGetMod((UInt64*)&i, 10) :
+        sizeof(i) == 4 ? UInt32DivAndGetMod((UInt32*)&i, 10) :
+        0);  /* 0 never happens, see AssertOffTSizeIs4or8 above. */
+  } while (i != 0);
+  result = q--;
+  while (p < q) {  /* Reverse the string between p and q. */
+    c = *p; *p++ = *q; *q-- = c;
+  }
+  return result;
+}
+#else
+
+/** Returns p + size of formatted output. */
+static char *format_unsigned(char *p, off_t i) {
+  char *q = p, *result, c;
+  assert(i >= 0);
+  do {
+    *q++ = '0' + (i % 10);
+  } while ((i /= 10) != 0);
+  result = q--;
+  while (p < q) {  /* Reverse the string between p and q. */
+    c = *p; *p++ = *q; *q-- = c;
+  }
+  return result;
+}
+#endif
+
+typedef enum printing_t {
+  PR_OFFSETS,
+  PR_CONTENTS,
+  PR_DETECT,
+  PR_COUNT,
+  PR_UNSET,
+} printing_t;
+
+typedef enum incomplete_t {
+  IN_IGNORE,  /* Ignore incomplete last line of file. */
+  IN_USE,  /* Use incomplete last line of file as if it had a trailin '\n'. */
+  IN_UNSET,  /* Not set yet. Most functions do not support it. */
+} incomplete_t;
+
+/* Ignores the incomplete last line of yf (if any) by limiting its size. The
+ * bytes before lo (the start of a line) are not looked at.
+ */
+STATIC void yfignore_incomplete_after(yfile *yf, off_t lo) {
+  off_t size = yfgetsize(yf);
+  int c;
+  while (size > lo) {
+    yfseek_set(yf, size - 1);
+    if ((c = YFGETCHAR(yf)) < 0 || c == '\n') break;
+    --size;
+  }
+  yflimit(yf, size);
+}
+
+STATIC void yfignore_incomplete(yfile *yf) {
+  yfignore_incomplete_after(yf, 0);
+}
+
+#ifndef RECORD_SAMPLE_COUNT
+#define RECORD_SAMPLE_COUNT 5  /* Number of records checked by flag -w. */
+#endif
+
+/* Flag -w: if the lines of yf are fixed-width records of reclen bytes (or
+ * if reclen is -1, of the length of the first line), then makes get_fofs
+ * compute line starts without reading the file. Only RECORD_SAMPLE_COUNT
+ * records (the first, the last and evenly spread ones) and the incomplete
+ * last one are checked. If any of them is not a single line, then yf is
+ * searched as usual.
+ */
+STATIC void yfuse_fixed_width(yfile *yf, off_t reclen) {
+  const off_t size = yfgetsize(yf);
+  off_t count, i, ofs;
+  if (reclen < 0) reclen = get_fofs(yf, 1);
+  if (reclen <= 0) return;  /* Empty file. */
+  count = size / reclen;  /* Number of full records. */
+  ofs = count * reclen;
+  if (ofs < size && get_fofs(yf, ofs + 1) != size) return;
+  for (i = 0; i < RECORD_SAMPLE_COUNT && i < count; ++i) {
+    ofs = (count <= RECORD_SAMPLE_COUNT ? i :
+           i == RECORD_SAMPLE_COUNT - 1 ? count - 1 :
+           count * i / (RECORD_SAMPLE_COUNT - 1)) * reclen;
+    if (get_fofs(yf, ofs) != ofs || get_fofs(yf, ofs + 1) != ofs + reclen) {
+      return;
+    }
+  }
+  yf->reclen = reclen;
+}
+
+/* --- Handles
+ *
+ * A handle is a file opened for searching, with its file-level options
+ * (flags -i, -x, -u, -k, -h, -K, -H, -w and -v), and the sidecar index,
+ * io_uring and shared memory cache it needs. It's used by main, by flag -M
+ * for each shard, and it's the pts_lbsearch of the library API.
+ */
+
+/* Flags of a handle, the same as PTS_LBSEARCH_... in pts_lbsearch.h. */
+#define YH_IGNORE_INCOMPLETE 1  /* Flag -i. */
+#define YH_USE_INDEX 2  /* Flag -x. */
+#define YH_INTERPOLATION 4  /* Flag -u. */
+#define YH_STATS 8  /* Flag -v. */
+#define YH_COLD 16  /* Flag -d, not in the library API. */
+#define YH_SHM_CACHE 32  /* Flag -H. */
+#define YH_FIXED_WIDTH 64  /* Flag -w. */
+
+typedef struct pts_lbsearch {
+  yfile yf;
+  lbindex idx;
+  bisect_opts opts;
+#if USE_IO_URING
+  yuring uring;
+#endif
+#if USE_SHM_CACHE
+  shmcache shmc;
+#endif
+  unsigned flags;  /* YH_... */
+  unsigned cache_kb;  /* Flag -k<N>. */
+  int kary;  /* Flag -K<N>, or 0. */
+  off_t reclen;  /* Flag -w<N>, or -1 to detect it (flag -w). */
+  char *lbuf;  /* Line buffer for yfgetline. */
+  size_t lbuf_capacity;
+} yhandle;
+
+/* Initializes h as closed, with the file-level options. */
+STATIC void yhandle_init(yhandle *h, unsigned flags, unsigned cache_kb,
+                         int prefetch_depth, int kary) {
+  h->yf.fd = -1;
+  h->yf.cache = NULL;
+  h->yf.is_borrowed = 0;
+#if YF_USE_MMAP
+  h->yf.map = NULL;
+#endif
+#if USE_ZLIB
+  h->yf.bgzf = NULL;
+#endif
+#if YF_USE_DIRECT
+  h->yf.direct_fd = -1;
+#endif
+  h->opts.idx = NULL;
+  h->opts.is_interpolation = (flags & YH_INTERPOLATION) != 0;
+  h->opts.prefetch_depth = prefetch_depth;
+#if USE_IO_URING
+  h->opts.uring = NULL;
+#endif
+#if USE_SHM_CACHE
+  h->opts.shmc = NULL;
+#endif
+  h->flags = flags;
+  h->cache_kb = cache_kb;
+  h->kary = kary;
+  h->reclen = -1;
+  h->lbuf = NULL;
+  h->lbuf_capacity = 0;
+}
+
+/* Enables the cache and the io_uring of h, with h->yf already open. */
+STATIC void yhandle_setup(yhandle *h) {
+  h->yf.stats.is_on = (h->flags & YH_STATS) != 0;
+  if (h->cache_kb != 0 &&
+      !yfenable_cache(&h->yf, (size_t)h->cache_kb << 10)) {
+    die1_nomem("error: out of memory for cache");
+  }
+#if USE_IO_URING
+  if (h->kary != 0 && yuring_open(&h->uring, h->kary)) {
+    h->opts.uring = &h->uring;
+    yfunmap(&h->yf);  /* Read the probes in parallel instead of page faults. */
+  }
+#endif
+}
+
+/* Finishes opening h after h->yf has been opened at open_usec, from
+ * pathname, or from a file descriptor or memory if pathname is NULL (then
+ * there is no sidecar index).
+ */
+STATIC void yhandle_opened(yhandle *h, const char *pathname,
+                           long long open_usec) {
+  h->yf.stats.last_usec = open_usec;
+  yhandle_setup(h);
+  if (h->flags & YH_USE_INDEX && pathname &&
+      lbindex_open(&h->idx, pathname, &h->yf)) {
+    h->opts.idx = &h->idx;
+  }
+  if (h->flags & YH_IGNORE_INCOMPLETE) yfignore_incomplete(&h->yf);
+  if (h->flags & YH_FIXED_WIDTH) yfuse_fixed_width(&h->yf, h->reclen);
+#if USE_SHM_CACHE
+  if (h->flags & YH_SHM_CACHE && h->yf.fd >= 0 &&
+      shmcache_open(&h->shmc, &h->yf)) {
+    h->opts.shmc = &h->shmc;
+  }
+#endif
+  ystats_mark(&h->yf.stats, YS_OPEN);
+}
+
+/* Opens pathname as h (already initialized by yhandle_init). */
+STATIC void yhandle_open(yhandle *h, const char *pathname) {
+  const long long open_usec = h->flags & YH_STATS ? get_usec() : 0;
+#if YF_USE_DIRECT
+  if (h->flags & YH_COLD) {
+    yfopen_cold(&h->yf, pathname);
+  } else
+#endif
+  {
+    yfopen(&h->yf, pathname, (off_t)-1);
+  }
+  yhandle_opened(h, pathname, open_usec);
+}
+
+#if USE_LIBRARY || USE_BATCH
+/* Opens h (already initialized by yhandle_init) as a new handle for the
+ * same file as src, sharing its file descriptor and mapping.
+ */
+STATIC void yhandle_dup(yhandle *h, const yhandle *src) {
+  const long long open_usec = h->flags & YH_STATS ? get_usec() : 0;
+  yfopen_dup(&h->yf, &src->yf);
+  h->yf.stats.last_usec = open_usec;
+  yhandle_setup(h);
+  if (src->opts.idx) {
+    h->idx.count = src->idx.count;
+    yfopen_dup(&h->idx.yf, &src->idx.yf);
+    h->opts.idx = &h->idx;
+  }
+#if USE_SHM_CACHE
+  if (src->opts.shmc) {
+    h->shmc = src->shmc;
+    h->shmc.is_borrowed = 1;
+    h->opts.shmc = &h->shmc;
+  }
+#endif
+  ystats_mark(&h->yf.stats, YS_OPEN);
+}
+#endif
+
+STATIC void yhandle_close(yhandle *h) {
+  if (h->opts.idx) lbindex_close(h->opts.idx);
+#if USE_IO_URING
+  if (h->opts.uring) yuring_close(h->opts.uring);
+#endif
+#if USE_SHM_CACHE
+  if (h->opts.shmc) shmcache_close(h->opts.shmc);
+#endif
+  yfclose(&h->yf);
+  free(h->lbuf);
+  h->lbuf = NULL;
+}
+
+#if USE_LIBRARY
+/* --- Library API (pts_lbsearch.h)
+ *
+ * The body of each function is run by ycatch_call, which returns the error
+ * code of a die* call instead of exiting.
+ */
+
+/* Arguments and results of the bodies of the functions. */
+typedef struct yapi_args {
+  yhandle *h;
+  const yhandle *src;  /* pts_lbsearch_dup. */
+  const char *pathname;  /* pts_lbsearch_open. */
+  int fd;  /* pts_lbsearch_open_fd. */
+  const char *buf;  /* pts_lbsearch_open_memory. */
+  off_t size;  /* Size limit of pts_lbsearch_open_fd, or -1. */
+  const char *x, *y;
+  size_t xsize, ysize;
+  compare_mode_t cm;
+  off_t start, end;
+  pts_lbsearch_line_func func;  /* pts_lbsearch_iterate. */
+  void *func_arg;
+  int result;
+} yapi_args;
+
+/* Calls body(a). Returns PTS_LBSEARCH_OK, or the error code if body has
+ * called die*. In the latter case, if is_opening, then a->h is closed and
+ * freed.
+ */
+STATIC int ycatch_call(void (*body)(yapi_args *a), yapi_args *a,
+                       ybool is_opening) {
+  ycatch c;
+  c.prev = ycatch_current;
+  ycatch_current = &c;
+  if (setjmp(c.jb) != 0) {
+    ycatch_current = c.prev;
+    if (is_opening) pts_lbsearch_close(a->h);
+    errno = c.saved_errno;  /* Also after close(2). */
+    return c.code;
+  }
+  body(a);
+  ycatch_current = c.prev;
+  return PTS_LBSEARCH_OK;
+}
+
+/* Returns the compare mode of a PTS_LBSEARCH_... search mode. */
+STATIC compare_mode_t yapi_cm(int mode) {
+  return mode == PTS_LBSEARCH_LEFT ? CM_LE : mode == PTS_LBSEARCH_RIGHT ?
+      CM_LT : mode == PTS_LBSEARCH_PREFIX ? CM_LP : CM_UNSET;
+}
+
+/* Allocates a closed handle with the options (checked) in opts. */
+STATIC int yapi_new(yhandle **h_out, const pts_lbsearch_options *opts) {
+  static const pts_lbsearch_options default_opts = { 0, 0, 0, 0 };
+  if (!opts) opts = &default_opts;
+  if (opts->cache_kb > 4 << 20 || opts->prefetch_depth < 0 ||
+      opts->prefetch_depth > 4 || opts->kary < 0 || opts->kary == 1 ||
+      opts->kary > 64) {  /* KARY_MAX_K. */
+    return yerror(PTS_LBSEARCH_EINVAL, "error: bad options");
+  }
+  if (!(*h_out = (yhandle*)malloc(sizeof(yhandle)))) {
+    return yerror(PTS_LBSEARCH_ENOMEM, "error: out of memory for handle");
+  }
+  yhandle_init(*h_out, opts->flags, opts->cache_kb, opts->prefetch_depth,
+               opts->kary);
+  return PTS_LBSEARCH_OK;
+}
+
+STATIC void yapi_open(yapi_args *a) {
+  yhandle_open(a->h, a->pathname);
+}
+
+int pts_lbsearch_open(pts_lbsearch **h_out, const char *pathname,
+                      const pts_lbsearch_options *opts) {
+  yapi_args a;
+  int code;
+  *h_out = NULL;
+  if ((code = yapi_new(&a.h, opts)) != PTS_LBSEARCH_OK) return code;
+  a.pathname = pathname;
+  if ((code = ycatch_call(yapi_open, &a, 1)) == PTS_LBSEARCH_OK) {
+    *h_out = a.h;
+  }
+  return code;
+}
+
+STATIC void yapi_open_fd(yapi_args *a) {
+  const long long open_usec = a->h->flags & YH_STATS ? get_usec() : 0;
+  if ((a->h->yf.fd = dup(a->fd)) < 0) die2_strerror("error: dup", "");
+  yfopen_fd(&a->h->yf, a->h->yf.fd, (off_t)-1);
+  if (a->size >= 0) yflimit(&a->h->yf, a->size);
+  yhandle_opened(a->h, NULL, open_usec);
+}
+
+int pts_lbsearch_open_fd(pts_lbsearch **h_out, int fd, long long size,
+                         const pts_lbsearch_options *opts) {
+  yapi_args a;
+  int code;
+  *h_out = NULL;
+  if ((code = yapi_new(&a.h, opts)) != PTS_LBSEARCH_OK) return code;
+  a.fd = fd;
+  a.size = size < 0 ? (off_t)-1 : (off_t)size;
+  if ((code = ycatch_call(yapi_open_fd, &a, 1)) == PTS_LBSEARCH_OK) {
+    *h_out = a.h;
+  }
+  return code;
+}
+
+#if YF_USE_MMAP
+STATIC void yapi_open_memory(yapi_args *a) {
+  const long long open_usec = a->h->flags & YH_STATS ? get_usec() : 0;
+  a->h->kary = 0;  /* io_uring would unmap it. */
+  yfopen_memory(&a->h->yf, a->buf, a->size);
+  yhandle_opened(a->h, NULL, open_usec);
+}
+#endif
+
+int pts_lbsearch_open_memory(pts_lbsearch **h_out, const char *buf,
+                             size_t size, const pts_lbsearch_options *opts) {
+  yapi_args a;
+  int code;
+  *h_out = NULL;
+#if YF_USE_MMAP
+  if ((code = yapi_new(&a.h, opts)) != PTS_LBSEARCH_OK) return code;
+  a.buf = buf;
+  a.size = (off_t)size;
+  if ((code = ycatch_call(yapi_open_memory, &a, 1)) == PTS_LBSEARCH_OK) {
+    *h_out = a.h;
+  }
+  return code;
+#else
+  (void)buf; (void)size; (void)opts; (void)a; (void)code;
+  return yerror(PTS_LBSEARCH_EINVAL, "error: memory needs mmap");
+#endif
+}
+
+STATIC void yapi_dup(yapi_args *a) {
+  yhandle_dup(a->h, a->src);
+}
+
+int pts_lbsearch_dup(pts_lbsearch **h_out, const pts_lbsearch *src) {
+  pts_lbsearch_options opts;
+  yapi_args a;
+  int code;
+  *h_out = NULL;
+  opts.flags = src->flags;
+  opts.cache_kb = src->cache_kb;
+  opts.prefetch_depth = src->opts.prefetch_depth;
+  opts.kary = src->kary;
+  if ((code = yapi_new(&a.h, &opts)) != PTS_LBSEARCH_OK) return code;
+  a.src = src;
+  if ((code = ycatch_call(yapi_dup, &a, 1)) == PTS_LBSEARCH_OK) {
+    *h_out = a.h;
+  }
+  return code;
+}
+
+void pts_lbsearch_close(pts_lbsearch *h) {
+  if (!h) return;
+  yhandle_close(h);
+  free(h);
+}
+
+long long pts_lbsearch_size(const pts_lbsearch *h) {
+  return h->yf.size;
+}
+
+STATIC void yapi_bisect(yapi_args *a) {
+  struct cache cache;
+  cache_init(&cache);
+  a->start = bisect_way(&a->h->yf, &cache, &a->h->opts, 0, (off_t)-1,
+                        a->x, a->xsize, a->cm);
+}
+
+int pts_lbsearch_bisect(pts_lbsearch *h, const char *key, size_t key_size,
+                        int mode, long long *ofs_out) {
+  yapi_args a;
+  int code;
+  if ((a.cm = yapi_cm(mode)) == CM_UNSET ||
+      (key_size != 0 && memchr(key, '\n', key_size))) {
+    return yerror(PTS_LBSEARCH_EINVAL, "error: bad search mode or key");
+  }
+  a.h = h;
+  a.x = key;
+  a.xsize = key_size;
+  if ((code = ycatch_call(yapi_bisect, &a, 0)) == PTS_LBSEARCH_OK) {
+    *ofs_out = a.start;
+  }
+  return code;
+}
+
+STATIC void yapi_range(yapi_args *a) {
+  bisect_interval(&a->h->yf, &a->h->opts, 0, (off_t)-1, a->cm,
+                  a->x, a->xsize, a->y, a->ysize, &a->start, &a->end);
+}
+
+int pts_lbsearch_range(pts_lbsearch *h, const char *x, size_t xsize,
+                       const char *y, size_t ysize, int mode,
+                       long long *start_out, long long *end_out) {
+  yapi_args a;
+  int code;
+  if (!y) {
+    y = x;
+    ysize = xsize;
+  }
+  if ((a.cm = yapi_cm(mode)) == CM_UNSET ||
+      (xsize != 0 && memchr(x, '\n', xsize)) ||
+      (ysize != 0 && memchr(y, '\n', ysize))) {
+    return yerror(PTS_LBSEARCH_EINVAL, "error: bad search mode or key");
+  }
+  a.h = h;
+  a.x = x;
+  a.xsize = xsize;
+  a.y = y;
+  a.ysize = ysize;
+  if ((code = ycatch_call(yapi_range, &a, 0)) == PTS_LBSEARCH_OK) {
+    *start_out = a.start;
+    *end_out = a.end;
+  }
+  return code;
+}
+
+STATIC void yapi_iterate(yapi_args *a) {
+  yhandle *h = a->h;
+  const char *line;
+  size_t size;
+  off_t ofs;
+  for (ofs = a->start; ofs < a->end; ofs += size) {
+    size = yfgetline(&h->yf, ofs, a->end, &line, &h->lbuf, &h->lbuf_capacity);
+    if ((a->result = a->func(a->func_arg, line,
+                             size - (line[size - 1] == '\n'))) != 0) {
+      if (a->result < 0) {
+        a->result = yerror(PTS_LBSEARCH_ECALLBACK,
+                           "error: negative callback result");
+      }
+      break;
+    }
+  }
+}
+
+int pts_lbsearch_iterate(pts_lbsearch *h, long long start, long long end,
+                         pts_lbsearch_line_func func, void *arg) {
+  yapi_args a;
+  int code;
+  if (start < 0) return yerror(PTS_LBSEARCH_EINVAL, "error: bad start");
+  a.h = h;
+  a.start = start;
+  a.end = end < yfgetsize(&h->yf) ? end : yfgetsize(&h->yf);
+  a.func = func;
+  a.func_arg = arg;
+  a.result = 0;
+  code = ycatch_call(yapi_iterate, &a, 0);
+  return code == PTS_LBSEARCH_OK ? a.result : code;
+}
+
+const char *pts_lbsearch_errmsg(void) {
+  return yerror_msg;
+}
+#endif
+
+/* --- Queries */
+
+/* Flags of a single query, as specified by -<flags>. */
+typedef struct query {
+  compare_mode_t cm;
+  compare_mode_t cmstart;
+  printing_t printing;
+  incomplete_t incomplete;
+  ybool is_stream;  /* Flag -s: read queries from stdin. */
+  ybool use_index;  /* Flag -x: use the sidecar index if fresh. */
+  ybool is_index_write;  /* Flag -X: write the sidecar index. */
+  ybool is_bgzf_write;  /* Flag -Z: write a BGZF copy of the file. */
+  ybool use_interpolation;  /* Flag -u: do interpolation search. */
+  unsigned cache_kb;  /* Flag -k<N>: block and line cache size in KiB. */
+  int prefetch_depth;  /* Flag -h[<N>]: levels of probes to prefetch. */
+  int kary;  /* Flag -K[<N>]: k of k-ary search with io_uring, or 0. */
+  ybool is_verbose;  /* Flag -v: print statistics to stderr. */
+  ybool is_server;  /* Flag -S: serve queries on a Unix domain socket. */
+  ybool is_client;  /* Flag -z: send the query to the server. */
+  ybool is_shards;  /* Flag -M: search the shards matching a pattern. */
+  ybool is_follow;  /* Flag -f: print the lines appended to the range. */
+  ybool is_batch;  /* Flag -B: run the query for each key in a file. */
+  ybool is_cold;  /* Flag -d: print without polluting the page cache. */
+  ybool use_shm_cache;  /* Flag -H: cache the top probes in shared memory. */
+  ybool is_insert;  /* Flag -N: insert new lines to the file. */
+  ybool is_join;  /* Flag -J: run the query for each key in a sorted file. */
+  off_t max_lines;  /* Flag -m<N>: limit the range to N lines, or 0. */
+  ybool is_reverse;  /* Flag -r: limit it to the last N lines. */
+  off_t reclen;  /* Flag -w[<N>]: record length, -1 to detect it, or 0. */
+  unsigned thread_count;  /* Flag -j<N>: number of worker threads. */
+} query;
+
+STATIC void query_init(query *q) {
+  q->cm = CM_UNSET;
+  q->cmstart = CM_UNSET;
+  q->printing = PR_UNSET;
+  q->incomplete = IN_UNSET;
+  q->is_stream = 0;
+  q->use_index = 0;
+  q->is_index_write = 0;
+  q->is_bgzf_write = 0;
+  q->use_interpolation = 0;
+  q->cache_kb = 0;
+  q->prefetch_depth = 0;
+  q->kary = 0;
+  q->is_verbose = 0;
+  q->is_server = 0;
+  q->is_client = 0;
+  q->is_shards = 0;
+  q->is_follow = 0;
+  q->is_batch = 0;
+  q->is_cold = 0;
+  q->use_shm_cache = 0;
+  q->is_insert = 0;
+  q->is_join = 0;
+  q->max_lines = 0;
+  q->is_reverse = 0;
+  q->reclen = 0;
+  q->thread_count = 0;
+}
+
+/* Initializes h (closed) with the file-level flags in q. */
+STATIC void yhandle_init_query(yhandle *h, const query *q) {
+  /* With flag -f, the incomplete last line will be printed when completed. */
+  yhandle_init(h, (q->incomplete == IN_IGNORE || q->is_follow ?
+                   YH_IGNORE_INCOMPLETE : 0) |
+                  (q->use_index ? YH_USE_INDEX : 0) |
+                  (q->use_interpolation ? YH_INTERPOLATION : 0) |
+                  (q->is_verbose ? YH_STATS : 0) |
+                  (q->is_cold ? YH_COLD : 0) |
+                  (q->use_shm_cache ? YH_SHM_CACHE : 0) |
+                  (q->reclen != 0 ? YH_FIXED_WIDTH : 0),
+               q->cache_kb, q->prefetch_depth, q->kary);
+  if (q->reclen > 0) h->reclen = q->reclen;
+}
+
+#if USE_SERVER
+/* Initializes opts from the file-level flags in q, without an index. */
+STATIC void bisect_opts_init(bisect_opts *opts, const query *q) {
+  opts->idx = NULL;
+  opts->is_interpolation = q->use_interpolation;
+  opts->prefetch_depth = q->prefetch_depth;
+#if USE_IO_URING
+  opts->uring = NULL;
+#endif
+#if USE_SHM_CACHE
+  opts->shmc = NULL;
+#endif
+}
+#endif
+
+/* Parses flags to q. If is_in_stream, then it rejects flags which affect
+ * the whole file rather than a single query.
+ *
+ * Returns NULL on success, or an error message.
+ */
+STATIC const char *parse_flags(const char *flags, query *q,
+                               ybool is_in_stream) {
+  char flag;
+  for (; (flag = *flags); ++flags) {
+    if (flag == 'e') {
+      if (q->cm != CM_UNSET) return "multiple boundary flags";
+      q->cm = CM_LE;
+    } else if (flag == 't') {
+      if (q->cm != CM_UNSET) return "multiple boundary flags";
+      q->cm = CM_LT;
+    } else if (flag == 'p') {
+      if (q->cm != CM_UNSET) return "multiple boundary flags";
+      q->cm = CM_LP;
+    } else if (flag == 'b') {
+      if (q->cmstart != CM_UNSET) return "multiple start flags";
+      q->cmstart = CM_LE;
+    } else if (flag == 'a') {
+      if (q->cmstart != CM_UNSET) return "multiple start flags";
+      q->cmstart = CM_LT;
+    } else if (flag == 'o') {
+      if (q->printing != PR_UNSET) return "multiple printing flags";
+      q->printing = PR_OFFSETS;
+    } else if (flag == 'c') {
+      if (q->printing != PR_UNSET) return "multiple printing flags";
+      q->printing = PR_CONTENTS;
+    } else if (flag == 'q') {
+      if (q->printing != PR_UNSET) return "multiple printing flags";
+      q->printing = PR_DETECT;
+    } else if (flag == 'n') {
+      if (q->printing != PR_UNSET) return "multiple printing flags";
+      q->printing = PR_COUNT;
+    } else if (flag == 'm') {
+      if (q->max_lines != 0) return "multiple max line count flags";
+      for (; flags[1] >= '0' && flags[1] <= '9'; ++flags) {
+        q->max_lines = q->max_lines * 10 + (flags[1] - '0');
+        if (q->max_lines > 2000000000) return "max line count too large";
+      }
+      if (q->max_lines == 0) return "missing line count after flag -m";
+    } else if (flag == 'r') {
+      if (q->is_reverse) return "multiple reverse flags";
+      q->is_reverse = 1;
+    } else if (flag == 'i' && !is_in_stream) {
+      if (q->incomplete != IN_UNSET) return "multiple incomplete flags";
+      q->incomplete = IN_IGNORE;
+    } else if (flag == 's' && !is_in_stream) {
+      if (q->is_stream) return "multiple stream flags";
+      q->is_stream = 1;
+    } else if (flag == 'x' && !is_in_stream) {
+      if (q->use_index) return "multiple index flags";
+      q->use_index = 1;
+    } else if (flag == 'X' && !is_in_stream) {
+      if (q->is_index_write) return "multiple index flags";
+      q->is_index_write = 1;
+#if USE_ZLIB
+    } else if (flag == 'Z' && !is_in_stream) {
+      if (q->is_bgzf_write) return "multiple BGZF flags";
+      q->is_bgzf_write = 1;
+#endif
+    } else if (flag == 'u' && !is_in_stream) {
+      if (q->use_interpolation) return "multiple interpolation flags";
+      q->use_interpolation = 1;
+    } else if (flag == 'k' && !is_in_stream) {
+      if (q->cache_kb != 0) return "multiple cache flags";
+      for (; flags[1] >= '0' && flags[1] <= '9'; ++flags) {
+        q->cache_kb = q->cache_kb * 10 + (flags[1] - '0');
+        if (q->cache_kb > 4 << 20) return "cache size too large";
+      }
+      if (q->cache_kb == 0) return "missing cache size after flag -k";
+#if YF_USE_FADVISE
+    } else if (flag == 'h' && !is_in_stream) {
+      if (q->prefetch_depth != 0) return "multiple prefetch flags";
+      for (; flags[1] >= '0' && flags[1] <= '9'; ++flags) {
+        q->prefetch_depth = q->prefetch_depth * 10 + (flags[1] - '0');
+        if (q->prefetch_depth > 4) return "prefetch depth too large";
+      }
+      if (q->prefetch_depth == 0) q->prefetch_depth = 1;
+#endif
+#if USE_IO_URING
+    } else if (flag == 'K' && !is_in_stream) {
+      if (q->kary != 0) return "multiple k-ary flags";
+      for (; flags[1] >= '0' && flags[1] <= '9'; ++flags) {
+        q->kary = q->kary * 10 + (flags[1] - '0');
+        if (q->kary > KARY_MAX_K) return "k-ary k too large";
+      }
+      if (q->kary == 0) q->kary = KARY_DEFAULT_K;
+      if (q->kary < 2) return "k-ary k too small";
+#endif
+    } else if (flag == 'v' && !is_in_stream) {
+      if (q->is_verbose) return "multiple verbose flags";
+      q->is_verbose = 1;
+#if USE_SERVER
+    } else if (flag == 'S' && !is_in_stream) {
+      if (q->is_server) return "multiple server flags";
+      q->is_server = 1;
+    } else if (flag == 'z' && !is_in_stream) {
+      if (q->is_client) return "multiple client flags";
+      q->is_client = 1;
+#endif
+#if USE_SERVER || USE_SHARDS || USE_BATCH
+    } else if (flag == 'j' && !is_in_stream) {
+      if (q->thread_count != 0) return "multiple thread count flags";
+      for (; flags[1] >= '0' && flags[1] <= '9'; ++flags) {
+        q->thread_count = q->thread_count * 10 + (flags[1] - '0');
+        if (q->thread_count > 1024) return "thread count too large";
+      }
+      if (q->thread_count == 0) return "missing thread count after flag -j";
+#endif
+#if USE_SHARDS
+    } else if (flag == 'M' && !is_in_stream) {
+      if (q->is_shards) return "multiple shard flags";
+      q->is_shards = 1;
+#endif
+#if USE_FOLLOW
+    } else if (flag == 'f' && !is_in_stream) {
+      if (q->is_follow) return "multiple follow flags";
+      q->is_follow = 1;
+#endif
+#if YF_USE_DIRECT
+    } else if (flag == 'd' && !is_in_stream) {
+      if (q->is_cold) return "multiple cold flags";
+      q->is_cold = 1;
+#endif
+#if USE_SHM_CACHE
+    } else if (flag == 'H' && !is_in_stream) {
+      if (q->use_shm_cache) return "multiple shared memory cache flags";
+      q->use_shm_cache = 1;
+#endif
+    } else if (flag == 'w' && !is_in_stream) {
+      if (q->reclen != 0) return "multiple fixed-width flags";
+      for (; flags[1] >= '0' && flags[1] <= '9'; ++flags) {
+        q->reclen = q->reclen * 10 + (flags[1] - '0');
+        if (q->reclen > 2000000000) return "record length too large";
+      }
+      if (q->reclen == 0) q->reclen = -1;
+    } else if (flag == 'J' && !is_in_stream) {
+      if (q->is_join) return "multiple join flags";
+      q->is_join = 1;
+#if USE_INSERT
+    } else if (flag == 'N' && !is_in_stream) {
+      if (q->is_insert) return "multiple insert flags";
+      q->is_insert = 1;
+#endif
+#if USE_BATCH
+    } else if (flag == 'B' && !is_in_stream) {
+      if (q->is_batch) return "multiple batch flags";
+      q->is_batch = 1;
+#endif
+    } else if ((flag == 'i' || flag == 's' || flag == 'x' || flag == 'X' ||
+                flag == 'Z' ||
+                flag == 'u' || flag == 'k' || flag == 'h' || flag == 'K' ||
+                flag == 'v' || flag == 'S' || flag == 'z' || flag == 'j' ||
+                flag == 'M' || flag == 'f' || flag == 'B' || flag == 'd' ||
+                flag == 'H' || flag == 'N' || flag == 'J' || flag == 'w') &&
+               is_in_stream) {
+      return "flag not allowed in query";
+    } else {
+      return "unsupported flag";
+    }
+  }
+  return NULL;
+}
+
+/* Fills the defaults in q, and checks that q is consistent with has_y
+ * (whether <key-y> was specified).
+ *
+ * Returns NULL on success, or an error message.
+ */
+STATIC const char *check_query(query *q, ybool has_y) {
+  if (q->printing == PR_UNSET) q->printing = PR_CONTENTS;
+  if (q->incomplete == IN_UNSET) q->incomplete = IN_USE;
+  if (q->cmstart == CM_UNSET) q->cmstart = CM_LE;
+  if (q->cm == CM_UNSET) return "missing boundary flag";
+  if (q->cmstart == CM_LT &&
+      !(!has_y && q->cm == CM_LE && q->printing == PR_OFFSETS)) {
+    /* TODO(pts): Make cmstart=CM_LT work in bisect_interval etc. */
+    return "flag -a needs -eo and no <key-y>";
+  }
+  if (!has_y && q->printing != PR_OFFSETS && q->cm == CM_LE) {
+    return "single-key contents is always empty";
+  }
+  if (q->is_reverse && q->max_lines == 0) return "flag -r needs -m<N>";
+  if (q->max_lines != 0 && !has_y && q->cm == CM_LE) {
+    return "flag -m needs a range";
+  }
+  return NULL;
+}
+
+/* Limits the range [*start_io, *end_io) to its first q->max_lines lines
+ * (flag -m<N>), or to its last ones (flag -r).
+ */
+STATIC void limit_range(yfile *yf, const query *q, off_t *start_io,
+                        off_t *end_io) {
+  if (q->max_lines == 0 || *start_io >= *end_io) return;
+  if (q->is_reverse) {
+    *start_io = skip_lines_back(yf, *start_io, *end_io, q->max_lines);
+  } else {
+    *end_io = skip_lines(yf, *start_io, *end_io, q->max_lines);
+  }
+}
+
+/* Runs the query q (already checked by check_query) on yf. y == NULL means
+ * that <key-y> was not specified.
+ *
+ * Sets *start_out and *end_out to the result range. If only a single offset
+ * is to be printed (flag -eo without <key-y>), then *end_out is set to -1.
+ *
+ * Returns the exit code: 0 if there is a match, 3 if not.
+ */
+STATIC int run_query(yfile *yf, const bisect_opts *opts, const query *q,
+                     const char *x, size_t xsize,
+                     const char *y, size_t ysize,
+                     off_t *start_out, off_t *end_out) {
+  struct cache cache;
+  const struct cache_entry *entry;
+  *start_out = *end_out = 0;
+  if (!y && q->cm == CM_LE && q->printing == PR_OFFSETS) {
+    cache_init(&cache);
+    *start_out = bisect_way(
+        yf, &cache, opts, 0, (off_t)-1, x, xsize, q->cmstart);
+    ystats_mark(&yf->stats, YS_START);
+    *end_out = -1;
+    return 0;
+  } else if (q->printing == PR_DETECT &&
+             (!y || (xsize == ysize && 0 == memcmp(x, y, xsize)))) {
+    /* This branch is just a shortcut, it doesn't change the results. */
+    /* Shortcut just to detect if x is present. */
+    if (q->cm == CM_LE) return 3;  /* start:end range would always be empty. */
+    cache_init(&cache);
+    *start_out = *end_out =
+        bisect_way(yf, &cache, opts, 0, (off_t)-1, x, xsize, CM_LE);
+    ystats_mark(&yf->stats, YS_START);
+    cache_init(&cache);  /* Can't reuse cache, cm has changed. */
+    /* We don't benefit any speed from the cache here (because it's empty),
+     * but we reuse the existing code to compare a single line from yf.
+     */
+    entry = get_using_cache(yf, &cache, *start_out, x, xsize, q->cm);
+    ystats_mark(&yf->stats, YS_END);
+    return entry->cmp_result ? 3 : 0;  /* 3 iff x not found in yf. */
+  } else {
+    if (!y) {
+      y = x;
+      ysize = xsize;
+    }
+    bisect_interval(yf, opts, 0, (off_t)-1, q->cm, x, xsize, y, ysize,
+                    start_out, end_out);
+    limit_range(yf, q, start_out, end_out);
+    return *start_out >= *end_out ? 3 : 0;  /* 3 iff no match found. */
+  }
+}
+
+/* Formats the line count printed by flag -n to buf. Returns the end. */
+STATIC char *format_count(char *buf, off_t count) {
+  char *p = format_unsigned(buf, count);
+  *p++ = '\n';
+  return p;
+}
+
+/* Formats the offsets printed by flag -o to ofsbuf. Returns the end. */
+STATIC char *format_offsets(char *ofsbuf, off_t start, off_t end) {
+  char *ofsp = format_unsigned(ofsbuf, start);
+  if (end >= 0) {
+    *ofsp++ = ' ';
+    ofsp = format_unsigned(ofsp, end);
+  }
+  *ofsp++ = '\n';
+  return ofsp;
+}
+
+STATIC char *format_stat(char *p, const char *name, off_t value) {
+  *p++ = ' ';
+  while (*name) *p++ = *name++;
+  *p++ = '=';
+  return format_unsigned(p, value);
+}
+
+/* Writes the statistics of the last query on yf to stderr (flag -v), as a
+ * line of `stats' followed by name=value pairs. Times are in microseconds.
+ */
+STATIC void write_stats(yfile *yf, const bisect_opts *opts) {
+  const ystats *st = &yf->stats;
+  char buf[1024], *p = buf;
+  memcpy(p, "stats", 5);
+  p += 5;
+  p = format_stat(p, "open_us", st->usec[YS_OPEN]);
+  p = format_stat(p, "start_us", st->usec[YS_START]);
+  p = format_stat(p, "end_us", st->usec[YS_END]);
+  p = format_stat(p, "print_us", st->usec[YS_PRINT]);
+  p = format_stat(p, "probes", st->probe_count);
+#if USE_IO_URING
+  if (opts && opts->uring) {
+    p = format_stat(p, "kary_rounds", st->kary_round_count);
+  }
+#endif
+  p = format_stat(p, "compares", st->compare_count);
+  p = format_stat(p, "cache_hits", st->cache_hit_count);
+  p = format_stat(p, "cache_misses", st->cache_miss_count);
+  p = format_stat(p, "line_hits", st->line_hit_count);
+  p = format_stat(p, "block_hits", st->block_hit_count);
+  p = format_stat(p, "mapped", YF_IS_MAPPED(yf));
+  p = format_stat(p, "lseeks", st->lseek_count);
+  p = format_stat(p, "reads", st->read_count);
+  p = format_stat(p, "read_bytes", st->read_bytes);
+  p = format_stat(p, "copies", st->copy_count);
+  p = format_stat(p, "prefetches", st->prefetch_count);
+#if USE_SHM_CACHE
+  if (opts && opts->shmc) p = format_stat(p, "shm_hits", st->shm_hit_count);
+#endif
+  if (YF_IS_COMPRESSED(yf)) {
+    p = format_stat(p, "inflates", st->inflate_count);
+  }
+  if (opts && opts->idx) {
+    p = format_stat(p, "index_lseeks", opts->idx->yf.stats.lseek_count);
+    p = format_stat(p, "index_reads", opts->idx->yf.stats.read_count);
+    p = format_stat(p, "index_read_bytes", opts->idx->yf.stats.read_bytes);
+  }
+  *p++ = '\n';
+  (void)!write(STDERR_FILENO, buf, p - buf);
+}
+
+/* --- Stream of queries (flag -s)
+ *
+ * Each query is a line on stdin: `-<flags>\t<key-x>\n' or
+ * `-<flags>\t<key-x>\t<key-y>\n', thus keys can't contain '\t' here. Each
+ * response on stdout is a header line `<status> <size>\n' followed by
+ * <size> bytes of payload. <status> is the exit code the equivalent single
+ * invocation would have (0: match, 1: usage error, 3: no match), the
+ * payload is what it would print to stdout, or the error message for
+ * usage errors.
+ */
+
+#ifndef QUERY_LINE_BUF_SIZE
+#define QUERY_LINE_BUF_SIZE 65536
+#endif
+
+typedef struct linereader {
+  int fd;
+  char *p;
+  char *rend;
+  char buf[QUERY_LINE_BUF_SIZE];
+} linereader;
+
+STATIC void lrinit(linereader *lr, int fd) {
+  lr->fd = fd;
+  lr->p = lr->rend = lr->buf;
+}
+
+/* Reads the next line (without the trailing '\n') to *line_out. The line is
+ * valid until the next call.
+ *
+ * Returns the size of the line, -1 on EOF, -2 if the line is too long
+ * (then it is skipped), or -3 on read error.
+ */
+STATIC int lrgetline(linereader *lr, const char **line_out) {
+  char *q;
+  int got;
+  ybool is_too_long = 0;
+  for (;;) {
+    if ((q = (char*)memchr(lr->p, '\n', lr->rend - lr->p)) != NULL) {
+      *line_out = lr->p;
+      lr->p = q + 1;
+      return is_too_long ? -2 : q - *line_out;
+    }
+    if (lr->p != lr->buf) {  /* Make room by moving the partial line. */
+      memmove(lr->buf, lr->p, lr->rend - lr->p);
+      lr->rend -= lr->p - lr->buf;
+      lr->p = lr->buf;
+    }
+    if (lr->rend == lr->buf + sizeof(lr->buf)) {  /* Line too long. */
+      is_too_long = 1;
+      lr->p = lr->rend = lr->buf;
+    }
+    got = read(lr->fd, lr->rend, lr->buf + sizeof(lr->buf) - lr->rend);
+    if (got < 0 && errno == EINTR) continue;
+    if (got < 0) return -3;
+    if (got == 0) {  /* EOF. */
+      if (lr->p == lr->rend && !is_too_long) return -1;
+      *line_out = lr->p;
+      got = lr->rend - lr->p;
+      lr->p = lr->rend = lr->buf;
+      return is_too_long ? -2 : got;
+    }
+    lr->rend += got;
+  }
+}
+
+/* Formats the response header to hdrp. Returns the end. */
+STATIC char *format_response_header(char *hdrp, int status, off_t size) {
+  *hdrp++ = '0' + status;
+  *hdrp++ = ' ';
+  hdrp = format_unsigned(hdrp, size);
+  *hdrp++ = '\n';
+  return hdrp;
+}
+
+/* Returns false on write error. */
+STATIC ybool write_response_header(int out_fd, int status, off_t size) {
+  /* Large enough to hold 2 off_t()s and 2 more bytes. */
+  char hdrbuf[sizeof(off_t) * 6 + 2];
+  return write_all(out_fd, hdrbuf,
+                   format_response_header(hdrbuf, status, size) - hdrbuf);
+}
+
+/* Returns false on write error. */
+STATIC ybool write_error_response(int out_fd, int status, const char *msg) {
+  const size_t msg_size = strlen(msg);
+  return write_response_header(out_fd, status, msg_size + 1) &&
+         write_all(out_fd, msg, msg_size) &&
+         write_all(out_fd, "\n", 1);
+}
+
+#define RESPONSE_BUF_SIZE 65536
+
+/* Appends the response to query q with the results of run_query (and
+ * line_count for flag -n) to the output buffer obuf[:*op_io] of
+ * RESPONSE_BUF_SIZE bytes, flushing the buffer to stdout as needed. Small
+ * ranges are copied to the buffer, large ones are printed with print_range.
+ */
+STATIC void buffer_response(yfile *yf, const query *q, char *obuf,
+                            char **op_io, int status, off_t start, off_t end,
+                            off_t line_count) {
+  char ofsbuf[sizeof(off_t) * 6 + 2], *ofsp = ofsbuf;
+  char *op = *op_io, *oend = obuf + RESPONSE_BUF_SIZE;
+  const char *buf;
+  off_t size = 0;
+  int need;
+  if (q->printing == PR_CONTENTS) {
+    if (start < end) size = end - start;
+  } else if (q->printing == PR_OFFSETS) {
+    size = (ofsp = format_offsets(ofsbuf, start, end)) - ofsbuf;
+  } else if (q->printing == PR_COUNT) {
+    size = (ofsp = format_count(ofsbuf, line_count)) - ofsbuf;
+  }
+  if (oend - op < (int)sizeof(ofsbuf) * 2 ||
+      (q->printing == PR_CONTENTS && size > oend - op - (int)sizeof(ofsbuf))) {
+    write_all_to_stdout(obuf, op - obuf);
+    op = obuf;
+  }
+  op = format_response_header(op, status, size);
+  if (q->printing == PR_OFFSETS || q->printing == PR_COUNT) {
+    memcpy(op, ofsbuf, size);
+    op += size;
+  } else if (size > oend - op) {  /* Large range. */
+    write_all_to_stdout(obuf, op - obuf);
+    op = obuf;
+    if (!print_range(yf, STDOUT_FILENO, start, end)) {
+      die2_strerror("error: write stdout", "");
+    }
+  } else if (size > 0) {
+    yfseek_set(yf, start);
+    while ((need = yfpeek(yf, size, &buf)) > 0) {
+      memcpy(op, buf, need);
+      op += need;
+      yfseek_cur(yf, need);
+      size -= need;
+    }
+  }
+  *op_io = op;
+}
+
+/* Answers the query line[:lend] (`-<flags>\t<key-x>[\t<key-y>]') on yf,
+ * writing the response to out_fd. Returns false on write error.
+ */
+STATIC ybool answer_query(int out_fd, yfile *yf, const bisect_opts *opts,
+                          const char *line, const char *lend) {
+  const char *x, *y, *p, *msg;
+  char flags[16];
+  char ofsbuf[sizeof(off_t) * 6 + 2], *ofsp;
+  size_t xsize, ysize;
+  off_t start, end;
+  query q;
+  int status;
+  ybool is_ok;
+  for (p = line; p != lend && *p != '\t'; ++p) {}
+  if (p == lend) return write_error_response(out_fd, 1, "missing <key-x>");
+  if (*line != '-' || p - line >= (int)sizeof(flags)) {
+    return write_error_response(out_fd, 1, "missing flags");
+  }
+  memcpy(flags, line + 1, p - line - 1);
+  flags[p - line - 1] = '\0';
+  x = ++p;
+  for (; p != lend && *p != '\t'; ++p) {}
+  xsize = p - x;
+  if (p == lend) {
+    y = NULL;
+    ysize = 0;
+  } else {
+    y = ++p;
+    ysize = lend - y;
+    if (memchr(y, '\t', ysize)) {
+      return write_error_response(out_fd, 1, "too many keys");
+    }
+  }
+  query_init(&q);
+  if ((msg = parse_flags(flags, &q, 1)) != NULL ||
+      (msg = check_query(&q, y != NULL)) != NULL) {
+    return write_error_response(out_fd, 1, msg);
+  }
+  if (yf->stats.is_on) {
+    ystats_reset(&yf->stats, 1);
+    if (opts && opts->idx) ystats_reset(&opts->idx->yf.stats, 0);
+  }
+  status = run_query(yf, opts, &q, x, xsize, y, ysize, &start, &end);
+  if (q.printing == PR_CONTENTS) {
+    is_ok = write_response_header(
+        out_fd, status, start < end ? end - start : 0) &&
+        print_range(yf, out_fd, start, end);
+  } else if (q.printing == PR_OFFSETS || q.printing == PR_COUNT) {
+    ofsp = q.printing == PR_OFFSETS ? format_offsets(ofsbuf, start, end) :
+        format_count(ofsbuf, count_lines(yf, start, end));
+    is_ok = write_response_header(out_fd, status, ofsp - ofsbuf) &&
+            write_all(out_fd, ofsbuf, ofsp - ofsbuf);
+  } else {
+    is_ok = write_response_header(out_fd, status, 0);
+  }
+  if (yf->stats.is_on) {
+    ystats_mark(&yf->stats, YS_PRINT);
+    write_stats(yf, opts);
+  }
+  return is_ok;
+}
+
+/* Answers the queries on stdin, until EOF. */
+STATIC void run_query_stream(yfile *yf, const bisect_opts *opts) {
+  linereader lr;
+  const char *line;
+  int size;
+  ybool is_ok;
+  lrinit(&lr, STDIN_FILENO);
+  while ((size = lrgetline(&lr, &line)) != -1) {
+    if (size == -3) die2_strerror("error: read stdin", "");
+    if (size == -2) {
+      is_ok = write_error_response(STDOUT_FILENO, 1, "query line too long");
+    } else {
+      is_ok = answer_query(STDOUT_FILENO, yf, opts, line, line + size);
+    }
+    if (!is_ok) die2_strerror("error: write stdout", "");
+  }
+}
+
+#if USE_FOLLOW
+/* --- Follow mode (flag -f)
+ *
+ * After the result range has been printed, we wait for the file to grow
+ * (with inotify(7)), and print the appended lines within the range. Since
+ * the file is sorted, appended lines can be within the range only if the
+ * range ends at EOF, and we are done when a line after the range is
+ * appended. Only the appended lines are read, and the incomplete last line
+ * (which may be appended to right now) is ignored. The file is never
+ * bisected again.
+ */
+
+/* Follows the file filename (already opened as yf, and its incomplete last
+ * line ignored) after printing the range ending at end. Returns exit_code,
+ * or 0 if a line has been printed. Returns when a line after the range is
+ * appended, or the file is removed.
+ */
+STATIC int follow_range(yfile *yf, const char *filename, const query *q,
+                        const char *x, size_t xsize,
+                        const char *y, size_t ysize,
+                        off_t end, int exit_code) {
+  struct stat st;
+  char evbuf[4096];
+  off_t fsize = -1, ofs, start;
+  int fd, got;
+  if (end < yfgetsize(yf)) return exit_code;  /* A line after the range. */
+  if (!y) {
+    y = x;
+    ysize = xsize;
+  }
+  yfunmap(yf);  /* The mapping can't grow with the file. */
+  if (yf->cache) {  /* The block at the old EOF may be short. */
+    ycache_free(yf->cache);
+    yf->cache = NULL;
+  }
+  /* Add the watch before fstat(2), so we get an event for each later append.
+   */
+  if ((fd = inotify_init()) < 0 ||
+      inotify_add_watch(fd, filename, IN_MODIFY | IN_ATTRIB) < 0) {
+    die2_strerror("error: inotify ", filename);
+  }
+  for (;;) {
+    if (fstat(yf->fd, &st) != 0) die2_strerror("error: fstat ", filename);
+    if (st.st_size < fsize) die5_code("error: followed file has shrunk: ",
+                                      filename, "", "", "\n", 2);
+    if (st.st_size > fsize) {
+      fsize = st.st_size;
+      ofs = yfgetsize(yf);
+      yfgrow(yf, fsize);
+      yfignore_incomplete_after(yf, ofs);
+      /* Skip the lines before the range, then find the end of the range. */
+      for (; ofs < yfgetsize(yf) && !compare_line(yf, ofs, x, xsize, CM_LE);
+           ofs = get_fofs(yf, ofs + 1)) {}
+      for (start = ofs;
+           ofs < yfgetsize(yf) && !compare_line(yf, ofs, y, ysize, q->cm);
+           ofs = get_fofs(yf, ofs + 1)) {}
+      if (start < ofs) {
+        if (!print_range(yf, STDOUT_FILENO, start, ofs)) {
+          die2_strerror("error: write stdout", "");
+        }
+        exit_code = 0;
+      }
+      if (ofs < yfgetsize(yf)) break;  /* A line after the range. */
+    }
+    if (st.st_nlink == 0) break;  /* Removed, no more appends. */
+    do {
+      got = read(fd, evbuf, sizeof(evbuf));
+    } while (got < 0 && errno == EINTR);
+    if (got <= 0) die2_strerror("error: read inotify", "");
+  }
+  close(fd);
+  return exit_code;
+}
+#endif
+
+#if USE_SHARDS
+/* --- Shards (flag -M)
+ *
+ * With flag -M, <sorted-text-file> is a glob(3) pattern (or @<list-file>,
+ * with a pathname on each line) of shards: sorted files searched as if they
+ * were a single sorted file. The shards are opened and searched in parallel
+ * by a pool of threads (flag -j<N>), each shard by a single thread with its
+ * own yfile. Then the matching lines are printed in sorted order by a k-way
+ * merge (a heap of the next line of each shard), or the offsets are printed
+ * as `<pathname>\t<offsets>' lines in shard order, or the line counts are
+ * summed. With flag -q, we exit as soon as any shard has a match.
+ */
+
+#define SHARD_DEFAULT_THREAD_COUNT 8
+#define SHARD_OUT_BUF_SIZE 65536
+
+typedef struct shard {
+  const char *pathname;
+  yhandle h;
+  int exit_code;  /* Exit code of run_query, or -1 if not searched yet. */
+  off_t start, end;  /* Result of run_query. start is advanced by merging. */
+  /* Next line (start of the range) while merging, including the '\n'. */
+  const char *line;
+  size_t line_size;
+} shard;
+
+typedef struct shard_search {
+  const query *q;
+  const char *x, *y;
+  size_t xsize, ysize;
+  shard *shards;
+  int shard_count;
+  int next;  /* Index of the next shard to be searched. */
+  int done_count;
+  ybool is_found;  /* Some shard has a match. */
+  pthread_mutex_t mutex;
+  pthread_cond_t done;
+} shard_search;
+
+/* Opens and searches shard sh, as main does for a single file. */
+STATIC void search_shard(shard_search *ss, shard *sh) {
+  yhandle_init_query(&sh->h, ss->q);
+  yhandle_open(&sh->h, sh->pathname);
+  sh->exit_code = run_query(&sh->h.yf, &sh->h.opts, ss->q, ss->x, ss->xsize,
+                            ss->y, ss->ysize, &sh->start, &sh->end);
+}
+
+STATIC void *shard_worker_main(void *arg) {
+  shard_search *ss = (shard_search*)arg;
+  int i;
+  for (;;) {
+    pthread_mutex_lock(&ss->mutex);
+    i = ss->is_found && ss->q->printing == PR_DETECT ?
+        ss->shard_count : ss->next++;
+    pthread_mutex_unlock(&ss->mutex);
+    if (i >= ss->shard_count) break;
+    search_shard(ss, ss->shards + i);
+    pthread_mutex_lock(&ss->mutex);
+    ++ss->done_count;
+    if (ss->shards[i].exit_code == 0) ss->is_found = 1;
+    pthread_cond_signal(&ss->done);
+    pthread_mutex_unlock(&ss->mutex);
+  }
+  return NULL;
+}
+
+/* Reads the line of sh at sh->start (< sh->end) to sh->line. */
+STATIC void shard_read_line(shard *sh) {
+  sh->line_size = yfgetline(&sh->h.yf, sh->start, sh->end, &sh->line,
+                            &sh->h.lbuf, &sh->h.lbuf_capacity);
+}
+
+/* Compares the next lines of a and b (without the '\n'), like strcmp.
+ * Equal lines are ordered by shard order.
+ */
+STATIC int shard_compare(const shard *a, const shard *b) {
+  const size_t asize = a->line_size - (a->line[a->line_size - 1] == '\n');
+  const size_t bsize = b->line_size - (b->line[b->line_size - 1] == '\n');
+  const int c = memcmp(a->line, b->line, asize < bsize ? asize : bsize);
+  if (c != 0) return c;
+  if (asize != bsize) return asize < bsize ? -1 : 1;
+  return a < b ? -1 : a > b;
+}
+
+/* Restores the heap property of heap[:heap_size] below index i. */
+STATIC void shard_sift_down(shard **heap, int heap_size, int i) {
+  shard *sh = heap[i];
+  int j;
+  while ((j = 2 * i + 1) < heap_size) {
+    if (j + 1 < heap_size && shard_compare(heap[j + 1], heap[j]) < 0) ++j;
+    if (shard_compare(sh, heap[j]) <= 0) break;
+    heap[i] = heap[j];
+    i = j;
+  }
+  heap[i] = sh;
+}
+
+/* Prints the result ranges of the shards to stdout, merged. An incomplete
+ * last line of a shard gets a '\n' unless it's printed last.
+ */
+STATIC void print_shards_merged(shard *shards, int shard_count) {
+  shard **heap;
+  shard *sh;
+  char *obuf;
+  size_t osize = 0;
+  int heap_size = 0, i;
+  ybool is_nl_missing = 0;
+  if (!(heap = (shard**)malloc(sizeof(shard*) * shard_count)) ||
+      !(obuf = (char*)malloc(SHARD_OUT_BUF_SIZE))) {
+    die1_nomem("error: out of memory for merging");
+  }
+  for (i = 0; i < shard_count; ++i) {
+    if (shards[i].start < shards[i].end) {
+      shard_read_line(heap[heap_size++] = shards + i);
+    }
+  }
+  for (i = heap_size / 2; i-- > 0;) shard_sift_down(heap, heap_size, i);
+  while (heap_size > 0) {
+    sh = heap[0];
+    if (osize + sh->line_size + 1 > SHARD_OUT_BUF_SIZE) {
+      if (!write_all(STDOUT_FILENO, obuf, osize)) {
+        die2_strerror("error: write stdout", "");
+      }
+      osize = 0;
+    }
+    if (is_nl_missing) obuf[osize++] = '\n';
+    if (sh->line_size + 1 > SHARD_OUT_BUF_SIZE) {  /* Long line. */
+      if (!write_all(STDOUT_FILENO, obuf, osize) ||
+          !write_all(STDOUT_FILENO, sh->line, sh->line_size)) {
+        die2_strerror("error: write stdout", "");
+      }
+      osize = 0;
+    } else {
+      memcpy(obuf + osize, sh->line, sh->line_size);
+      osize += sh->line_size;
+    }
+    is_nl_missing = sh->line[sh->line_size - 1] != '\n';
+    if ((sh->start += sh->line_size) < sh->end) {
+      shard_read_line(sh);
+    } else {
+      heap[0] = heap[--heap_size];
+    }
+    if (heap_size > 0) shard_sift_down(heap, heap_size, 0);
+  }
+  if (!write_all(STDOUT_FILENO, obuf, osize)) {
+    die2_strerror("error: write stdout", "");
+  }
+  free(obuf);
+  free(heap);
+}
+
+/* The pathnames of the shards. */
+typedef struct shard_list {
+  char **pathnames;
+  int count;
+  char *list;  /* Contents of the @<list-file>, or NULL if g is used. */
+  glob_t g;
+} shard_list;
+
+/* Sets sl to the pathnames of the shards specified by pattern: a glob(3)
+ * pattern, or @<list-file>. Free it with free_shard_pathnames.
+ */
+STATIC void get_shard_pathnames(const char *pattern, shard_list *sl) {
+  yfile lyf;
+  char **pathnames, *list, *p, *q, *lend;
+  int count = 0, got;
+  if (pattern[0] != '@') {
+    got = glob(pattern, 0, NULL, &sl->g);
+    if (got == GLOB_NOMATCH) die5_code("error: no shards match ", pattern, "",
+                                       "", "\n", 2);
+    if (got != 0) die2_strerror("error: glob ", pattern);
+    sl->pathnames = sl->g.gl_pathv;
+    sl->count = (int)sl->g.gl_pathc;
+    sl->list = NULL;
+    return;
+  }
+  yfopen(&lyf, pattern + 1, (off_t)-1);
+  if (!(list = (char*)malloc(yfgetsize(&lyf) + 1))) {
+    die1_nomem("error: out of memory for shard list");
+  }
+  got = yfread(&lyf, list, (int)yfgetsize(&lyf));
+  yfclose(&lyf);
+  lend = list + got;
+  for (p = list; p != lend; ++p) count += *p == '\n';
+  if (!(pathnames = (char**)malloc(sizeof(char*) * (count + 1)))) {
+    die1_nomem("error: out of memory for shard list");
+  }
+  for (count = 0, p = list; p < lend; p = q + 1) {
+    for (q = p; q != lend && *q != '\n'; ++q) {}
+    *q = '\0';  /* Also fine for q == lend. */
+    if (q != p) pathnames[count++] = p;
+  }
+  if (count == 0) die5_code("error: no shards in ", pattern + 1, "", "", "\n",
+                            2);
+  sl->pathnames = pathnames;
+  sl->count = count;
+  sl->list = list;
+}
+
+STATIC void free_shard_pathnames(shard_list *sl) {
+  if (sl->list) {
+    free(sl->pathnames);
+    free(sl->list);
+  } else {
+    globfree(&sl->g);
+  }
+}
+
+/* Runs the query q on the shards specified by pattern, and prints the
+ * results. Returns the exit code: 0 if there is a match, 3 if not.
+ */
+STATIC int run_shards(const query *q, const char *pattern,
+                      const char *x, size_t xsize,
+                      const char *y, size_t ysize) {
+  shard_search sss, *ss = &sss;
+  shard *sh;
+  pthread_t *threads;
+  shard_list sl;
+  char ofsbuf[sizeof(off_t) * 6 + 2], *ofsp;
+  off_t line_count = 0;
+  int count, i, thread_count;
+  get_shard_pathnames(pattern, &sl);
+  count = sl.count;
+  thread_count = q->thread_count != 0 ? (int)q->thread_count :
+      SHARD_DEFAULT_THREAD_COUNT;
+  if (thread_count > count) thread_count = count;
+  if (!(ss->shards = (shard*)malloc(sizeof(shard) * count)) ||
+      !(threads = (pthread_t*)malloc(sizeof(pthread_t) * thread_count))) {
+    die1_nomem("error: out of memory for shards");
+  }
+  for (i = 0; i < count; ++i) {
+    sh = ss->shards + i;
+    sh->pathname = sl.pathnames[i];
+    sh->exit_code = -1;
+  }
+  ss->q = q;
+  ss->x = x;
+  ss->xsize = xsize;
+  ss->y = y;
+  ss->ysize = ysize;
+  ss->shard_count = count;
+  ss->next = ss->done_count = 0;
+  ss->is_found = 0;
+  pthread_mutex_init(&ss->mutex, NULL);
+  pthread_cond_init(&ss->done, NULL);
+  for (i = 0; i < thread_count; ++i) {
+    if (pthread_create(threads + i, NULL, shard_worker_main, ss) != 0) {
+      die1("error: cannot create shard thread");
+    }
+  }
+  pthread_mutex_lock(&ss->mutex);
+  while (ss->done_count < count &&
+         !(ss->is_found && q->printing == PR_DETECT)) {
+    pthread_cond_wait(&ss->done, &ss->mutex);
+  }
+  pthread_mutex_unlock(&ss->mutex);
+  /* Don't wait for the other shards. Nothing has to be flushed, so exit
+   * without running atexit(3) handlers while the threads are running.
+   */
+  if (q->printing == PR_DETECT) _exit(ss->is_found ? 0 : 3);
+  for (i = 0; i < thread_count; ++i) pthread_join(threads[i], NULL);
+  if (q->printing == PR_CONTENTS) {
+    print_shards_merged(ss->shards, count);
+  } else if (q->printing == PR_OFFSETS) {
+    for (i = 0; i < count; ++i) {
+      sh = ss->shards + i;
+      ofsp = format_offsets(ofsbuf, sh->start, sh->end);
+      write_all_to_stdout(sh->pathname, strlen(sh->pathname));
+      write_all_to_stdout("\t", 1);
+      write_all_to_stdout(ofsbuf, ofsp - ofsbuf);
+    }
+  } else if (q->printing == PR_COUNT) {
+    for (i = 0; i < count; ++i) {
+      sh = ss->shards + i;
+      line_count += count_lines(&sh->h.yf, sh->start, sh->end);
+    }
+    ofsp = format_count(ofsbuf, line_count);
+    write_all_to_stdout(ofsbuf, ofsp - ofsbuf);
+  }
+  for (i = 0; i < count; ++i) {
+    sh = ss->shards + i;
+    if (q->is_verbose) {
+      ystats_mark(&sh->h.yf.stats, YS_PRINT);
+      write_stats(&sh->h.yf, &sh->h.opts);
+    }
+    yhandle_close(&sh->h);
+  }
+  pthread_cond_destroy(&ss->done);
+  pthread_mutex_destroy(&ss->mutex);
+  free(threads);
+  free(ss->shards);
+  free_shard_pathnames(&sl);
+  return ss->is_found ? 0 : 3;
+}
+#endif
+
+#if USE_BATCH
+/* --- Batch (flag -B)
+ *
+ * With flag -B, the keys are read from <key-file> (one key per line), and
+ * the query is run for each key. The keys are sorted, and the sorted keys
+ * are split to contiguous partitions, each searched by a thread (flag
+ * -j<N>) with its own yhandle, sharing the file descriptor (read with
+ * pread(2)). Since the results are monotonic in the key, a thread searches
+ * the middle key of its partition first, and then the keys in each half
+ * only within the bounds given by the result of the middle key, recursively,
+ * thus consecutive keys need only a few probes each. The responses are
+ * printed in the order of <key-file>, in the format of flag -s.
+ */
+
+#define BATCH_MAX_THREAD_COUNT 64
+
+typedef struct batch_key {
+  const char *key;
+  size_t size;
+  int exit_code;
+  off_t start, end;  /* Same as the outputs of run_query. */
+  off_t line_count;  /* For flag -n. */
+} batch_key;
+
+typedef struct batch_worker {
+  yhandle h;
+  const query *q;
+  batch_key **keys;  /* Partition of the sorted keys. */
+  int count;
+  pthread_t thread;
+} batch_worker;
+
+STATIC int batch_key_compare(const void *a, const void *b) {
+  const batch_key *ka = *(const batch_key* const*)a;
+  const batch_key *kb = *(const batch_key* const*)b;
+  const int c = memcmp(ka->key, kb->key,
+                       ka->size < kb->size ? ka->size : kb->size);
+  if (c != 0) return c;
+  return ka->size < kb->size ? -1 : ka->size > kb->size;
+}
+
+/* Runs the query of w on key k, like run_query without <key-y>, but
+ * searching the start only in lo...start_hi, and the end only before
+ * end_hi.
+ */
+STATIC void batch_search(batch_worker *w, batch_key *k, off_t lo,
+                         off_t start_hi, off_t end_hi) {
+  const query *q = w->q;
+  yfile *yf = &w->h.yf;
+  struct cache cache;
+  cache_init(&cache);
+  k->line_count = 0;
+  if (q->cm == CM_LE && q->printing == PR_OFFSETS) {  /* Flag -eo. */
+    k->start = bisect_way(yf, &cache, &w->h.opts, lo, start_hi,
+                          k->key, k->size, q->cmstart);
+    ystats_mark(&yf->stats, YS_START);
+    k->end = -1;
+    k->exit_code = 0;
+    return;
+  }
+  k->start = bisect_way(yf, &cache, &w->h.opts, lo, start_hi,
+                        k->key, k->size, CM_LE);
+  ystats_mark(&yf->stats, YS_START);
+  if (q->cm == CM_LE) {
+    k->end = k->start;
+  } else {
+    cache_init(&cache);  /* Can't reuse cache, cm has changed. */
+    k->end = bisect_way(yf, &cache, &w->h.opts, k->start, end_hi,
+                        k->key, k->size, q->cm);
+    ystats_mark(&yf->stats, YS_END);
+  }
+  k->exit_code = k->start < k->end ? 0 : 3;
+}
+
+/* Searches the sorted keys[:count], whose starts are within lo...start_hi,
+ * and whose ends are before end_hi.
+ */
+STATIC void batch_search_keys(batch_worker *w, batch_key **keys, int count,
+                              off_t lo, off_t start_hi, off_t end_hi) {
+  batch_key *k;
+  int mid;
+  while (count > 0) {
+    k = keys[mid = count >> 1];
+    batch_search(w, k, lo, start_hi, end_hi);
+    /* With flag -p, the end is not monotonic: "a" ends after "ab". */
+    batch_search_keys(w, keys, mid, lo, k->start,
+                      w->q->cm == CM_LT ? k->end : end_hi);
+    keys += mid + 1;  /* Continue with the upper half. */
+    count -= mid + 1;
+    lo = k->start;
+  }
+}
+
+STATIC void *batch_worker_main(void *arg) {
+  batch_worker *w = (batch_worker*)arg;
+  batch_key *k;
+  int i;
+  batch_search_keys(w, w->keys, w->count, 0, (off_t)-1, (off_t)-1);
+  /* Only now, because batch_search_keys needs the whole ranges. */
+  for (i = 0; i < w->count; ++i) {
+    k = w->keys[i];
+    if (k->end < 0) continue;  /* Flag -eo. */
+    limit_range(&w->h.yf, w->q, &k->start, &k->end);
+    if (w->q->printing == PR_COUNT) {
+      k->line_count = count_lines(&w->h.yf, k->start, k->end);
+    }
+  }
+  return NULL;
+}
+
+/* Prints the responses for keys[:count] to stdout, in the format of flag
+ * -s. Small ranges are copied to the output buffer.
+ */
+STATIC void print_batch(yfile *yf, const query *q, const batch_key *keys,
+                        int count) {
+  char *obuf, *op;
+  const batch_key *k;
+  if (!(obuf = (char*)malloc(RESPONSE_BUF_SIZE))) {
+    die1_nomem("error: out of memory for output");
+  }
+  for (op = obuf, k = keys; k != keys + count; ++k) {
+    buffer_response(yf, q, obuf, &op, k->exit_code, k->start, k->end,
+                    k->line_count);
+  }
+  write_all_to_stdout(obuf, op - obuf);
+  free(obuf);
+}
+
+/* Runs the query q (checked by check_query without <key-y>) on h for each
+ * key in key_filename, and prints the responses.
+ */
+STATIC void run_batch(yhandle *h, const query *q, const char *key_filename) {
+  yfile kyf;
+  batch_key *keys, **sorted;
+  batch_worker *workers, *w;
+  char *list, *p, *lend, *nl;
+  long cpu_count;
+  int count = 0, got, i, thread_count;
+  yfopen(&kyf, key_filename, (off_t)-1);
+  if (!(list = (char*)malloc(yfgetsize(&kyf) + 1))) {
+    die1_nomem("error: out of memory for keys");
+  }
+  got = yfread(&kyf, list, (int)yfgetsize(&kyf));
+  yfclose(&kyf);
+  lend = list + got;
+  for (p = list; p != lend; ++p) count += *p == '\n';
+  if (got > 0 && lend[-1] != '\n') ++count;  /* Incomplete last line. */
+  if (count == 0) goto done;
+  if (!(keys = (batch_key*)malloc(sizeof(batch_key) * count)) ||
+      !(sorted = (batch_key**)malloc(sizeof(batch_key*) * count))) {
+    die1_nomem("error: out of memory for keys");
+  }
+  for (i = 0, p = list; i < count; ++i, p = nl + 1) {
+    if (!(nl = (char*)memchr(p, '\n', lend - p))) nl = lend;
+    keys[i].key = p;
+    keys[i].size = nl - p;
+    sorted[i] = keys + i;
+  }
+  qsort(sorted, count, sizeof(batch_key*), batch_key_compare);
+  if ((thread_count = (int)q->thread_count) == 0) {
+    cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    thread_count = cpu_count > 0 ? (int)(cpu_count < BATCH_MAX_THREAD_COUNT ?
+        cpu_count : BATCH_MAX_THREAD_COUNT) : 1;
+  }
+  if (thread_count > BATCH_MAX_THREAD_COUNT) {
+    thread_count = BATCH_MAX_THREAD_COUNT;
+  }
+  if (thread_count > count) thread_count = count;
+  if (!(workers = (batch_worker*)malloc(
+      sizeof(batch_worker) * thread_count))) {
+    die1_nomem("error: out of memory for batch");
+  }
+  for (i = 0; i < thread_count; ++i) {
+    w = workers + i;
+    w->q = q;
+    w->keys = sorted + (long)count * i / thread_count;
+    w->count = (int)((long)count * (i + 1) / thread_count -
+                     (long)count * i / thread_count);
+    yhandle_init_query(&w->h, q);
+    yhandle_dup(&w->h, h);
+    if (pthread_create(&w->thread, NULL, batch_worker_main, w) != 0) {
+      die1("error: cannot create batch thread");
+    }
+  }
+  for (i = 0; i < thread_count; ++i) pthread_join(workers[i].thread, NULL);
+  print_batch(&h->yf, q, keys, count);
+  for (i = 0; i < thread_count; ++i) {
+    w = workers + i;
+    if (q->is_verbose) write_stats(&w->h.yf, &w->h.opts);
+    yhandle_close(&w->h);
+  }
+  free(workers);
+  free(sorted);
+  free(keys);
+ done:
+  free(list);
+}
+#endif
+
+/* --- Join (flag -J)
+ *
+ * With flag -J, the keys are read from a sorted <key-file> (or stdin if it's
+ * -) as a stream, and the query is run for each key, with the same
+ * responses as flag -B, in a single pass: since the results are monotonic
+ * in the key, the search of a key starts at the result of the previous
+ * key, with probes at exponentially growing distances (galloping), and
+ * then bisect_way runs only in the window found. Thus dense keys need about
+ * a sequential pass over the file in total, and sparse keys a logarithmic
+ * number of probes each. The read buffer and the flag -k cache are kept
+ * between keys. A key smaller than the previous one is searched from the
+ * start of the file (slower, but correct).
+ */
+
+#define JOIN_FIRST_STEP 256
+
+/* Like bisect_way(yf, ..., lo, -1, x, xsize, cm), but first it probes
+ * forward from lo, doubling the step, to find a small window.
+ */
+STATIC off_t gallop_way(yfile *yf, const bisect_opts *opts, off_t lo,
+                        const char *x, size_t xsize, compare_mode_t cm) {
+  const off_t size = yfgetsize(yf);
+  off_t hi = size, step = JOIN_FIRST_STEP, ofs;
+  struct cache cache;  /* Shared with bisect_way, x and cm are the same. */
+  cache_init(&cache);
+  while ((ofs = lo + step) < size) {
+    ++yf->stats.probe_count;
+    if (get_using_cache(yf, &cache, ofs, x, xsize, cm)->cmp_result) {
+      hi = ofs;
+      break;
+    }
+    lo = ofs + 1;
+    step <<= 1;
+  }
+  return bisect_way(yf, &cache, opts, lo, hi, x, xsize, cm);
+}
+
+/* Runs the query q (checked by check_query without <key-y>) on yf for each
+ * key in key_filename, and prints the responses.
+ */
+STATIC void run_join(yfile *yf, const bisect_opts *opts, const query *q,
+                     const char *key_filename) {
+  linereader lr;
+  const char *key;
+  char *obuf, *op, *prev;
+  off_t lo = 0, start, end;
+  int size, prev_size = -1, c, status;
+  if (!(obuf = (char*)malloc(RESPONSE_BUF_SIZE)) ||
+      !(prev = (char*)malloc(QUERY_LINE_BUF_SIZE))) {
+    die1_nomem("error: out of memory for join");
+  }
+  if (0 == strcmp(key_filename, "-")) {
+    lrinit(&lr, STDIN_FILENO);
+  } else if ((c = open(key_filename, O_RDONLY | O_BINARY, 0)) >= 0) {
+    lrinit(&lr, c);
+  } else {
+    die2_strerror("error: open ", key_filename);
+  }
+  op = obuf;
+  while ((size = lrgetline(&lr, &key)) != -1) {
+    if (size == -3) die2_strerror("error: read ", key_filename);
+    if (size == -2) {
+      die5_code("error: key too long in ", key_filename, "", "", "\n", 2);
+    }
+    if (prev_size >= 0) {  /* Compare key with the previous key. */
+      c = memcmp(key, prev, size < prev_size ? size : prev_size);
+      if (c < 0 || (c == 0 && size < prev_size)) lo = 0;  /* Not sorted. */
+    }
+    memcpy(prev, key, prev_size = size);
+    if (q->cm == CM_LE && q->printing == PR_OFFSETS) {  /* Flag -eo. */
+      lo = start = gallop_way(yf, opts, lo, key, size, q->cmstart);
+      end = -1;
+      status = 0;
+    } else {
+      lo = start = gallop_way(yf, opts, lo, key, size, CM_LE);
+      end = q->cm == CM_LE ? start :
+          gallop_way(yf, opts, start, key, size, q->cm);
+      status = start < end ? 0 : 3;
+      limit_range(yf, q, &start, &end);
+    }
+    buffer_response(yf, q, obuf, &op, status, start, end,
+                    q->printing == PR_COUNT ? count_lines(yf, start, end) : 0);
+  }
+  write_all_to_stdout(obuf, op - obuf);
+  if (lr.fd != STDIN_FILENO) close(lr.fd);
+  if (q->is_verbose) write_stats(yf, opts);
+  free(prev);
+  free(obuf);
+}
+
+#if USE_INSERT
+/* --- Merge-insert (flag -N)
+ *
+ * With flag -N, the lines of <new-lines-file> are inserted to the sorted
+ * file, keeping it sorted, without sorting the whole file again. The new
+ * lines are sorted in memory, and each is inserted after the equal lines
+ * already in the file (at the offset printed by flag -aeo), found by
+ * bisect_way from the insertion offset of the previous new line. If all
+ * new lines go after the end, they are appended in place. Otherwise the
+ * file is rewritten to a new temporary file next to it (after resolving
+ * symlinks), copying the parts between the insertion offsets with
+ * print_range (within the kernel if possible), and then it's renamed over
+ * the file, so readers see either the old or the new file. (If the file
+ * has hard links, the temporary file is copied back in place instead.)
+ * Concurrent runs of -N are serialized by an exclusive flock(2) on the
+ * file.
+ */
+
+#define INSERT_BUF_SIZE 65536
+
+typedef struct insert_line {
+  const char *line;
+  size_t size;
+} insert_line;
+
+/* Output of the merge. */
+typedef struct inserter {
+  yfile *yf;
+  int fd;
+  const char *pathname;  /* Of fd, for error messages. */
+  off_t pos;  /* yf[:pos] has been merged. */
+  ybool need_nl;  /* yf has an incomplete last line, not written yet. */
+  size_t wsize;  /* Number of bytes in wbuf. */
+  char wbuf[INSERT_BUF_SIZE];  /* Buffered new lines. */
+} inserter;
+
+STATIC int insert_line_compare(const void *a, const void *b) {
+  const insert_line *la = (const insert_line*)a;
+  const insert_line *lb = (const insert_line*)b;
+  const int c = memcmp(la->line, lb->line,
+                       la->size < lb->size ? la->size : lb->size);
+  if (c != 0) return c;
+  return la->size < lb->size ? -1 : la->size > lb->size;
+}
+
+STATIC void insert_flush(inserter *ins) {
+  if (!write_all(ins->fd, ins->wbuf, ins->wsize)) {
+    die2_strerror("error: write ", ins->pathname);
+  }
+  ins->wsize = 0;
+}
+
+/* Writes buf[:size] to ins, buffered. */
+STATIC void insert_write(inserter *ins, const char *buf, size_t size) {
+  if (size > INSERT_BUF_SIZE - ins->wsize) {
+    insert_flush(ins);
+    if (size > INSERT_BUF_SIZE) {
+      if (!write_all(ins->fd, buf, size)) {
+        die2_strerror("error: write ", ins->pathname);
+      }
+      return;
+    }
+  }
+  memcpy(ins->wbuf + ins->wsize, buf, size);
+  ins->wsize += size;
+}
+
+/* Copies yf[ins->pos:end] to ins. */
+STATIC void insert_copy(inserter *ins, off_t end) {
+  if (ins->pos >= end) return;
+  insert_flush(ins);
+  if (!print_range(ins->yf, ins->fd, ins->pos, end)) {
+    die2_strerror("error: write ", ins->pathname);
+  }
+  ins->pos = end;
+}
+
+/* Writes the new line l to ins, at ins->pos. */
+STATIC void insert_new_line(inserter *ins, const insert_line *l) {
+  if (ins->need_nl && ins->pos == yfgetsize(ins->yf)) {
+    insert_write(ins, "\n", 1);
+    ins->need_nl = 0;
+  }
+  insert_write(ins, l->line, l->size);
+  insert_write(ins, "\n", 1);
+}
+
+/* Opens pathname as yf, and locks it with flock(2) against concurrent runs
+ * of -N, until yfclose. Fills *st.
+ */
+STATIC void insert_open_locked(yfile *yf, const char *pathname,
+                               struct stat *st) {
+  struct stat pst;
+  for (;;) {
+    yfopen(yf, pathname, (off_t)-1);
+#if USE_ZLIB
+    if (YF_IS_COMPRESSED(yf)) {
+      die5_code("error: cannot insert to BGZF file: ", pathname, "", "",
+                "\n", 2);
+    }
 #endif
+    if (flock(yf->fd, LOCK_EX) != 0) die2_strerror("error: flock ", pathname);
+    if (fstat(yf->fd, st) != 0) die2_strerror("error: fstat ", pathname);
+    /* Retry if another -N has replaced or appended to it in the meantime. */
+    if (stat(pathname, &pst) == 0 && pst.st_dev == st->st_dev &&
+        pst.st_ino == st->st_ino && st->st_size == yfgetsize(yf)) {
+      break;
+    }
+    yfclose(yf);
+  }
 }
 
-#if defined(__i386__) && __SIZEOF_INT__ == 4 && __SIZEOF_LONG_LONG__ == 8 && \
-    defined(__GNUC__)
-/* A smaller implementation of division for format_unsigned, which doesn't
- * call the __udivdi3 (for 64-bit /) and __umoddi3 (for 64-bit %) functions
- * from libgcc. This implementation can be smaller because the divisor (b) is
- * only 32 bits.
+/* Copies the temporary file tmp_fd[:size] to the beginning of pathname, which
+ * is not longer than size. Closes tmp_fd.
  */
+STATIC void insert_copy_back(int tmp_fd, const char *tmppathname,
+                             const char *pathname, off_t size) {
+  yfile tyf;
+  int fd;
+  if ((fd = open(pathname, O_WRONLY | O_BINARY, 0)) < 0) {
+    die2_strerror("error: open ", pathname);
+  }
+  yfopen_fd(&tyf, tmp_fd, size);
+  if (!print_range(&tyf, fd, 0, size)) {
+    die2_strerror("error: write ", pathname);
+  }
+  yfclose(&tyf);
+  if (fsync(fd) != 0) die2_strerror("error: fsync ", pathname);
+  if (close(fd) != 0) die2_strerror("error: close ", pathname);
+  if (unlink(tmppathname) != 0) die2_strerror("error: unlink ", tmppathname);
+}
 
-typedef unsigned UInt32;
-typedef unsigned long long UInt64;
-/* Returns *a % b, and sets *a = *a_old / b; */
-STATIC __inline__ UInt32 UInt64DivAndGetMod(UInt64 *a, UInt32 b) {
-  /* http://stackoverflow.com/a/41982320/97248 */
-  UInt32 upper = ((UInt32*)a)[1], r;
-  ((UInt32*)a)[1] = 0;
-  if (upper >= b) {
-    ((UInt32*)a)[1] = upper / b;
-    upper %= b;
+/* Inserts the lines of lines_filename to filename, opening it as yf. */
+STATIC void run_insert(yfile *yf, const char *filename,
+                       const char *lines_filename) {
+  yfile lyf;
+  inserter ins;
+  insert_line *lines;
+  struct cache cache;
+  struct stat st;
+  char *list, *p, *lend, *nl, *pathname, *tmppathname = NULL;
+  off_t size, ofs;
+  int count = 0, got, i;
+  size_t pathname_size;
+  if (!(pathname = realpath(filename, NULL))) {
+    die2_strerror("error: open ", filename);
   }
-  __asm__("divl %2" : "=a" (((UInt32*)a)[0]), "=d" (r) :
-      "rm" (b), "0" (((UInt32*)a)[0]), "1" (upper));
-  return r;
+  insert_open_locked(yf, pathname, &st);
+  size = yfgetsize(yf);
+  yfopen(&lyf, lines_filename, (off_t)-1);
+  if (!(list = (char*)malloc(yfgetsize(&lyf) + 1))) {
+    die1_nomem("error: out of memory for new lines");
+  }
+  got = yfread(&lyf, list, (int)yfgetsize(&lyf));
+  yfclose(&lyf);
+  lend = list + got;
+  for (p = list; p != lend; ++p) count += *p == '\n';
+  if (got > 0 && lend[-1] != '\n') ++count;  /* Incomplete last line. */
+  if (count == 0) goto done;
+  if (!(lines = (insert_line*)malloc(sizeof(insert_line) * count))) {
+    die1_nomem("error: out of memory for new lines");
+  }
+  for (i = 0, p = list; i < count; ++i, p = nl + 1) {
+    if (!(nl = (char*)memchr(p, '\n', lend - p))) nl = lend;
+    lines[i].line = p;
+    lines[i].size = nl - p;
+  }
+  qsort(lines, count, sizeof(insert_line), insert_line_compare);
+  cache_init(&cache);
+  ofs = bisect_way(yf, &cache, NULL, 0, (off_t)-1, lines[0].line,
+                   lines[0].size, CM_LT);
+  ins.yf = yf;
+  ins.wsize = 0;
+  ins.need_nl = 0;
+  if (size > 0) {
+    yfseek_set(yf, size - 1);
+    ins.need_nl = YFGETCHAR(yf) != '\n';
+  }
+  if (ofs == size) {  /* Append all in place. */
+    ins.pathname = pathname;
+    ins.pos = size;
+    if ((ins.fd = open(pathname, O_WRONLY | O_APPEND | O_BINARY, 0)) < 0) {
+      die2_strerror("error: open ", pathname);
+    }
+    for (i = 0; i < count; ++i) insert_new_line(&ins, lines + i);
+  } else {
+    pathname_size = strlen(pathname);
+    if (!(tmppathname = (char*)malloc(pathname_size + 8))) {
+      die1_nomem("error: out of memory for pathname");
+    }
+    memcpy(tmppathname, pathname, pathname_size);
+    memcpy(tmppathname + pathname_size, ".XXXXXX", 8);
+    ins.pathname = tmppathname;
+    ins.pos = 0;
+    if ((ins.fd = mkstemp(tmppathname)) < 0) {  /* With O_EXCL. */
+      die2_strerror("error: open ", tmppathname);
+    }
+    /* Keep the owner and permissions of the original. */
+    (void)!fchown(ins.fd, st.st_uid, st.st_gid);
+    if (fchmod(ins.fd, st.st_mode & 07777) != 0) {
+      die2_strerror("error: chmod ", tmppathname);
+    }
+    for (i = 0; i < count; ++i) {
+      if (i > 0) {
+        cache_init(&cache);  /* Can't reuse cache, x has changed. */
+        ofs = bisect_way(yf, &cache, NULL, ins.pos, (off_t)-1, lines[i].line,
+                         lines[i].size, CM_LT);
+      }
+      insert_copy(&ins, ofs);
+      insert_new_line(&ins, lines + i);
+    }
+    insert_copy(&ins, size);
+  }
+  insert_flush(&ins);
+  if (tmppathname && st.st_nlink > 1) {  /* Keep the hard links. */
+    insert_copy_back(ins.fd, tmppathname, pathname,
+                     lseek(ins.fd, 0, SEEK_CUR));
+  } else {
+    if (tmppathname && fsync(ins.fd) != 0) {
+      die2_strerror("error: fsync ", tmppathname);
+    }
+    if (close(ins.fd) != 0) die2_strerror("error: close ", ins.pathname);
+    if (tmppathname && rename(tmppathname, pathname) != 0) {
+      die2_strerror("error: rename ", tmppathname);
+    }
+  }
+  free(tmppathname);
+  free(lines);
+ done:
+  yfclose(yf);  /* Releases the lock. */
+  free(pathname);
+  free(list);
 }
-/* Returns *a % b, and sets *a = *a_old / b; */
-STATIC __inline__ UInt32 UInt32DivAndGetMod(UInt32 *a, UInt32 b) {
-  /* gcc-4.4 is smart enough to optimize the / and % to a single divl. */
-  const UInt32 r = *a % b;
-  *a /= b;
-  return r;
+#endif
+
+#if USE_SERVER
+/* --- Server (flag -S) and client (flag -z)
+ *
+ * The server opens the files once, and answers queries on a Unix domain
+ * socket with a pool of worker threads. Each worker has its own yfile (read
+ * buffer, position and flag -k cache) for each file, sharing the file
+ * descriptor (read with pread(2)) and the memory mapping. A connection is
+ * served by a single worker. Each query on a connection is a line
+ * `<sorted-text-file>\t-<flags>\t<key-x>[\t<key-y>]', and each response is
+ * the same as with flag -s, with <status> 2 if the file is not served. Files
+ * are matched by the pathname resolved by realpath(3).
+ */
+
+#ifndef SERVER_QUEUE_SIZE
+#define SERVER_QUEUE_SIZE 64
+#endif
+#define SERVER_DEFAULT_THREAD_COUNT 4
+
+typedef struct served_file {
+  const char *pathname;  /* Resolved by realpath(3). */
+  yfile yf;
+  lbindex idx;
+  bisect_opts opts;
+} served_file;
+
+typedef struct server {
+  served_file *files;  /* Owning the file descriptors and mappings. */
+  int file_count;
+  /* Queue of accepted connections, waiting for a worker. */
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty, not_full;
+  int queue[SERVER_QUEUE_SIZE];
+  int queue_head, queue_count;
+} server;
+
+typedef struct worker {
+  server *srv;
+  served_file *files;  /* Borrowing from srv->files. */
+  linereader lr;
+#if USE_IO_URING
+  yuring uring;  /* Flag -K. */
+#endif
+} worker;
+
+/* Answers the queries on connection fd, until EOF or error. */
+STATIC void serve_connection(worker *w, int fd) {
+  const served_file *sf;
+  served_file *files = w->files;
+  const int file_count = w->srv->file_count;
+  const char *line, *lend, *p;
+  int size, i;
+  ybool is_ok;
+  lrinit(&w->lr, fd);
+  while ((size = lrgetline(&w->lr, &line)) != -1 && size != -3) {
+    if (size == -2) {
+      is_ok = write_error_response(fd, 1, "query line too long");
+    } else {
+      lend = line + size;
+      for (p = line; p != lend && *p != '\t'; ++p) {}
+      for (i = 0; i < file_count; ++i) {
+        sf = files + i;
+        if (strlen(sf->pathname) == (size_t)(p - line) &&
+            0 == memcmp(sf->pathname, line, p - line)) break;
+      }
+      if (p == lend) {
+        is_ok = write_error_response(fd, 1, "missing flags");
+      } else if (i == file_count) {
+        is_ok = write_error_response(fd, 2, "file not served");
+      } else {
+        is_ok = answer_query(fd, &files[i].yf, &files[i].opts, p + 1, lend);
+      }
+    }
+    if (!is_ok) break;
+  }
+  close(fd);
 }
 
-/** Returns p + size of formatted output. */
-STATIC char *format_unsigned(char *p, off_t i) {
-  struct AssertOffTSizeIs4or8_Struct {
-    int  AssertOffTSizeIs4or8 : sizeof(i) == 4 || sizeof(i) == 8;
-  };
-  char *q = p, *result, c;
-  assert(i >= 0);
-  do {
-    *q++ = '0' + (
-        sizeof(i) == 8 ? UInt64DivAndGetMod((UInt64*)&i, 10) :
-        sizeof(i) == 4 ? UInt32DivAndGetMod((UInt32*)&i, 10) :
-        0);  /* 0 never happens, see AssertOffTSizeIs4or8 above. */
-  } while (i != 0);
-  result = q--;
-  while (p < q) {  /* Reverse the string between p and q. */
-    c = *p; *p++ = *q; *q-- = c;
+STATIC void *worker_main(void *arg) {
+  worker *w = (worker*)arg;
+  server *srv = w->srv;
+  int fd;
+  for (;;) {
+    pthread_mutex_lock(&srv->mutex);
+    while (srv->queue_count == 0) {
+      pthread_cond_wait(&srv->not_empty, &srv->mutex);
+    }
+    fd = srv->queue[srv->queue_head];
+    srv->queue_head = (srv->queue_head + 1) % SERVER_QUEUE_SIZE;
+    --srv->queue_count;
+    pthread_cond_signal(&srv->not_full);
+    pthread_mutex_unlock(&srv->mutex);
+    serve_connection(w, fd);
   }
-  return result;
+  return NULL;
 }
-#else
 
-/** Returns p + size of formatted output. */
-static char *format_unsigned(char *p, off_t i) {
-  char *q = p, *result, c;
-  assert(i >= 0);
-  do {
-    *q++ = '0' + (i % 10);
-  } while ((i /= 10) != 0);
-  result = q--;
-  while (p < q) {  /* Reverse the string between p and q. */
-    c = *p; *p++ = *q; *q-- = c;
+/* Fills addr with the socket pathname. Returns false if it's too long. */
+STATIC ybool set_unix_addr(struct sockaddr_un *addr, const char *pathname) {
+  const size_t size = strlen(pathname);
+  if (size >= sizeof(addr->sun_path)) return 0;
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  memcpy(addr->sun_path, pathname, size + 1);
+  return 1;
+}
+
+/* Opens the files (with the file-level flags in q), and serves them on
+ * socket_path. Never returns.
+ */
+STATIC __attribute__((noreturn)) void run_server(
+    const query *q, const char *socket_path,
+    char **filenames, int file_count) {
+  struct sockaddr_un addr;
+  struct stat st;
+  server sserver, *srv = &sserver;
+  worker *workers;
+  served_file *sf;
+  pthread_t thread;
+  const unsigned thread_count =
+      q->thread_count != 0 ? q->thread_count : SERVER_DEFAULT_THREAD_COUNT;
+  unsigned wi;
+  int lfd, fd, i;
+#if USE_IO_URING
+  ybool use_uring, has_uring = 0;
+#endif
+  if (!set_unix_addr(&addr, socket_path)) die1("error: socket path too long");
+  srv->file_count = file_count;
+  if (!(srv->files = (served_file*)malloc(sizeof(served_file) * file_count)) ||
+      !(workers = (worker*)malloc(sizeof(worker) * thread_count))) {
+    die1_nomem("error: out of memory for workers");
   }
-  return result;
+#if USE_IO_URING
+  use_uring = q->kary != 0 && yuring_open(&workers[0].uring, q->kary);
+#endif
+  for (i = 0; i < file_count; ++i) {
+    sf = srv->files + i;
+    if (!(sf->pathname = realpath(filenames[i], NULL))) {
+      die2_strerror("error: open ", filenames[i]);
+    }
+#if YF_USE_DIRECT
+    if (q->is_cold) {
+      yfopen_cold(&sf->yf, filenames[i]);
+    } else
+#endif
+    {
+      yfopen(&sf->yf, filenames[i], (off_t)-1);
+    }
+#if USE_IO_URING
+    if (use_uring) yfunmap(&sf->yf);
+#endif
+    bisect_opts_init(&sf->opts, q);
+    if (q->use_index && lbindex_open(&sf->idx, filenames[i], &sf->yf)) {
+      sf->opts.idx = &sf->idx;
+    }
+    if (q->incomplete == IN_IGNORE) yfignore_incomplete(&sf->yf);
+  }
+  for (wi = 0; wi < thread_count; ++wi) {
+    workers[wi].srv = srv;
+    if (!(workers[wi].files = (served_file*)malloc(
+        sizeof(served_file) * file_count))) {
+      die1_nomem("error: out of memory for workers");
+    }
+#if USE_IO_URING
+    has_uring = use_uring &&
+        (wi == 0 || yuring_open(&workers[wi].uring, q->kary));
+#endif
+    for (i = 0; i < file_count; ++i) {
+      sf = workers[wi].files + i;
+      sf->pathname = srv->files[i].pathname;
+      yfopen_dup(&sf->yf, &srv->files[i].yf);
+      sf->yf.stats.is_on = q->is_verbose;
+      if (q->cache_kb != 0 &&
+          !yfenable_cache(&sf->yf, (size_t)q->cache_kb << 10)) {
+        die1_nomem("error: out of memory for cache");
+      }
+      bisect_opts_init(&sf->opts, q);
+      if (srv->files[i].opts.idx) {
+        sf->idx.count = srv->files[i].idx.count;
+        yfopen_dup(&sf->idx.yf, &srv->files[i].idx.yf);
+        sf->opts.idx = &sf->idx;
+      }
+#if USE_IO_URING
+      if (has_uring) sf->opts.uring = &workers[wi].uring;
+#endif
+    }
+  }
+  pthread_mutex_init(&srv->mutex, NULL);
+  pthread_cond_init(&srv->not_empty, NULL);
+  pthread_cond_init(&srv->not_full, NULL);
+  srv->queue_head = srv->queue_count = 0;
+  signal(SIGPIPE, SIG_IGN);  /* Get EPIPE from write(2) instead. */
+  if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    die2_strerror("error: socket", "");
+  }
+  /* Remove the socket of a previous server, but nothing else. */
+  if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(socket_path);
+  }
+  if (bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    die2_strerror("error: bind ", socket_path);
+  }
+  if (listen(lfd, SERVER_QUEUE_SIZE) != 0) die2_strerror("error: listen", "");
+  for (wi = 0; wi < thread_count; ++wi) {
+    if (pthread_create(&thread, NULL, worker_main, workers + wi) != 0) {
+      die1("error: cannot create worker thread");
+    }
+  }
+  for (;;) {
+    if ((fd = accept(lfd, NULL, NULL)) < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      die2_strerror("error: accept", "");
+    }
+    pthread_mutex_lock(&srv->mutex);
+    while (srv->queue_count == SERVER_QUEUE_SIZE) {
+      pthread_cond_wait(&srv->not_full, &srv->mutex);
+    }
+    srv->queue[(srv->queue_head + srv->queue_count) % SERVER_QUEUE_SIZE] = fd;
+    ++srv->queue_count;
+    pthread_cond_signal(&srv->not_empty);
+    pthread_mutex_unlock(&srv->mutex);
+  }
+}
+
+/* Sends the query to the server at $PTS_LBSEARCH_SOCKET, and prints the
+ * response as if the query was run locally. Flags which affect the whole
+ * file (such as -i) are ignored, they are taken from the server command
+ * line. Returns the exit code.
+ */
+STATIC int run_client(const char *flags, const char *filename,
+                      const char *x, size_t xsize,
+                      const char *y, size_t ysize) {
+  struct sockaddr_un addr;
+  const char *socket_path = getenv("PTS_LBSEARCH_SOCKET");
+  char *pathname, *req, *reqp;
+  const char *line;
+  linereader *lr;
+  off_t size;
+  size_t pathname_size;
+  int fd, status, got;
+  if (!socket_path || !*socket_path) {
+    die1("error: PTS_LBSEARCH_SOCKET not set");
+  }
+  if (!set_unix_addr(&addr, socket_path)) die1("error: socket path too long");
+  if (!(pathname = realpath(filename, NULL))) {
+    die2_strerror("error: open ", filename);
+  }
+  pathname_size = strlen(pathname);
+  if (!(req = (char*)malloc(pathname_size + strlen(flags) + xsize + ysize +
+                            5)) ||
+      !(lr = (linereader*)malloc(sizeof(linereader)))) {
+    die1_nomem("error: out of memory");
+  }
+  memcpy(reqp = req, pathname, pathname_size);
+  reqp += pathname_size;
+  *reqp++ = '\t';
+  *reqp++ = '-';
+  for (; *flags; ++flags) {  /* Drop the file-level flags. */
+    if (*flags == 'z' || *flags == 'i' || *flags == 'x' || *flags == 'u' ||
+        *flags == 'k' || *flags == 'h' || *flags == 'K' || *flags == 'v' ||
+        *flags == 'd' || *flags == 'H' || *flags == 'w') {
+      while (flags[1] >= '0' && flags[1] <= '9') ++flags;
+    } else {
+      *reqp++ = *flags;  /* Keep the query flags, e.g. -m<N>. */
+    }
+  }
+  *reqp++ = '\t';
+  memcpy(reqp, x, xsize);
+  reqp += xsize;
+  if (y) {
+    *reqp++ = '\t';
+    memcpy(reqp, y, ysize);
+    reqp += ysize;
+  }
+  *reqp++ = '\n';
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    die2_strerror("error: socket", "");
+  }
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    die2_strerror("error: connect ", socket_path);
+  }
+  if (!write_all(fd, req, reqp - req)) {
+    die2_strerror("error: write socket", "");
+  }
+  shutdown(fd, SHUT_WR);
+  lrinit(lr, fd);
+  if ((got = lrgetline(lr, &line)) < 3 || line[0] < '0' || line[0] > '9' ||
+      line[1] != ' ') {
+    die1("error: bad response from server");
+  }
+  status = line[0] - '0';
+  for (size = 0, line += 2; --got >= 2; ++line) {
+    if (*line < '0' || *line > '9') die1("error: bad response from server");
+    size = size * 10 + (*line - '0');
+  }
+  if (status == 1 || status == 2) {
+    (void)!write(STDERR_FILENO, status == 1 ? "usage error: " : "error: ",
+                 status == 1 ? 13 : 7);
+  }
+  for (;;) {
+    got = lr->rend - lr->p;
+    if (got > size) got = (int)size;
+    if (!write_all(status == 1 || status == 2 ? STDERR_FILENO : STDOUT_FILENO,
+                   lr->p, got)) {
+      die2_strerror("error: write stdout", "");
+    }
+    if ((size -= got) == 0) break;
+    do {
+      got = read(fd, lr->buf, sizeof(lr->buf));
+    } while (got < 0 && errno == EINTR);
+    if (got <= 0) die1("error: short response from server");
+    lr->p = lr->buf;
+    lr->rend = lr->buf + got;
+  }
+  close(fd);
+  free(lr);
+  free(req);
+  free(pathname);
+  return status;
 }
 #endif
 
-typedef enum printing_t {
-  PR_OFFSETS,
-  PR_CONTENTS,
-  PR_DETECT,
-  PR_UNSET,
-} printing_t;
+#if !PTS_LBSEARCH_LIB
+/* --- main */
 
-typedef enum incomplete_t {
-  IN_IGNORE,  /* Ignore incomplete last line of file. */
-  IN_USE,  /* Use incomplete last line of file as if it had a trailin '\n'. */
-  IN_UNSET,  /* Not set yet. Most functions do not support it. */
-} incomplete_t;
+STATIC __attribute__((noreturn)) void usage_error(
+    const char *argv0, const char *msg) {
+  die5_code("Binary search (bisection) in a sorted text file\n"
+            "Usage: ", argv0, "-<flags> <sorted-text-file> <key-x> [<key-y>]\n"
+            "<key-x> is the first key to search for\n"
+            "<key-y> is the last key to search for; default is <key-x>\n"
+            "Flags:\n"
+            "e: do bisect_left, open interval end\n"
+            "t: do bisect_right, closed interval end\n"
+            "b: do bisect_left for interval start (default)\n"
+            "a: do bisect_right for interval start (for append position)\n"
+            "p: do prefix search\n"
+            "c: print file contents (default)\n"
+            "o: print file offsets\n"
+            "q: don't print anything, just detect if there is a match\n"
+            "n: print the number of lines (like -c | wc -l, but also\n"
+            "   counting an incomplete last line)\n"
+            "m<N>: limit the range to its first N lines\n"
+            "r: with -m<N>, limit the range to its last N lines\n"
+            "i: ignore incomplete last line (may be appended to right now)\n"
+            "s: read queries from stdin, without <key-x>: each query line is\n"
+            "   -<flags>\\t<key-x>[\\t<key-y>], each response is a\n"
+            "   `<exit-code> <size>' line followed by <size> bytes\n"
+            "x: use the sidecar index <sorted-text-file>.lbidx if up to date\n"
+            "X: write the sidecar index, without <key-x>\n"
+#if USE_ZLIB
+            "Z: write <sorted-text-file>.gz and .gz.gzi in BGZF format (as\n"
+            "   bgzip -i), without <key-x>; BGZF files are searched as is\n"
+#endif
+            "u: do interpolation search (for uniformly distributed keys)\n"
+            "k<N>: use N KiB of memory for block and line cache (e.g. -s)\n"
+#if YF_USE_FADVISE
+            "h[<N>]: prefetch blocks of the next N (default: 1) levels of\n"
+            "   probes with posix_fadvise(2) (for slow disks)\n"
+#endif
+#if USE_IO_URING
+            "K[<N>]: do N-ary (default: 16) search with parallel reads using\n"
+            "   io_uring (for NVMe), then bisection\n"
+#endif
+            "w[<N>]: lines are fixed-width records of N bytes (including\n"
+            "   the \\n; default: length of the first line), probes need no\n"
+            "   scanning for line starts; checked on a few lines\n"
+            "v: print I/O and search statistics of each query to stderr\n"
+#if USE_SHM_CACHE
+            "H: cache the top levels of the bisection in shared memory\n"
+            "   (/dev/shm), for many short runs on the same file\n"
+#endif
+#if YF_USE_DIRECT
+            "d: print large ranges with O_DIRECT reads (or drop them from\n"
+            "   the page cache), to keep other processes' cached data\n"
+#endif
+#if USE_FOLLOW
+            "f: after printing, keep printing the lines appended to the file\n"
+            "   within the range (implies -i), until a line after the range\n"
+#endif
+#if USE_SERVER
+            "S: run a server: -S<flags> <socket> <sorted-text-file>...;\n"
+            "   query lines are <sorted-text-file>\\t-<flags>\\t<key-x>...,\n"
+            "   with the same responses as with -s\n"
+            "j<N>: use N worker threads in the server (default: 4)\n"
+            "z: send the query to the server at $PTS_LBSEARCH_SOCKET\n"
+#endif
+#if USE_SHARDS
+            "M: <sorted-text-file> is a glob pattern (or @<list-file>) of\n"
+            "   shards, searched by -j<N> (default: 8) threads in parallel;\n"
+            "   contents are printed merged, offsets per shard\n"
+#endif
+#if USE_BATCH
+            "B: batch: -B<flags> <sorted-text-file> <key-file>; run the\n"
+            "   query for each line of <key-file> in -j<N> (default: CPU\n"
+            "   count) threads, with the same responses as with -s\n"
+#endif
+            "J: join: -J<flags> <sorted-text-file> <sorted-key-file>; like\n"
+            "   -B, but in a single thread and a single pass over the file\n"
+#if USE_INSERT
+            "N: insert: -N <sorted-text-file> <new-lines-file>; insert the\n"
+            "   lines to the file keeping it sorted, without a full sort\n"
+#endif
+            "usage error: ", msg, "\n",
+            1);
+}
 
 int main(int argc, char **argv) {
-  yfile yff, *yf = &yff;
+  yhandle hh, *h = &hh;
+  yfile *yf = &h->yf;
+  const bisect_opts *opts;
   const char *x;
   const char *y;
   const char *filename;
-  const char *flags;
   const char *p;
-  char flag;
+  const char *msg;
   /* Large enough to hold 2 off_t()s and 2 more bytes. */
   char ofsbuf[sizeof(off_t) * 6 + 2], *ofsp;
-  compare_mode_t cm = CM_UNSET;
-  compare_mode_t cmstart = CM_UNSET;
   size_t xsize, ysize;
   off_t start, end;
-  printing_t printing = PR_UNSET;
-  incomplete_t incomplete = IN_UNSET;
+  query q;
+  int exit_code;
 
   /* Parse the command-line. */
-  if (argc != 4 && argc != 5) usage_error(argv[0], "incorrect argument count");
+  if (argc < 2) usage_error(argv[0], "incorrect argument count");
   if (argv[1][0] != '-') usage_error(argv[0], "missing flags");
-  flags = argv[1] + 1;
-  filename = argv[2];
-  x = argv[3];
-  for (p = x; *p && *p != '\n'; ++p) {}
-  xsize = p - x;  /* Make sure x[:psize] doesn't contain '\n'. */
-  if (argc == 4) {
-    y = NULL;
-    ysize = 0;
-  } else {
-    y = argv[4];
-    for (p = y; *p && *p != '\n'; ++p) {}
-    ysize = p - y;  /* Make sure x[:psize] doesn't contain '\n'. */
+  query_init(&q);
+  if ((msg = parse_flags(argv[1] + 1, &q, 0)) != NULL) {
+    usage_error(argv[0], msg);
   }
-  /* TODO(pts): Make the initial lo and hi offsets specifiable. */
-  for (p = flags; (flag = *p); ++p) {
-    if (flag == 'e') {
-      if (cm != CM_UNSET) usage_error(argv[0], "multiple boundary flags");
-      cm = CM_LE;
-    } else if (flag == 't') {
-      if (cm != CM_UNSET) usage_error(argv[0], "multiple boundary flags");
-      cm = CM_LT;
-    } else if (flag == 'p') {
-      if (cm != CM_UNSET) usage_error(argv[0], "multiple boundary flags");
-      cm = CM_LP;
-    } else if (flag == 'b') {
-      if (cmstart != CM_UNSET) usage_error(argv[0], "multiple start flags");
-      cmstart = CM_LE;
-    } else if (flag == 'a') {
-      if (cmstart != CM_UNSET) usage_error(argv[0], "multiple start flags");
-      cmstart = CM_LT;
-    } else if (flag == 'o') {
-      if (printing != PR_UNSET) usage_error(argv[0], "multiple printing flags");
-      printing = PR_OFFSETS;
-    } else if (flag == 'c') {
-      if (printing != PR_UNSET) usage_error(argv[0], "multiple printing flags");
-      printing = PR_CONTENTS;
-    } else if (flag == 'q') {
-      if (printing != PR_UNSET) usage_error(argv[0], "multiple printing flags");
-      printing = PR_DETECT;
-    } else if (flag == 'i') {
-      if (incomplete != IN_UNSET) {
-        usage_error(argv[0], "multiple incomplete flags");
-      }
-      incomplete = IN_IGNORE;
-    } else {
-      usage_error(argv[0], "unsupported flag");
-    }
+  x = y = NULL;
+  xsize = ysize = 0;
+  if (q.thread_count != 0 && !q.is_server && !q.is_shards && !q.is_batch) {
+    usage_error(argv[0], "flag -j needs -S, -M or -B");
   }
-  if (printing == PR_UNSET) printing = PR_CONTENTS;
-  if (incomplete == IN_UNSET) incomplete = IN_USE;
-  if (cmstart == CM_UNSET) cmstart = CM_LE;
-  if (cm == CM_UNSET) usage_error(argv[0], "missing boundary flag");
-  if (cmstart == CM_LT && !(!y && cm == CM_LE && printing == PR_OFFSETS)) {
-    /* TODO(pts): Make cmstart=CM_LT work in bisect_interval etc. */
-    usage_error(argv[0], "flag -a needs -eo and no <key-y>");
+  if (q.is_server) {
+    if (argc < 4) usage_error(argv[0], "incorrect argument count");
+    if (q.cm != CM_UNSET || q.cmstart != CM_UNSET || q.printing != PR_UNSET) {
+      usage_error(argv[0], "query flags must be specified per query");
+    }
+    if (q.is_stream || q.is_index_write || q.is_bgzf_write || q.is_client ||
+        q.is_shards || q.is_follow || q.is_batch || q.is_join ||
+        q.use_shm_cache) {
+      usage_error(argv[0], "incompatible flags");
+    }
+  } else if (q.is_batch || q.is_join) {
+    if (argc != 4) usage_error(argv[0], "incorrect argument count");
+    if ((msg = check_query(&q, 0)) != NULL) usage_error(argv[0], msg);
+    if (q.is_stream || q.is_index_write || q.is_bgzf_write || q.is_client ||
+        q.is_shards || q.is_follow || (q.is_batch && q.is_join)) {
+      usage_error(argv[0], "incompatible flags");
+    }
+  } else if (q.is_insert) {
+    if (argc != 4) usage_error(argv[0], "incorrect argument count");
+    if (strcmp(argv[1], "-N") != 0) usage_error(argv[0], "incompatible flags");
+  } else if (q.is_stream || q.is_index_write || q.is_bgzf_write) {
+    if (argc != 3) usage_error(argv[0], "incorrect argument count");
+    if (q.cm != CM_UNSET || q.cmstart != CM_UNSET || q.printing != PR_UNSET) {
+      usage_error(argv[0], "query flags must be specified per query");
+    }
+    if (((q.is_index_write || q.is_bgzf_write) &&
+         (q.is_stream || q.use_index || q.use_interpolation ||
+          q.cache_kb != 0 || q.prefetch_depth != 0 || q.kary != 0 ||
+          q.is_verbose || q.incomplete != IN_UNSET || q.is_cold ||
+          q.use_shm_cache || q.reclen != 0 ||
+          (q.is_index_write && q.is_bgzf_write))) ||
+        q.is_client || q.is_shards || q.is_follow) {
+      usage_error(argv[0], "incompatible flags");
+    }
+  } else {
+    if (argc != 4 && argc != 5) {
+      usage_error(argv[0], "incorrect argument count");
+    }
+    x = argv[3];
+    for (p = x; *p && *p != '\n'; ++p) {}
+    xsize = p - x;  /* Make sure x[:psize] doesn't contain '\n'. */
+    if (argc == 5) {
+      y = argv[4];
+      for (p = y; *p && *p != '\n'; ++p) {}
+      ysize = p - y;  /* Make sure x[:psize] doesn't contain '\n'. */
+    }
+    /* TODO(pts): Make the initial lo and hi offsets specifiable. */
+    if ((msg = check_query(&q, y != NULL)) != NULL) usage_error(argv[0], msg);
+#if USE_SERVER
+    if (q.is_client &&
+        (memchr(x, '\t', xsize) || (y && memchr(y, '\t', ysize)))) {
+      usage_error(argv[0], "key contains tab");
+    }
+#endif
+    if (q.is_shards && (q.is_client || q.max_lines != 0)) {
+      usage_error(argv[0], "incompatible flags");
+    }
+    if (q.is_follow && (q.printing != PR_CONTENTS || q.is_client ||
+                        q.is_shards || q.max_lines != 0)) {
+      usage_error(argv[0], "flag -f needs -c, without -z, -M and -m");
+    }
   }
-  if (!y && printing != PR_OFFSETS && cm == CM_LE) {
-    usage_error(argv[0], "single-key contents is always empty");
+  filename = argv[2];
+#if USE_SERVER
+  if (q.is_server) run_server(&q, argv[2], argv + 3, argc - 3);
+  if (q.is_client) {
+    return run_client(argv[1] + 1, filename, x, xsize, y, ysize);
   }
+#endif
+#if USE_SHARDS
+  if (q.is_shards) return run_shards(&q, filename, x, xsize, y, ysize);
+#endif
 
-  yfopen(yf, filename, (off_t)-1);
-  if (incomplete == IN_IGNORE) {
-    off_t size = yfgetsize(yf);
-    int c;
-    while (size != 0) {
-      yfseek_set(yf, size - 1);
-      if ((c = YFGETCHAR(yf)) < 0 || c == '\n') break;
-      --size;
-    }
-    yflimit(yf, size);
-  }
-  if (!y && cm == CM_LE && printing == PR_OFFSETS) {
-    struct cache cache;
-    cache_init(&cache);
-    start = bisect_way(yf, &cache, 0, (off_t)-1, x, xsize, cmstart);
-    yfclose(yf);
-    ofsp = ofsbuf;
-    ofsp = format_unsigned(ofsp, start);
-    *ofsp++ = '\n';
-    write_all_to_stdout(ofsbuf, ofsp - ofsbuf);
-  } else if (printing == PR_DETECT &&
-             (!y || (xsize == ysize && 0 == memcmp(x, y, xsize)))) {
-    /* This branch is just a shortcut, it doesn't change the results. */
-    struct cache cache;
-    const struct cache_entry *entry;
-    /* Shortcut just to detect if x is present. */
-    if (cm == CM_LE) exit(3);  /* start:end range would always be empty. */
-    cache_init(&cache);
-    start = bisect_way(yf, &cache, 0, (off_t)-1, x, xsize, CM_LE);
-    cache_init(&cache);  /* Can't reuse cache, cm has changed. */
-    /* We don't benefit any speed from the cache here (because it's empty),
-     * but we reuse the existing code to compare a single line from yf.
-     */
-    entry = get_using_cache(yf, &cache, start, x, xsize, cm);
+  if (q.is_index_write || q.is_bgzf_write) {
+    yfopen(yf, filename, (off_t)-1);
+    if (q.is_index_write) lbindex_write(filename, yf);
+#if USE_ZLIB
+    if (q.is_bgzf_write) bgzf_write(filename, yf);
+#endif
     yfclose(yf);
-    if (entry->cmp_result) exit(3);  /* exit(3) iff x not found in yf. */
+    return EXIT_SUCCESS;  /* 0. */
+  }
+#if USE_INSERT
+  if (q.is_insert) {
+    run_insert(yf, filename, argv[3]);
+    return EXIT_SUCCESS;  /* 0. */
+  }
+#endif
+  yhandle_init_query(h, &q);
+  yhandle_open(h, filename);
+  yf = &h->yf;
+  opts = &h->opts;
+#if USE_ZLIB
+  if (q.is_follow && YF_IS_COMPRESSED(yf)) {
+    die5_code("error: cannot follow BGZF file: ", filename, "", "", "\n", 2);
+  }
+#endif
+  if (q.is_stream) {
+    run_query_stream(yf, opts);
+    exit_code = EXIT_SUCCESS;  /* 0. */
+#if USE_BATCH
+  } else if (q.is_batch) {
+    run_batch(h, &q, argv[3]);
+    exit_code = EXIT_SUCCESS;  /* 0. */
+#endif
+  } else if (q.is_join) {
+    run_join(yf, opts, &q, argv[3]);
+    exit_code = EXIT_SUCCESS;  /* 0. */
   } else {
-    if (!y) {
-      y = x;
-      ysize = xsize;
-    }
-    bisect_interval(yf, 0, (off_t)-1, cm, x, xsize, y, ysize, &start, &end);
-    if (printing == PR_CONTENTS) {
-      print_range(yf, start, end);
-    } else if (printing == PR_OFFSETS) {
-      ofsp = ofsbuf;
-      ofsp = format_unsigned(ofsp, start);
-      *ofsp++ = ' ';
-      ofsp = format_unsigned(ofsp, end);
-      *ofsp++ = '\n';
+    exit_code = run_query(yf, opts, &q, x, xsize, y, ysize, &start, &end);
+    if (q.printing == PR_CONTENTS) {
+      if (!print_range(yf, STDOUT_FILENO, start, end)) {
+        die2_strerror("error: write stdout", "");
+      }
+    } else if (q.printing == PR_OFFSETS) {
+      ofsp = format_offsets(ofsbuf, start, end);
+      write_all_to_stdout(ofsbuf, ofsp - ofsbuf);
+    } else if (q.printing == PR_COUNT) {
+      ofsp = format_count(ofsbuf, count_lines(yf, start, end));
       write_all_to_stdout(ofsbuf, ofsp - ofsbuf);
     }
-    yfclose(yf);
-    if (start >= end) exit(3);  /* No match found. */
+    if (q.is_verbose) {
+      ystats_mark(&yf->stats, YS_PRINT);
+      write_stats(yf, opts);
+    }
+#if USE_FOLLOW
+    if (q.is_follow) {
+      exit_code = follow_range(yf, filename, &q, x, xsize, y, ysize, end,
+                               exit_code);
+    }
+#endif
   }
-  return EXIT_SUCCESS;  /* 0. */
+  yhandle_close(h);
+  return exit_code;
 }
+#endif
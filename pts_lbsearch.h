@@ -0,0 +1,130 @@
+/*
+ * pts_lbsearch.h: Library API of pts_lbsearch.c, for embedding.
+ * by pts@fazekas.hu
+ *
+ * License: GNU GPL v2 or newer, at your choice.
+ *
+ * Build the library with compile_lib.sh (libptslbsearch.a and
+ * libptslbsearch.so). Usable from C (C89 or later) and C++.
+ *
+ * A handle (pts_lbsearch) is an open sorted text file with its own read
+ * buffer and caches. The functions never call exit(3): they return
+ * PTS_LBSEARCH_OK (0) on success, or a negative error code, and then
+ * pts_lbsearch_errmsg() returns the error message. There is no global
+ * state, but a handle must not be used by multiple threads at the same
+ * time. To search the same file in multiple threads, create a handle for
+ * each thread with pts_lbsearch_dup, which shares the file descriptor (read
+ * with pread(2)) and the memory mapping.
+ */
+
+#ifndef PTS_LBSEARCH_H
+#define PTS_LBSEARCH_H 1
+
+#include <stddef.h>  /* size_t. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct pts_lbsearch pts_lbsearch;
+
+/* Error codes, returned by the functions. */
+#define PTS_LBSEARCH_OK 0
+#define PTS_LBSEARCH_EIO (-1)  /* A system call failed, errno is set. */
+#define PTS_LBSEARCH_ENOMEM (-2)  /* Out of memory. */
+#define PTS_LBSEARCH_EFORMAT (-3)  /* Bad file format (e.g. BGZF). */
+#define PTS_LBSEARCH_EINVAL (-4)  /* Bad argument. */
+#define PTS_LBSEARCH_ECALLBACK (-5)  /* The line_func returned < 0. */
+
+/* Flags of pts_lbsearch_options. */
+#define PTS_LBSEARCH_IGNORE_INCOMPLETE 1  /* Flag -i. */
+#define PTS_LBSEARCH_USE_INDEX 2  /* Flag -x. */
+#define PTS_LBSEARCH_INTERPOLATION 4  /* Flag -u. */
+#define PTS_LBSEARCH_STATS 8  /* Collect statistics (for flag -v). */
+#define PTS_LBSEARCH_SHM_CACHE 32  /* Flag -H. */
+#define PTS_LBSEARCH_FIXED_WIDTH 64  /* Flag -w: detect fixed-width lines. */
+
+/* File-level options of a handle. All 0 are the defaults. */
+typedef struct pts_lbsearch_options {
+  unsigned flags;  /* PTS_LBSEARCH_... flags above, ORed. */
+  unsigned cache_kb;  /* Flag -k<N>: block and line cache size in KiB. */
+  int prefetch_depth;  /* Flag -h<N>: levels of probes to prefetch. */
+  int kary;  /* Flag -K<N>: k of k-ary search with io_uring, or 0. */
+} pts_lbsearch_options;
+
+/* Search modes, for the end of the range. */
+#define PTS_LBSEARCH_LEFT 0  /* bisect_left: lines >= key (flag -e). */
+#define PTS_LBSEARCH_RIGHT 1  /* bisect_right: lines > key (flag -t). */
+#define PTS_LBSEARCH_PREFIX 2  /* Lines not starting with key (flag -p). */
+
+/* Called by pts_lbsearch_iterate for each line (without the '\n'). line is
+ * valid only during the call. Return 0 to continue, or a positive value to
+ * stop the iteration. A negative value also stops it, but then
+ * pts_lbsearch_iterate returns PTS_LBSEARCH_ECALLBACK instead.
+ */
+typedef int (*pts_lbsearch_line_func)(void *arg, const char *line,
+                                      size_t size);
+
+/* Opens the sorted text file (or BGZF file) pathname, and sets *h_out.
+ * opts can be NULL for the defaults.
+ */
+int pts_lbsearch_open(pts_lbsearch **h_out, const char *pathname,
+                      const pts_lbsearch_options *opts);
+
+/* Like pts_lbsearch_open, but opens a duplicate of fd (which stays open),
+ * and searches only its first size bytes, or the whole file if size is -1.
+ * BGZF files are not detected.
+ */
+int pts_lbsearch_open_fd(pts_lbsearch **h_out, int fd, long long size,
+                         const pts_lbsearch_options *opts);
+
+/* Like pts_lbsearch_open, but searches buf[:size] in memory, which must not
+ * be changed or freed before the handle (and its duplicates) is closed.
+ */
+int pts_lbsearch_open_memory(pts_lbsearch **h_out, const char *buf,
+                             size_t size, const pts_lbsearch_options *opts);
+
+/* Creates a new handle for the same file as src, and sets *h_out. src must
+ * not be closed before the new handle.
+ */
+int pts_lbsearch_dup(pts_lbsearch **h_out, const pts_lbsearch *src);
+
+void pts_lbsearch_close(pts_lbsearch *h);
+
+/* Returns the size of the file (without the incomplete last line with
+ * PTS_LBSEARCH_IGNORE_INCOMPLETE).
+ */
+long long pts_lbsearch_size(const pts_lbsearch *h);
+
+/* Sets *ofs_out to the offset of the first line which is not before key
+ * (key[:key_size], it can't contain '\n'): with PTS_LBSEARCH_LEFT, the
+ * first line >= key; with PTS_LBSEARCH_RIGHT, the first line > key; with
+ * PTS_LBSEARCH_PREFIX, the first line > key which doesn't start with key.
+ */
+int pts_lbsearch_bisect(pts_lbsearch *h, const char *key, size_t key_size,
+                        int mode, long long *ofs_out);
+
+/* Sets *start_out and *end_out to the range of lines starting at the first
+ * line >= x, and ending before the first line after y in mode (see
+ * pts_lbsearch_bisect). y == NULL means y = x, e.g. for a prefix search.
+ * The range is empty if *start_out >= *end_out.
+ */
+int pts_lbsearch_range(pts_lbsearch *h, const char *x, size_t xsize,
+                       const char *y, size_t ysize, int mode,
+                       long long *start_out, long long *end_out);
+
+/* Calls func for each line in the range start...end (as returned by
+ * pts_lbsearch_range). Returns the (positive) value returned by func if it
+ * has stopped the iteration, 0 at the end of the range, or an error code.
+ */
+int pts_lbsearch_iterate(pts_lbsearch *h, long long start, long long end,
+                         pts_lbsearch_line_func func, void *arg);
+
+/* Returns the message of the last error in the calling thread. */
+const char *pts_lbsearch_errmsg(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* PTS_LBSEARCH_H */
@@ -0,0 +1,327 @@
+#! /bin/sh
+
+""":" # Benchmark for pts_lbsearch and pts_line_bisect.py.
+
+type -p python2.7 >/dev/null 2>&1 && exec python2.7 -- "$0" ${1+"$@"}
+type -p python2.6 >/dev/null 2>&1 && exec python2.6 -- "$0" ${1+"$@"}
+exec python -- "$0" ${1+"$@"}; exit 1
+
+Generates a sorted text file with the specified size, line length
+distribution and key distribution, runs a battery of -e, -t, -p, -q and -o
+queries against pts_lbsearch (one process per query, like shell callers
+do) and against pts_line_bisect.py (in-process), and reports latency
+percentiles, I/O calls and bytes read per query.
+
+For pts_lbsearch, the I/O counts are the lseek(2), read(2), pread(2),
+sendfile(2) and copy_file_range(2) system calls reported by its flag -v,
+and the search time is the time spent within the process (as reported by
+-v), without exec(2) and the dynamic linker. For pts_line_bisect.py, the
+I/O counts are the seek, read and readline calls on the file object.
+
+pts_lbsearch is compiled from pts_lbsearch.c for each YF_READ_BUF_SIZE
+specified in --buf-sizes (reading with pread(2), without mmap(2), since
+YF_READ_BUF_SIZE doesn't matter for mapped files), and also in the default
+configuration (mmap). With --cold, the page cache of the file is evicted
+with posix_fadvise(POSIX_FADV_DONTNEED) before each query.
+
+Usage example:
+
+  $ ./pts_lbsearch_bench.py --size-mb=64 --line-len=exp:80 --keys=hex \\
+        --queries=200 --buf-sizes=4096,8192,65536 --cold
+
+The output is a table on stdout, one row per implementation, build and
+flags.
+"""
+
+import optparse
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+import pts_line_bisect
+
+POSIX_FADV_DONTNEED = 4  # Linux.
+
+ALL_FLAGS = ('e', 't', 'p', 'q', 'o')
+
+# Command-line flags of each query in the battery, for each of ALL_FLAGS,
+# and whether it needs <key-y>.
+QUERY_FLAGS = {
+    'e': ('-e', True),
+    't': ('-t', False),
+    'p': ('-p', False),
+    'q': ('-qt', False),
+    'o': ('-eo', False),
+}
+
+
+def parse_dist(spec):
+  """Parses a line length distribution like `fixed:80', `uniform:10:200' or
+  `exp:80'. Returns a function which returns a random length.
+  """
+  items = spec.split(':')
+  kind, args = items[0], [int(item) for item in items[1:]]
+  if kind == 'fixed' and len(args) == 1:
+    return lambda rnd: args[0]
+  if kind == 'uniform' and len(args) == 2:
+    return lambda rnd: rnd.randint(args[0], args[1])
+  if kind == 'exp' and len(args) == 1:
+    return lambda rnd: int(rnd.expovariate(1.0 / args[0]))
+  raise ValueError('bad line length distribution: %r' % spec)
+
+
+def make_key(rnd, keys):
+  """Returns a random key with distribution keys."""
+  if keys == 'hex':  # Uniform, good for interpolation search (-u).
+    return '%016x' % rnd.getrandbits(64)
+  if keys == 'decimal':  # Zero-padded, also uniform.
+    return '%012d' % rnd.randrange(10 ** 12)
+  if keys == 'words':  # Skewed: many common prefixes.
+    return ''.join(rnd.choice('etaoinshr') for _ in
+                   xrange(int(rnd.expovariate(0.25)) + 1))
+  if keys == 'random':
+    return ''.join(rnd.choice('abcdefghijklmnopqrstuvwxyz0123456789') for _
+                   in xrange(12))
+  raise ValueError('bad key distribution: %r' % keys)
+
+
+def generate_file(filename, size, line_len, keys, rnd):
+  """Writes a sorted text file of about size bytes. Returns the keys."""
+  lines, total = [], 0
+  while total < size:
+    key = make_key(rnd, keys)
+    line = key + ' ' + 'x' * max(0, line_len(rnd) - len(key) - 1)
+    lines.append(line)
+    total += len(line) + 1
+  lines.sort()
+  f = open(filename, 'wb')
+  try:
+    f.write('\n'.join(lines) + '\n')
+    f.flush()
+    os.fsync(f.fileno())  # posix_fadvise(DONTNEED) ignores dirty pages.
+  finally:
+    f.close()
+  return [line.split(' ', 1)[0] for line in lines]
+
+
+def make_queries(rnd, keys, file_keys, count):
+  """Returns count (x, y) pairs, half of them present in the file."""
+  queries = []
+  for _ in xrange(count):
+    if rnd.random() < 0.5:
+      x = rnd.choice(file_keys)
+    else:
+      x = make_key(rnd, keys)
+    queries.append((x, rnd.choice(file_keys)))
+  return queries
+
+
+def drop_cache(filename):
+  """Evicts filename from the page cache."""
+  fd = os.open(filename, os.O_RDONLY)
+  try:
+    if getattr(os, 'posix_fadvise', None):
+      os.posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED)
+    else:
+      import ctypes
+      libc = ctypes.CDLL(None)
+      libc.posix_fadvise(fd, ctypes.c_longlong(0), ctypes.c_longlong(0),
+                         POSIX_FADV_DONTNEED)
+  finally:
+    os.close(fd)
+
+
+def build(cc, src, out, defines):
+  cmd = [cc, '-O2', '-DNDEBUG', '-pthread', '-o', out, src] + [
+      '-D%s' % define for define in defines]
+  subprocess.check_call(cmd)
+
+
+def parse_stats(stderr):
+  """Parses the `stats name=value ...' line of flag -v to a dict."""
+  for line in stderr.splitlines():
+    if line.startswith('stats '):
+      return dict((name, int(value)) for name, value in
+                  (item.split('=') for item in line.split()[1:]))
+  raise ValueError('missing stats in: %r' % stderr)
+
+
+def run_lbsearch(binary, filename, flags, x, y, is_cold):
+  """Runs a single query. Returns (latency, search_time, io_calls, bytes)."""
+  if is_cold:
+    drop_cache(filename)
+  argv = [binary, flags + 'v', filename, x]
+  if y is not None:
+    argv.append(y)
+  start = time.time()
+  p = subprocess.Popen(argv, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+  _, stderr = p.communicate()
+  latency = time.time() - start
+  if p.returncode not in (0, 3):
+    raise RuntimeError('query failed: %r: %s' % (argv, stderr))
+  stats = parse_stats(stderr)
+  search_time = (stats['open_us'] + stats['start_us'] + stats['end_us'] +
+                 stats['print_us']) / 1e6
+  io_calls = stats['lseeks'] + stats['reads'] + stats['copies']
+  return latency, search_time, io_calls, stats['read_bytes']
+
+
+class CountingFile(object):
+  """File object wrapper counting the I/O calls and bytes read."""
+
+  def __init__(self, f):
+    self.f = f
+    self.io_calls = self.read_bytes = 0
+
+  def tell(self):
+    return self.f.tell()
+
+  def seek(self, *args):
+    self.io_calls += 1
+    return self.f.seek(*args)
+
+  def read(self, *args):
+    self.io_calls += 1
+    data = self.f.read(*args)
+    self.read_bytes += len(data)
+    return data
+
+  def readline(self):
+    self.io_calls += 1
+    data = self.f.readline()
+    self.read_bytes += len(data)
+    return data
+
+
+def run_python(filename, flags, x, y, is_cold):
+  """Runs a single query in-process with pts_line_bisect.
+
+  Returns (latency, search_time, io_calls, bytes), or None if flags are not
+  supported.
+  """
+  if 'p' in flags or 'q' in flags:
+    return None
+  if is_cold:
+    drop_cache(filename)
+  is_open = 'e' in flags
+  start = time.time()
+  f = CountingFile(open(filename, 'rb'))
+  try:
+    if is_open and 'o' in flags and y is None:
+      pts_line_bisect.bisect_way(f, x, True)
+    else:
+      start_ofs, end_ofs = pts_line_bisect.bisect_interval(f, x, y, is_open)
+      if 'o' not in flags and start_ofs < end_ofs:
+        f.seek(start_ofs)
+        f.read(end_ofs - start_ofs)
+  finally:
+    f.f.close()
+  latency = time.time() - start
+  return latency, latency, f.io_calls, f.read_bytes
+
+
+def percentile(values, p):
+  values = sorted(values)
+  return values[min(len(values) - 1, int(len(values) * p / 100.0))]
+
+
+def main(argv):
+  parser = optparse.OptionParser(usage='%prog [options]')
+  parser.add_option('--size-mb', type='float', default=16,
+                    help='size of the generated file in MiB')
+  parser.add_option('--line-len', default='uniform:20:200',
+                    help='line length distribution: fixed:N, '
+                    'uniform:MIN:MAX or exp:MEAN')
+  parser.add_option('--keys', default='random',
+                    help='key distribution: random, hex, decimal or words')
+  parser.add_option('--queries', type='int', default=100,
+                    help='number of queries for each flag')
+  parser.add_option('--flags', default=','.join(ALL_FLAGS),
+                    help='comma-separated query kinds to run, of e, t, p, '
+                    'q and o')
+  parser.add_option('--buf-sizes', default='8192',
+                    help='comma-separated YF_READ_BUF_SIZE values to build')
+  parser.add_option('--cold', action='store_true', default=False,
+                    help='evict the file from the page cache before each '
+                    'query')
+  parser.add_option('--no-python', action='store_true', default=False,
+                    help="don't benchmark pts_line_bisect.py")
+  parser.add_option('--seed', type='int', default=1)
+  parser.add_option('--cc', default=os.getenv('CC', 'gcc'))
+  parser.add_option('--keep', action='store_true', default=False,
+                    help="don't remove the temporary directory")
+  options, args = parser.parse_args(argv[1:])
+  if args:
+    parser.error('too many arguments')
+  flag_kinds = [kind for kind in options.flags.split(',') if kind]
+  for kind in flag_kinds:
+    if kind not in QUERY_FLAGS:
+      parser.error('bad query kind: %r' % kind)
+  src = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                     'pts_lbsearch.c')
+  rnd = random.Random(options.seed)
+  tmpdir = tempfile.mkdtemp(prefix='pts_lbsearch_bench.')
+  try:
+    builds = [('mmap', os.path.join(tmpdir, 'pts_lbsearch.mmap'), [])]
+    for buf_size in options.buf_sizes.split(','):
+      builds.append(('pread%s' % buf_size,
+                     os.path.join(tmpdir, 'pts_lbsearch.%s' % buf_size),
+                     ['YF_READ_BUF_SIZE=%s' % buf_size, 'YF_USE_MMAP=0']))
+    for _, binary, defines in builds:
+      build(options.cc, src, binary, defines)
+    filename = os.path.join(tmpdir, 'data.sorted')
+    file_keys = generate_file(filename, int(options.size_mb * (1 << 20)),
+                              parse_dist(options.line_len), options.keys, rnd)
+    queries = make_queries(rnd, options.keys, file_keys, options.queries)
+    sys.stdout.write(
+        '# size=%d lines=%d line_len=%s keys=%s queries=%d cold=%d\n' %
+        (os.path.getsize(filename), len(file_keys), options.line_len,
+         options.keys, len(queries), int(options.cold)))
+    sys.stdout.write('%-8s %-10s %-4s %9s %9s %11s %11s %9s %11s\n' % (
+        'impl', 'build', 'flag', 'p50_ms', 'p99_ms', 'search_p50',
+        'search_p99', 'io_calls', 'read_bytes'))
+    runs = [('c', name, binary) for name, binary, _ in builds]
+    if not options.no_python:
+      runs.append(('python', '-', None))
+    for impl, name, binary in runs:
+      for kind in flag_kinds:
+        flags, has_y = QUERY_FLAGS[kind]
+        results = []
+        for x, y in queries:
+          if not has_y:
+            y = None
+          elif y < x:
+            x, y = y, x
+          if binary:
+            result = run_lbsearch(binary, filename, flags, x, y,
+                                  options.cold)
+          else:
+            result = run_python(filename, flags, x, y, options.cold)
+          if result is None:
+            break
+          results.append(result)
+        if not results:
+          continue
+        latencies = [r[0] * 1000 for r in results]
+        search_times = [r[1] * 1000 for r in results]
+        sys.stdout.write(
+            '%-8s %-10s %-4s %9.3f %9.3f %11.3f %11.3f %9.1f %11.0f\n' % (
+            impl, name, flags, percentile(latencies, 50),
+            percentile(latencies, 99), percentile(search_times, 50),
+            percentile(search_times, 99),
+            float(sum(r[2] for r in results)) / len(results),
+            float(sum(r[3] for r in results)) / len(results)))
+        sys.stdout.flush()
+  finally:
+    if options.keep:
+      sys.stderr.write('info: kept %s\n' % tmpdir)
+    else:
+      shutil.rmtree(tmpdir)
+
+
+if __name__ == '__main__':
+  sys.exit(main(sys.argv))
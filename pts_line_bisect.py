@@ -25,9 +25,18 @@ please use the C implementation instead in pts_lbsearch.c, which does less
 IO (i.e. fewer calls to lseek(2) and read(2)), is faster, has more features
 (i.e. more command-line flags).
 
+If the C extension pts_line_bisect_ext (built by compile_pyext.sh from
+pts_lbsearch.c) can be imported, then the functions of this module use it
+for file objects with getbuffer() or fileno(), which is much faster.
+
 TODO(pts): Add setup.py and upload to PyPi.
 """
 
+try:
+  import pts_line_bisect_ext as _ext
+except ImportError:
+  _ext = None
+
 
 def _read_and_compare(cache, ofs, f, size, tester):
   """Read a line from f at ofs, and test it.
@@ -131,19 +140,37 @@ def bisect_way(f, x, is_left, size=None):
     bisect_left), then the smallest possible offset is returned, otherwise
     (i.e. bisect_right) the largest possible address is returned.
   """
+  if _ext:
+    result = _ext.bisect_way(f, x, is_left, size)
+    if result is not NotImplemented:
+      return result
   x = x.rstrip('\n')
   if is_left and not x:  # Shortcut.
     return 0
+  if is_left:
+    return _bisect_tester(f, x.__le__, size)  # x <= y.
+  else:
+    return _bisect_tester(f, x.__lt__, size)  # x < y.
+
+
+def _bisect_tester(f, tester, size):
+  """Return the offset of the first line in f for which tester is true.
+
+  Args:
+    f: Like in bisect_way.
+    tester: Like in _read_and_compare. Must be monotonic in sorted f.
+    size: Like in bisect_way.
+  Returns:
+    The start offset of the first line for which tester returns true, or
+    size if there is no such line.
+  """
   if size is None:
     f.seek(0, 2)
     size = f.tell()
   if size <= 0:  # Shortcut.
     return 0
-  if is_left:
-    tester = x.__le__  # x <= y.
-  else:
-    tester = x.__lt__  # x < y.
-  lo, hi, mid, cache = 0, size - 1, 1, []
+  # Not size - 1, that would skip a 1-byte last line (e.g. 'b' in 'a\nb').
+  lo, hi, mid, cache = 0, size, 1, []
   while lo < hi:
     mid = (lo + hi) >> 1
     midf, g, _ = _read_and_compare(cache, mid, f, size, tester)
@@ -194,6 +221,10 @@ def bisect_interval(f, x, y=None, is_open=False, size=None):
     `size'. These offsets contain the lines: start <= ofs < end. Trailing
     '\\n's are included in the interval (except at EOF if there was none).
   """
+  if _ext:
+    result = _ext.bisect_interval(f, x, y, is_open, size)
+    if result is not NotImplemented:
+      return result
   x = x.rstrip('\n')
   if y is None:
     y = x
@@ -206,6 +237,34 @@ def bisect_interval(f, x, y=None, is_open=False, size=None):
     return bisect_way(f, x, True, end), end
 
 
+def bisect_prefix(f, x, size=None):
+  """Return (start, end) offset pair for lines starting with x.
+
+  Prefix search, like `pts_lbsearch -p'. Args are like in bisect_interval.
+  """
+  if _ext:
+    result = _ext.bisect_prefix(f, x, size)
+    if result is not NotImplemented:
+      return result
+  x = x.rstrip('\n')
+  end = _bisect_tester(f, lambda y: x < y and not y.startswith(x), size)
+  return bisect_way(f, x, True, end), end
+
+
+def bisect_many(f, keys, is_left=True, size=None):
+  """Return the list of bisect_way(f, x, is_left, size) for x in keys.
+
+  With the C extension, it's faster than calling bisect_way for each key,
+  because the file is opened (and mapped) only once, and other Python
+  threads can run while it's searching.
+  """
+  if _ext:
+    result = _ext.bisect_many(f, keys, is_left, size)
+    if result is not NotImplemented:
+      return result
+  return [bisect_way(f, x, is_left, size) for x in keys]
+
+
 def main(argv):
   """Command-line tool for binary search in a line-sorted text file.
 
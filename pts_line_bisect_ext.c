@@ -0,0 +1,387 @@
+/*
+ * pts_line_bisect_ext.c: CPython extension for pts_line_bisect.py
+ * by pts@fazekas.hu
+ *
+ * License: GNU GPL v2 or newer, at your choice.
+ *
+ * Build it with compile_pyext.sh (it works with Python 2.7 and 3.x),
+ * and pts_line_bisect.py will use it automatically. It implements the
+ * functions of pts_line_bisect.py with the library API of pts_lbsearch.c
+ * (pts_lbsearch.h), so it doesn't need a Python method call and a
+ * lseek(2) and a read(2) for each probe.
+ *
+ * The file-like object f is searched in memory if it has getbuffer() (e.g.
+ * io.BytesIO in Python 3), without copying, otherwise its fileno() is
+ * searched (after flush()), with mmap(2) if possible. For other objects
+ * (e.g. cStringIO.StringIO, whose getvalue() would copy the whole file for
+ * each call), the functions return NotImplemented, and pts_line_bisect.py
+ * falls back to its Python implementation. The GIL is released while searching. The
+ * results are the same as of the Python implementation
+ * (pts_line_bisect_test.py checks this).
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <string.h>
+#include "pts_lbsearch.h"
+
+#if PY_MAJOR_VERSION < 3 && PY_MINOR_VERSION < 7
+#error Python 2.7 or later is needed.
+#endif
+
+/* The file to search, from a file-like object f. */
+typedef struct source {
+  PyObject *buffer;  /* f.getbuffer(), or NULL. */
+  Py_buffer view;  /* The data of buffer (to be searched). */
+  int fd;  /* f.fileno() if buffer is NULL. */
+  long long size;  /* Size limit, or -1. */
+} source;
+
+/* Sets up src from the file-like object f and the size limit (None or an
+ * int). Returns 1 on success, 0 if f is not supported, or -1 on error.
+ */
+static int source_init(source *src, PyObject *f, PyObject *size_obj) {
+  PyObject *result;
+  src->buffer = NULL;
+  src->fd = -1;
+  src->size = -1;
+  if (size_obj != Py_None) {
+    src->size = PyLong_AsLongLong(size_obj);
+    if (src->size == -1 && PyErr_Occurred()) return -1;
+    if (src->size < 0) src->size = 0;  /* Like size <= 0 in Python. */
+  }
+  if (PyObject_HasAttrString(f, "getbuffer")) {
+    /* The export also keeps f from being resized without the GIL. */
+    if (!(result = PyObject_CallMethod(f, (char*)"getbuffer", NULL))) {
+      return -1;
+    }
+    if (!PyObject_CheckBuffer(result)) {
+      Py_DECREF(result);
+      return 0;
+    }
+    if (PyObject_GetBuffer(result, &src->view, PyBUF_SIMPLE) != 0) {
+      Py_DECREF(result);
+      return -1;
+    }
+    src->buffer = result;
+    return 1;
+  }
+  if (!PyObject_HasAttrString(f, "fileno")) return 0;
+  if (!(result = PyObject_CallMethod(f, (char*)"fileno", NULL))) {
+    PyErr_Clear();  /* E.g. io.UnsupportedOperation. */
+    return 0;
+  }
+  src->fd = (int)PyLong_AsLong(result);
+  Py_DECREF(result);
+  if (src->fd == -1 && PyErr_Occurred()) return -1;
+  if (PyObject_HasAttrString(f, "flush")) {  /* Make writes visible. */
+    if (!(result = PyObject_CallMethod(f, (char*)"flush", NULL))) return -1;
+    Py_DECREF(result);
+  }
+  return 1;
+}
+
+static void source_free(source *src) {
+  if (src->buffer) {
+    PyBuffer_Release(&src->view);
+    Py_DECREF(src->buffer);
+  }
+}
+
+/* Opens src as *h_out. Can be called without the GIL. */
+static int source_open(const source *src, pts_lbsearch **h_out) {
+  Py_ssize_t size;
+  if (src->buffer) {
+    size = src->view.len;
+    if (src->size >= 0 && src->size < size) size = (Py_ssize_t)src->size;
+    return pts_lbsearch_open_memory(h_out, (const char*)src->view.buf,
+                                    (size_t)size, NULL);
+  }
+  return pts_lbsearch_open_fd(h_out, src->fd, src->size, NULL);
+}
+
+/* Sets the Python exception for the error code of the library. */
+static PyObject *set_error(int code) {
+  if (code == PTS_LBSEARCH_ENOMEM) return PyErr_NoMemory();
+  PyErr_SetString(
+      code == PTS_LBSEARCH_EIO ? PyExc_IOError : PyExc_ValueError,
+      pts_lbsearch_errmsg());
+  return NULL;
+}
+
+static PyObject *new_ofs(long long ofs) {
+#if PY_MAJOR_VERSION < 3
+  if (ofs == (long)ofs) return PyInt_FromLong((long)ofs);
+#endif
+  return PyLong_FromLongLong(ofs);
+}
+
+static PyObject *not_implemented(void) {
+  Py_INCREF(Py_NotImplemented);
+  return Py_NotImplemented;
+}
+
+/* Removes the trailing '\n's from x[:*xsize_io], like x.rstrip('\n'). */
+static void rstrip_nl(const char *x, Py_ssize_t *xsize_io) {
+  while (*xsize_io > 0 && x[*xsize_io - 1] == '\n') --*xsize_io;
+}
+
+/* Searches for x in f with mode (PTS_LBSEARCH_LEFT or PTS_LBSEARCH_RIGHT). */
+static PyObject *do_bisect(PyObject *f, const char *x, Py_ssize_t xsize,
+                           int mode, PyObject *size_obj) {
+  source src;
+  pts_lbsearch *h;
+  long long ofs = 0;
+  int code;
+  rstrip_nl(x, &xsize);
+  if ((code = source_init(&src, f, size_obj)) <= 0) {
+    return code < 0 ? NULL : not_implemented();
+  }
+  Py_BEGIN_ALLOW_THREADS
+  if ((code = source_open(&src, &h)) == PTS_LBSEARCH_OK) {
+    code = pts_lbsearch_bisect(h, x, (size_t)xsize, mode, &ofs);
+    pts_lbsearch_close(h);
+  }
+  Py_END_ALLOW_THREADS
+  source_free(&src);
+  return code == PTS_LBSEARCH_OK ? new_ofs(ofs) : set_error(code);
+}
+
+static PyObject *ext_bisect_way(PyObject *self, PyObject *args,
+                                PyObject *kwargs) {
+  static char *kwlist[] = {(char*)"f", (char*)"x", (char*)"is_left",
+                           (char*)"size", NULL};
+  PyObject *f, *is_left_obj, *size_obj = Py_None;
+  const char *x;
+  Py_ssize_t xsize;
+  int is_left;
+  (void)self;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Os#O|O:bisect_way", kwlist,
+                                   &f, &x, &xsize, &is_left_obj, &size_obj) ||
+      (is_left = PyObject_IsTrue(is_left_obj)) < 0) {
+    return NULL;
+  }
+  return do_bisect(f, x, xsize,
+                   is_left ? PTS_LBSEARCH_LEFT : PTS_LBSEARCH_RIGHT, size_obj);
+}
+
+static PyObject *ext_bisect_left(PyObject *self, PyObject *args,
+                                 PyObject *kwargs) {
+  static char *kwlist[] = {(char*)"f", (char*)"x", (char*)"size", NULL};
+  PyObject *f, *size_obj = Py_None;
+  const char *x;
+  Py_ssize_t xsize;
+  (void)self;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Os#|O:bisect_left", kwlist,
+                                   &f, &x, &xsize, &size_obj)) {
+    return NULL;
+  }
+  return do_bisect(f, x, xsize, PTS_LBSEARCH_LEFT, size_obj);
+}
+
+static PyObject *ext_bisect_right(PyObject *self, PyObject *args,
+                                  PyObject *kwargs) {
+  static char *kwlist[] = {(char*)"f", (char*)"x", (char*)"size", NULL};
+  PyObject *f, *size_obj = Py_None;
+  const char *x;
+  Py_ssize_t xsize;
+  (void)self;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Os#|O:bisect_right",
+                                   kwlist, &f, &x, &xsize, &size_obj)) {
+    return NULL;
+  }
+  return do_bisect(f, x, xsize, PTS_LBSEARCH_RIGHT, size_obj);
+}
+
+static PyObject *ext_bisect_interval(PyObject *self, PyObject *args,
+                                     PyObject *kwargs) {
+  static char *kwlist[] = {(char*)"f", (char*)"x", (char*)"y",
+                           (char*)"is_open", (char*)"size", NULL};
+  PyObject *f, *is_open_obj = Py_False, *size_obj = Py_None;
+  const char *x, *y = NULL;
+  Py_ssize_t xsize, ysize = 0;
+  source src;
+  pts_lbsearch *h;
+  long long start = 0, end = 0;
+  int is_open, code;
+  (void)self;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Os#|z#OO:bisect_interval",
+                                   kwlist, &f, &x, &xsize, &y, &ysize,
+                                   &is_open_obj, &size_obj) ||
+      (is_open = PyObject_IsTrue(is_open_obj)) < 0) {
+    return NULL;
+  }
+  rstrip_nl(x, &xsize);
+  if (y) {  /* Like y.strip('\n'). */
+    for (; ysize > 0 && *y == '\n'; ++y, --ysize) {}
+    rstrip_nl(y, &ysize);
+  } else {
+    y = x;
+    ysize = xsize;
+  }
+  if ((code = source_init(&src, f, size_obj)) <= 0) {
+    return code < 0 ? NULL : not_implemented();
+  }
+  Py_BEGIN_ALLOW_THREADS
+  if ((code = source_open(&src, &h)) == PTS_LBSEARCH_OK) {
+    code = pts_lbsearch_bisect(
+        h, y, (size_t)ysize,
+        is_open ? PTS_LBSEARCH_LEFT : PTS_LBSEARCH_RIGHT, &end);
+    if (code == PTS_LBSEARCH_OK && is_open && xsize == ysize &&
+        memcmp(x, y, xsize) == 0) {
+      start = end;
+    } else if (code == PTS_LBSEARCH_OK &&
+               (code = pts_lbsearch_bisect(h, x, (size_t)xsize,
+                                           PTS_LBSEARCH_LEFT, &start)) ==
+               PTS_LBSEARCH_OK && start > end) {
+      start = end;  /* Like searching for x before end. */
+    }
+    pts_lbsearch_close(h);
+  }
+  Py_END_ALLOW_THREADS
+  source_free(&src);
+  if (code != PTS_LBSEARCH_OK) return set_error(code);
+  return Py_BuildValue("(NN)", new_ofs(start), new_ofs(end));
+}
+
+static PyObject *ext_bisect_prefix(PyObject *self, PyObject *args,
+                                   PyObject *kwargs) {
+  static char *kwlist[] = {(char*)"f", (char*)"x", (char*)"size", NULL};
+  PyObject *f, *size_obj = Py_None;
+  const char *x;
+  Py_ssize_t xsize;
+  source src;
+  pts_lbsearch *h;
+  long long start = 0, end = 0;
+  int code;
+  (void)self;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Os#|O:bisect_prefix",
+                                   kwlist, &f, &x, &xsize, &size_obj)) {
+    return NULL;
+  }
+  rstrip_nl(x, &xsize);
+  if ((code = source_init(&src, f, size_obj)) <= 0) {
+    return code < 0 ? NULL : not_implemented();
+  }
+  Py_BEGIN_ALLOW_THREADS
+  if ((code = source_open(&src, &h)) == PTS_LBSEARCH_OK) {
+    code = pts_lbsearch_range(h, x, (size_t)xsize, NULL, 0,
+                              PTS_LBSEARCH_PREFIX, &start, &end);
+    pts_lbsearch_close(h);
+  }
+  Py_END_ALLOW_THREADS
+  source_free(&src);
+  if (code != PTS_LBSEARCH_OK) return set_error(code);
+  if (start > end) end = start;
+  return Py_BuildValue("(NN)", new_ofs(start), new_ofs(end));
+}
+
+static PyObject *ext_bisect_many(PyObject *self, PyObject *args,
+                                 PyObject *kwargs) {
+  static char *kwlist[] = {(char*)"f", (char*)"keys", (char*)"is_left",
+                           (char*)"size", NULL};
+  PyObject *f, *keys_obj, *is_left_obj = Py_True, *size_obj = Py_None;
+  PyObject *keys, *result = NULL;
+  const char **xs = NULL;
+  Py_ssize_t *xsizes = NULL, count, i;
+  long long *ofss = NULL;
+  source src;
+  pts_lbsearch *h;
+  int is_left, code;
+  (void)self;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|OO:bisect_many", kwlist,
+                                   &f, &keys_obj, &is_left_obj, &size_obj) ||
+      (is_left = PyObject_IsTrue(is_left_obj)) < 0) {
+    return NULL;
+  }
+  /* A tuple keeps the keys alive (and unchanged) without the GIL. */
+  if (!(keys = PySequence_Tuple(keys_obj))) return NULL;
+  count = PyTuple_GET_SIZE(keys);
+  if (!(xs = (const char**)PyMem_Malloc(sizeof(*xs) * (count + 1))) ||
+      !(xsizes = (Py_ssize_t*)PyMem_Malloc(sizeof(*xsizes) * (count + 1))) ||
+      !(ofss = (long long*)PyMem_Malloc(sizeof(*ofss) * (count + 1)))) {
+    PyErr_NoMemory();
+    goto done;
+  }
+  for (i = 0; i < count; ++i) {
+    if (!PyArg_Parse(PyTuple_GET_ITEM(keys, i), "s#", xs + i, xsizes + i)) {
+      goto done;
+    }
+    rstrip_nl(xs[i], xsizes + i);
+  }
+  if ((code = source_init(&src, f, size_obj)) <= 0) {
+    if (code == 0) result = not_implemented();
+    goto done;
+  }
+  Py_BEGIN_ALLOW_THREADS
+  if ((code = source_open(&src, &h)) == PTS_LBSEARCH_OK) {
+    for (i = 0; i < count && code == PTS_LBSEARCH_OK; ++i) {
+      code = pts_lbsearch_bisect(
+          h, xs[i], (size_t)xsizes[i],
+          is_left ? PTS_LBSEARCH_LEFT : PTS_LBSEARCH_RIGHT, ofss + i);
+    }
+    pts_lbsearch_close(h);
+  }
+  Py_END_ALLOW_THREADS
+  source_free(&src);
+  if (code != PTS_LBSEARCH_OK) {
+    set_error(code);
+  } else if ((result = PyList_New(count)) != NULL) {
+    for (i = 0; i < count; ++i) {
+      PyObject *ofs = new_ofs(ofss[i]);
+      if (!ofs) {
+        Py_DECREF(result);
+        result = NULL;
+        break;
+      }
+      PyList_SET_ITEM(result, i, ofs);
+    }
+  }
+ done:
+  PyMem_Free(ofss);
+  PyMem_Free(xsizes);
+  PyMem_Free(xs);
+  Py_DECREF(keys);
+  return result;
+}
+
+static PyMethodDef methods[] = {
+    {"bisect_way", (PyCFunction)(void (*)(void))ext_bisect_way,
+     METH_VARARGS | METH_KEYWORDS,
+     "bisect_way(f, x, is_left, size=None): Like in pts_line_bisect."},
+    {"bisect_left", (PyCFunction)(void (*)(void))ext_bisect_left,
+     METH_VARARGS | METH_KEYWORDS,
+     "bisect_left(f, x, size=None): Like in pts_line_bisect."},
+    {"bisect_right", (PyCFunction)(void (*)(void))ext_bisect_right,
+     METH_VARARGS | METH_KEYWORDS,
+     "bisect_right(f, x, size=None): Like in pts_line_bisect."},
+    {"bisect_interval", (PyCFunction)(void (*)(void))ext_bisect_interval,
+     METH_VARARGS | METH_KEYWORDS,
+     "bisect_interval(f, x, y=None, is_open=False, size=None): Like in "
+     "pts_line_bisect."},
+    {"bisect_prefix", (PyCFunction)(void (*)(void))ext_bisect_prefix,
+     METH_VARARGS | METH_KEYWORDS,
+     "bisect_prefix(f, x, size=None): Like in pts_line_bisect."},
+    {"bisect_many", (PyCFunction)(void (*)(void))ext_bisect_many,
+     METH_VARARGS | METH_KEYWORDS,
+     "bisect_many(f, keys, is_left=True, size=None): Like in "
+     "pts_line_bisect, without holding the GIL."},
+    {NULL, NULL, 0, NULL}
+};
+
+#define MODULE_DOC "C implementation of pts_line_bisect."
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef module_def = {
+    PyModuleDef_HEAD_INIT, "pts_line_bisect_ext", MODULE_DOC, -1, methods,
+    NULL, NULL, NULL, NULL
+};
+
+PyMODINIT_FUNC PyInit_pts_line_bisect_ext(void) {
+  return PyModule_Create(&module_def);
+}
+#else
+PyMODINIT_FUNC initpts_line_bisect_ext(void) {
+  Py_InitModule3("pts_line_bisect_ext", methods, MODULE_DOC);
+}
+#endif
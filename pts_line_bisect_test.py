@@ -11,6 +11,9 @@ exec python -- "$0" ${1+"$@"}; exit 1
 """
 
 import cStringIO
+import io
+import tempfile
+import time
 import unittest
 
 import pts_line_bisect
@@ -137,6 +140,23 @@ class PtsLineBisect0Test(unittest.TestCase):
         self.bi('10', '30'), '10ten\n20twenty\n30\n30\n30\n30\n30\n')
     self.assertEqual(self.bi('10', '30', True), '10ten\n20twenty\n')
 
+  def testBisectPrefix(self):
+    bisect_prefix = pts_line_bisect.bisect_prefix
+    self.assertEqual(bisect_prefix(self.f, '30', self.size), (15, 30))
+    self.assertEqual(bisect_prefix(self.f, '30', self.xsize), (15, 30))
+    self.assertEqual(bisect_prefix(self.f, '2', self.size), (6, 15))
+    self.assertEqual(bisect_prefix(self.f, '4', self.size), (30, self.size))
+    self.assertEqual(bisect_prefix(self.f, '5', self.size),
+                     (self.size, self.size))
+
+  def testBisectMany(self):
+    bisect_many = pts_line_bisect.bisect_many
+    keys = ('30', '10ten', '32', '')
+    self.assertEqual(bisect_many(self.f, keys, True, self.size),
+                     [15, 0, 30, 0])
+    self.assertEqual(bisect_many(self.f, keys, False, self.xsize),
+                     [30, 6, 30, 0])
+
 
 class PtsLineBisect1Test(PtsLineBisect0Test):
   EXTRA_LEN = 1
@@ -154,5 +174,100 @@ class PtsLineBisect42Test(PtsLineBisect0Test):
   EXTRA_LEN = 42
 
 
+def mini_bisect_way(data, x, is_left, size):
+  """Small and slow implementation of bisect_way on data[:size]."""
+  x = x.rstrip('\n')
+  if size is not None:
+    data = data[:size]
+  ofs = 0
+  for line in data.split('\n'):
+    if ofs == len(data):
+      break
+    if (x <= line if is_left else x < line):
+      return ofs
+    ofs += len(line) + 1
+  return len(data)
+
+
+class PtsLineBisectExtTest(unittest.TestCase):
+  """Checks that the C extension (if built) and the Python code agree."""
+
+  DATAS = ('', '\n', '\n\n', 'a', 'a\n', 'b\nb', 'a\nb', 'a\na\na',
+           'a\nab\nb\n', 'a\nab\nb', 'a\naa\naaa\nb\nbb\nc',
+           '\na\nb\nc\n', 'aa\naa\nab\nb\nba\nbab\nbb\nc\nc\nc')
+  KEYS = ('', 'a', 'aa', 'ab', 'b', 'ba', 'bb', 'c', 'd', 'a\n')
+
+  def setUp(self):
+    # mini_bisect_way checks the results instead of new_bisect_way.
+    pts_line_bisect.bisect_way = old_bisect_way
+
+  def tearDown(self):
+    pts_line_bisect.bisect_way = new_bisect_way
+
+  def results(self, f, data):
+    """Returns the results of all functions for all keys and sizes."""
+    results = []
+    for size in [None] + range(len(data) + 1):
+      # Truncating the last line may make data[:size] unsorted.
+      lines = data[:size].split('\n')
+      if lines[-1] == '':
+        lines.pop()
+      if lines != sorted(lines):
+        continue
+      for x in self.KEYS:
+        for is_left in (True, False):
+          fofs = pts_line_bisect.bisect_way(f, x, is_left, size)
+          self.assertEqual(fofs, mini_bisect_way(data, x, is_left, size),
+                           (data, x, is_left, size, fofs))
+          results.append(fofs)
+        for y in (None,) + self.KEYS:
+          for is_open in (False, True):
+            results.append(pts_line_bisect.bisect_interval(
+                f, x, y, is_open, size))
+        results.append(pts_line_bisect.bisect_prefix(f, x, size))
+      for is_left in (True, False):
+        results.append(pts_line_bisect.bisect_many(
+            f, self.KEYS, is_left, size))
+    return results
+
+  def testExtAndPython(self):
+    ext = pts_line_bisect._ext
+    tmp = tempfile.TemporaryFile()
+    for data in self.DATAS:
+      tmp.seek(0)
+      tmp.truncate()
+      tmp.write(data)
+      tmp.flush()
+      for f in (cStringIO.StringIO(data), tmp):
+        results = self.results(f, data)
+        pts_line_bisect._ext = None
+        try:
+          self.assertEqual(self.results(f, data), results, (data, f))
+        finally:
+          pts_line_bisect._ext = ext
+    tmp.close()
+
+  def bisect_time(self, f):
+    """Returns the time of many searches in f, best of 3."""
+    times = []
+    for _ in xrange(3):
+      start = time.time()
+      for i in xrange(200):
+        pts_line_bisect.bisect_left(f, '%07d' % (i * 4999))
+      times.append(time.time() - start)
+    return min(times)
+
+  def testInMemoryScaling(self):
+    # The time of a search in an in-memory file must not be proportional to
+    # the file size (e.g. by copying it with getvalue()).
+    small = ''.join('%07d\n' % i for i in xrange(1000))
+    large = ''.join('%07d\n' % i for i in xrange(1 << 21))  # 16 MiB.
+    for cls in (cStringIO.StringIO, io.BytesIO):
+      small_time = self.bisect_time(cls(small))
+      large_time = self.bisect_time(cls(large))
+      self.assertTrue(large_time < small_time * 10 + 0.05,
+                      (cls, small_time, large_time))
+
+
 if __name__ == '__main__':
   unittest.main()